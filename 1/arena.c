@@ -0,0 +1,45 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+int
+arena_create(struct arena *a, size_t size)
+{
+	memset(a, 0, sizeof(*a));
+	if (size == 0)
+		return 0;
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+	a->base = base;
+	a->size = size;
+	return 0;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	if (a->base != NULL)
+		munmap(a->base, a->size);
+	memset(a, 0, sizeof(*a));
+}
+
+size_t
+arena_size_of(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	size = arena_size_of(size);
+	size_t offset = __atomic_fetch_add(&a->used, size, __ATOMIC_RELAXED);
+	if (offset > a->size || a->size - offset < size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return a->base + offset;
+}
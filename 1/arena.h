@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Bump allocator for the objects which live as long as the whole
+ * run. The memory is one mapping reserved up front: an allocation
+ * only moves the pointer, and everything is freed at once. The pages
+ * are committed when touched, so a reservation by the upper bound of
+ * the needs costs address space, not RAM.
+ */
+
+enum {
+	/** Allocations are aligned by the cache line. */
+	ARENA_ALIGN = 64,
+};
+
+struct arena {
+	char *base;
+	size_t size;
+	/** Bytes taken, moved atomically. */
+	size_t used;
+};
+
+/**
+ * Reserve @a size bytes.
+ * @retval 0 Success.
+ * @retval -1 Error, see errno.
+ */
+int
+arena_create(struct arena *a, size_t size);
+
+void
+arena_destroy(struct arena *a);
+
+/**
+ * Take @a size bytes, aligned by ARENA_ALIGN. Can be called from
+ * many threads at once. The arena does not grow.
+ * @retval NULL Not enough room left.
+ */
+void *
+arena_alloc(struct arena *a, size_t size);
+
+/** Room an allocation of @a size bytes takes, with the alignment. */
+size_t
+arena_size_of(size_t size);
@@ -0,0 +1,1656 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libcoro.h"
+#include "libcoro_stackless.h"
+#include "libcoro_trace.h"
+#include "numio.h"
+#include "numsort.h"
+#include "extsort.h"
+
+/**
+ * Microbenchmarks of libcoro. Run all of them or only those whose
+ * names are given in the command line:
+ *
+ *     $> ./bench yield
+ */
+
+static long long
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** How many times each coroutine yields in the yield benchmark. */
+enum {
+	BENCH_YIELD_COUNT = 2000000,
+};
+
+static int
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/**
+ * Two coroutines ping-pong via coro_yield(). Each yield is exactly
+ * one context switch, so the result is the switch cost - with and
+ * without the work time accounting.
+ */
+static void
+bench_yield(void)
+{
+	for (int is_accounting = 0; is_accounting <= 1; ++is_accounting) {
+		int count = BENCH_YIELD_COUNT;
+		coro_sched_init();
+		coro_sched_set_accounting(is_accounting);
+		coro_new(bench_yield_f, &count);
+		coro_new(bench_yield_f, &count);
+		long long start = bench_now_ns();
+		struct coro *c;
+		long long switches = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		long long duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("yield: %lld switches, %.2f ns per yield, "
+		       "accounting %s\n", switches,
+		       (double)duration / switches,
+		       is_accounting ? "on" : "off");
+	}
+}
+
+/** Coroutines created in one batch of the create benchmark. */
+enum {
+	BENCH_CREATE_BATCH = 1000,
+	BENCH_CREATE_ROUNDS = 100,
+};
+
+static int
+bench_create_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/**
+ * Create a batch of empty coroutines, run them all to the end and
+ * delete them. Creation is measured separately from the full
+ * lifecycle.
+ */
+static void
+bench_create(void)
+{
+	coro_sched_init();
+	long long create_time = 0;
+	long long start = bench_now_ns();
+	for (int i = 0; i < BENCH_CREATE_ROUNDS; ++i) {
+		long long create_start = bench_now_ns();
+		for (int j = 0; j < BENCH_CREATE_BATCH; ++j) {
+			if (coro_new(bench_create_f, NULL) == NULL) {
+				perror("coro_new");
+				exit(-1);
+			}
+		}
+		create_time += bench_now_ns() - create_start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	long long count = BENCH_CREATE_BATCH * BENCH_CREATE_ROUNDS;
+	printf("create: %lld coroutines, %.2f ns per coro_new, "
+	       "%.0f coroutines/s with run and delete\n", count,
+	       (double)create_time / count, count * 1e9 / duration);
+}
+
+/**
+ * Idle coroutines in the stack benchmark. More than vm.max_map_count
+ * allows guarded stacks for, so the slabs are measured too.
+ */
+enum {
+	BENCH_STACK_COUNT = 100000,
+};
+
+/** Resident set size of the process in bytes. */
+static long long
+bench_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long long size = 0, resident = 0;
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%lld %lld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Create lots of coroutines with the default 1MB stacks and see how
+ * much memory they really take while idle.
+ */
+static void
+bench_stack(void)
+{
+	coro_sched_init();
+	long long rss = bench_rss();
+	long long start = bench_now_ns();
+	for (int i = 0; i < BENCH_STACK_COUNT; ++i) {
+		if (coro_new(bench_create_f, NULL) == NULL) {
+			perror("coro_new");
+			exit(-1);
+		}
+	}
+	long long duration = bench_now_ns() - start;
+	rss = bench_rss() - rss;
+	printf("stack: %d idle coroutines, %.2f ns per coro_new, "
+	       "%lld KB RSS total, %.2f KB per coroutine\n",
+	       BENCH_STACK_COUNT, (double)duration / BENCH_STACK_COUNT,
+	       rss / 1024, (double)rss / 1024 / BENCH_STACK_COUNT);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_destroy();
+}
+
+/** Yields made by all coroutines together in the scale benchmark. */
+enum {
+	BENCH_SCALE_SWITCHES = 4000000,
+	BENCH_SCALE_STACK_SIZE = 16 * 1024,
+};
+
+/**
+ * The same amount of yields spread over more and more coroutines.
+ * With O(1) queues the cost of a switch should stay flat, up to
+ * cache and TLB misses on cold stacks.
+ */
+static void
+bench_scale(void)
+{
+	for (int count = 10; count <= 100000; count *= 10) {
+		int yield_count = BENCH_SCALE_SWITCHES / count;
+		coro_sched_init();
+		coro_sched_set_accounting(false);
+		for (int i = 0; i < count; ++i) {
+			if (coro_new_with_stack(bench_yield_f, &yield_count,
+						BENCH_SCALE_STACK_SIZE) == NULL) {
+				perror("coro_new_with_stack");
+				exit(-1);
+			}
+		}
+		long long start = bench_now_ns();
+		long long switches = 0;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		long long duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("scale: %d coroutines, %lld switches, "
+		       "%.2f ns per yield\n", count, switches,
+		       (double)duration / switches);
+	}
+}
+
+/** CPU-bound coroutines of the M:N benchmark. */
+enum {
+	BENCH_MT_CORO_COUNT = 64,
+	BENCH_MT_ITERATIONS = 2000000,
+	BENCH_MT_YIELD_PERIOD = 1000,
+};
+
+static int
+bench_mt_f(void *arg)
+{
+	unsigned *result = arg;
+	unsigned x = 1;
+	for (int i = 0; i < BENCH_MT_ITERATIONS; ++i) {
+		x = x * 1103515245 + 12345;
+		if (i % BENCH_MT_YIELD_PERIOD == 0)
+			coro_yield();
+	}
+	*result = x;
+	return 0;
+}
+
+/** Run the CPU-bound coroutines on @a thread_count threads. */
+static void
+bench_mt_run(int thread_count)
+{
+	static unsigned results[BENCH_MT_CORO_COUNT];
+	if (thread_count == 0)
+		coro_sched_init();
+	else
+		coro_sched_init_mt(thread_count);
+	long long start = bench_now_ns();
+	for (int i = 0; i < BENCH_MT_CORO_COUNT; ++i)
+		coro_new(bench_mt_f, &results[i]);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("mt: %d threads%s, %d coroutines, %.2f ms\n", thread_count,
+	       thread_count == 0 ? " (single-threaded mode)" : "",
+	       BENCH_MT_CORO_COUNT, duration / 1e6);
+}
+
+/**
+ * The same CPU-bound job in the single-threaded mode and on 1, 2,
+ * 4, ... worker threads up to the number of cores.
+ */
+static void
+bench_mt(void)
+{
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	bench_mt_run(0);
+	for (int i = 1; i <= cpu_count || i == 1; i *= 2)
+		bench_mt_run(i);
+}
+
+/** Connections and round trips of the I/O benchmark. */
+enum {
+	BENCH_IO_CONN_COUNT = 100,
+	BENCH_IO_ROUND_TRIPS = 1000,
+};
+
+static const char *
+bench_io_backend_name(enum coro_io_backend backend)
+{
+	return backend == CORO_IO_URING ? "io_uring" : "epoll";
+}
+
+struct bench_io_server {
+	int listen_fd;
+	int accepted;
+};
+
+static int
+bench_io_echo_f(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char byte;
+	while (coro_read(fd, &byte, 1) == 1) {
+		if (coro_write(fd, &byte, 1) != 1)
+			break;
+	}
+	close(fd);
+	return 0;
+}
+
+static int
+bench_io_accept_f(void *arg)
+{
+	struct bench_io_server *server = arg;
+	while (server->accepted < BENCH_IO_CONN_COUNT) {
+		int fd = coro_accept(server->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			return -1;
+		}
+		++server->accepted;
+		coro_new_with_stack(bench_io_echo_f, (void *)(intptr_t)fd,
+				    64 * 1024);
+	}
+	return 0;
+}
+
+static int
+bench_io_client_f(void *arg)
+{
+	struct sockaddr_in *addr = arg;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0 || coro_connect(fd, (struct sockaddr *)addr,
+				   sizeof(*addr)) != 0) {
+		perror("connect");
+		return -1;
+	}
+	char byte = 'x';
+	for (int i = 0; i < BENCH_IO_ROUND_TRIPS; ++i) {
+		if (coro_write(fd, &byte, 1) != 1 ||
+		    coro_read(fd, &byte, 1) != 1) {
+			perror("echo");
+			break;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * Loopback echo server and clients, all in coroutines of one
+ * scheduler. The scheduler sleeps in epoll_wait() whenever all of
+ * them wait for the network.
+ */
+static bool
+bench_io_echo(enum coro_io_backend backend)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	struct bench_io_server server;
+	server.accepted = 0;
+	server.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (server.listen_fd < 0 ||
+	    bind(server.listen_fd, (struct sockaddr *)&addr, len) != 0 ||
+	    listen(server.listen_fd, BENCH_IO_CONN_COUNT) != 0 ||
+	    getsockname(server.listen_fd, (struct sockaddr *)&addr,
+			&len) != 0) {
+		perror("listen");
+		return false;
+	}
+	coro_sched_init();
+	if (coro_sched_set_io_backend(backend) != backend) {
+		printf("io: io_uring is not available\n");
+		coro_sched_destroy();
+		close(server.listen_fd);
+		return false;
+	}
+	coro_new(bench_io_accept_f, &server);
+	for (int i = 0; i < BENCH_IO_CONN_COUNT; ++i)
+		coro_new_with_stack(bench_io_client_f, &addr, 64 * 1024);
+	long long start = bench_now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	close(server.listen_fd);
+	long long count = (long long)BENCH_IO_CONN_COUNT * BENCH_IO_ROUND_TRIPS;
+	printf("io: %s, %d connections, %lld round trips, %.0f round "
+	       "trips/s\n", bench_io_backend_name(backend),
+	       BENCH_IO_CONN_COUNT, count, count * 1e9 / duration);
+	return true;
+}
+
+enum {
+	/** Files read at once, and their size. */
+	BENCH_IO_FILE_COUNT = 256,
+	BENCH_IO_FILE_SIZE = 256 * 1024,
+	/** Bytes read by one call. */
+	BENCH_IO_FILE_CHUNK = 16 * 1024,
+};
+
+static int
+bench_io_file_f(void *arg)
+{
+	const char *path = arg;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	char buf[BENCH_IO_FILE_CHUNK];
+	while (coro_read(fd, buf, sizeof(buf)) > 0)
+		;
+	close(fd);
+	return 0;
+}
+
+/**
+ * A coroutine per file reads it in chunks, like the sort does with
+ * its inputs. The files are in the page cache, so this is the cost
+ * of the calls, not of the disk.
+ */
+static void
+bench_io_files(enum coro_io_backend backend)
+{
+	static char paths[BENCH_IO_FILE_COUNT][64];
+	char *data = calloc(1, BENCH_IO_FILE_SIZE);
+	for (int i = 0; i < BENCH_IO_FILE_COUNT; ++i) {
+		snprintf(paths[i], sizeof(paths[i]), "/tmp/coro_bench_%d_%d",
+			 (int)getpid(), i);
+		int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, data, BENCH_IO_FILE_SIZE) !=
+			      BENCH_IO_FILE_SIZE) {
+			perror(paths[i]);
+			exit(-1);
+		}
+		close(fd);
+	}
+	free(data);
+	coro_sched_init();
+	coro_sched_set_io_backend(backend);
+	for (int i = 0; i < BENCH_IO_FILE_COUNT; ++i)
+		coro_new_with_stack(bench_io_file_f, paths[i], 64 * 1024);
+	long long start = bench_now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	for (int i = 0; i < BENCH_IO_FILE_COUNT; ++i)
+		unlink(paths[i]);
+	long long calls = (long long)BENCH_IO_FILE_COUNT *
+			  (BENCH_IO_FILE_SIZE / BENCH_IO_FILE_CHUNK + 1);
+	printf("io: %s, %d files of %d KB, %.0f ns per read, %.0f MB/s\n",
+	       bench_io_backend_name(backend), BENCH_IO_FILE_COUNT,
+	       BENCH_IO_FILE_SIZE / 1024, (double)duration / calls,
+	       (double)BENCH_IO_FILE_COUNT * BENCH_IO_FILE_SIZE * 1e9 /
+	       duration / (1 << 20));
+}
+
+/** Network and file I/O with each backend. */
+static void
+bench_io(void)
+{
+	bench_io_echo(CORO_IO_EPOLL);
+	bench_io_files(CORO_IO_EPOLL);
+	if (bench_io_echo(CORO_IO_URING))
+		bench_io_files(CORO_IO_URING);
+}
+
+enum {
+	/** Messages passed by each producer in the chan benchmark. */
+	BENCH_CHAN_MSG_COUNT = 1000000,
+	/** Producers and consumers of one channel. */
+	BENCH_CHAN_PEER_COUNT = 4,
+};
+
+struct bench_chan_arg {
+	struct coro_chan *ch;
+	struct coro_wait_group *producers;
+	/** Protects sum, taken once per consumer. */
+	struct coro_mutex *lock;
+	long long sum;
+};
+
+static int
+bench_chan_producer_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	for (intptr_t i = 1; i <= BENCH_CHAN_MSG_COUNT; ++i)
+		coro_chan_send(a->ch, (void *)i);
+	coro_wait_group_done(a->producers);
+	return 0;
+}
+
+static int
+bench_chan_consumer_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	void *msg;
+	long long sum = 0;
+	while (coro_chan_recv(a->ch, &msg) == 0)
+		sum += (intptr_t)msg;
+	coro_mutex_acquire(a->lock);
+	a->sum += sum;
+	coro_mutex_release(a->lock);
+	return 0;
+}
+
+static int
+bench_chan_closer_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	coro_wait_group_wait(a->producers);
+	coro_chan_close(a->ch);
+	return 0;
+}
+
+/**
+ * Producers and consumers of one channel. A small capacity means
+ * a park and a wakeup almost on each message, a big one lets the
+ * coroutines pass messages in batches between the switches.
+ */
+static void
+bench_chan(void)
+{
+	const int capacities[] = {1, 16, 256};
+	for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]);
+	     ++i) {
+		struct bench_chan_arg a;
+		a.ch = coro_chan_new(capacities[i]);
+		a.producers = coro_wait_group_new();
+		a.lock = coro_mutex_new();
+		a.sum = 0;
+		coro_sched_init();
+		coro_sched_set_accounting(false);
+		coro_wait_group_add(a.producers, BENCH_CHAN_PEER_COUNT);
+		for (int j = 0; j < BENCH_CHAN_PEER_COUNT; ++j) {
+			coro_new(bench_chan_producer_f, &a);
+			coro_new(bench_chan_consumer_f, &a);
+		}
+		coro_new(bench_chan_closer_f, &a);
+		long long start = bench_now_ns();
+		struct coro *c;
+		int finished = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			coro_delete(c);
+			++finished;
+		}
+		long long duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		long long count = (long long)BENCH_CHAN_MSG_COUNT *
+				  BENCH_CHAN_PEER_COUNT;
+		long long expected = (long long)BENCH_CHAN_MSG_COUNT *
+				     (BENCH_CHAN_MSG_COUNT + 1) / 2 *
+				     BENCH_CHAN_PEER_COUNT;
+		if (finished != 2 * BENCH_CHAN_PEER_COUNT + 1 ||
+		    a.sum != expected)
+			printf("chan: wrong result\n");
+		printf("chan: capacity %d, %lld messages, %.2f ns per "
+		       "message\n", capacities[i], count,
+		       (double)duration / count);
+		coro_mutex_delete(a.lock);
+		coro_wait_group_delete(a.producers);
+		coro_chan_delete(a.ch);
+	}
+}
+
+enum {
+	/** Sleeping coroutines of the timer benchmark. */
+	BENCH_TIMER_COUNT = 10000,
+	/** Sleeps of each of them, up to 100ms each. */
+	BENCH_TIMER_ROUNDS = 3,
+	/** Messages passed with and without a timeout on each recv. */
+	BENCH_TIMER_MSG_COUNT = 1000000,
+};
+
+struct bench_timer_stat {
+	long long late_sum;
+	long long late_max;
+	long long sleep_count;
+};
+
+static int
+bench_timer_sleep_f(void *arg)
+{
+	struct bench_timer_stat *stat = arg;
+	for (int i = 0; i < BENCH_TIMER_ROUNDS; ++i) {
+		long long usec = 1000 + rand() % 100000;
+		long long start = bench_now_ns();
+		coro_sleep(usec);
+		long long late = bench_now_ns() - start - usec * 1000;
+		stat->late_sum += late;
+		if (late > stat->late_max)
+			stat->late_max = late;
+		++stat->sleep_count;
+	}
+	return 0;
+}
+
+static int
+bench_timer_recv_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	void *msg;
+	while (coro_chan_recv_timeout(ch, &msg, 1000000) == 0)
+		;
+	return 0;
+}
+
+static int
+bench_timer_recv_no_timeout_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	void *msg;
+	while (coro_chan_recv(ch, &msg) == 0)
+		;
+	return 0;
+}
+
+static int
+bench_timer_send_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	for (int i = 0; i < BENCH_TIMER_MSG_COUNT; ++i)
+		coro_chan_send(ch, NULL);
+	coro_chan_close(ch);
+	return 0;
+}
+
+/**
+ * Many coroutines sleep for random times - how late they are woken
+ * up. Then a receiver parks on each message with and without a
+ * timeout, which shows the cost of arming and cancelling a timer.
+ */
+static void
+bench_timer(void)
+{
+	struct bench_timer_stat stat;
+	memset(&stat, 0, sizeof(stat));
+	coro_sched_init();
+	for (int i = 0; i < BENCH_TIMER_COUNT; ++i)
+		coro_new_with_stack(bench_timer_sleep_f, &stat, 16 * 1024);
+	long long start = bench_now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("timer: %lld sleeps in %.0f ms, late by %.0f us on average, "
+	       "%.0f us max\n", stat.sleep_count, duration / 1e6,
+	       stat.late_sum / 1e3 / stat.sleep_count, stat.late_max / 1e3);
+
+	for (int has_timeout = 0; has_timeout <= 1; ++has_timeout) {
+		struct coro_chan *ch = coro_chan_new(1);
+		coro_sched_init();
+		coro_sched_set_accounting(false);
+		coro_new(has_timeout ? bench_timer_recv_f :
+			 bench_timer_recv_no_timeout_f, ch);
+		coro_new(bench_timer_send_f, ch);
+		start = bench_now_ns();
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		coro_chan_delete(ch);
+		printf("timer: recv %s timeout, %.2f ns per message\n",
+		       has_timeout ? "with" : "without",
+		       (double)duration / BENCH_TIMER_MSG_COUNT);
+	}
+}
+
+enum {
+	/** Stackless coroutines alive at once in the fan-out test. */
+	BENCH_STACKLESS_COUNT = 1000000,
+	/** Yields of each of them. */
+	BENCH_STACKLESS_YIELDS = 4,
+	/** Stackful coroutines to compare the memory with. */
+	BENCH_STACKFUL_COUNT = 20000,
+};
+
+struct bench_stackless_frame {
+	struct coro_frame base;
+	int i;
+	int count;
+};
+
+static enum coro_step
+bench_stackless_f(struct coro_frame *frame)
+{
+	struct bench_stackless_frame *f =
+		(struct bench_stackless_frame *)frame;
+	CORO_BEGIN(frame);
+	for (f->i = 0; f->i < f->count; ++f->i)
+		CORO_YIELD(frame);
+	CORO_END(frame, 0);
+}
+
+/** Run the scheduler till the end, return the switch count. */
+static long long
+bench_run_all(void)
+{
+	long long switches = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	return switches;
+}
+
+/**
+ * Stackless against stackful coroutines: the switch cost of a
+ * ping-pong pair, and memory per coroutine when there are lots of
+ * them - a million stackless ones, and as many stackful ones as the
+ * mappings limit allows comfortably. With few yields per stackful
+ * coroutine, the first touch of each stack dominates its switches.
+ */
+static void
+bench_stackless(void)
+{
+	struct bench_stackless_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.count = BENCH_YIELD_COUNT;
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	coro_new_stackless(bench_stackless_f, &frame, sizeof(frame));
+	coro_new_stackless(bench_stackless_f, &frame, sizeof(frame));
+	long long start = bench_now_ns();
+	long long switches = bench_run_all();
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("stackless: 2 stackless, %.2f ns per step\n",
+	       (double)duration / switches);
+
+	int count = BENCH_YIELD_COUNT;
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	coro_new(bench_yield_f, &count);
+	coro_new(bench_yield_f, &count);
+	start = bench_now_ns();
+	switches = bench_run_all();
+	duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("stackless: 2 stackful, %.2f ns per yield\n",
+	       (double)duration / switches);
+
+	frame.count = BENCH_STACKLESS_YIELDS;
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	long long rss = bench_rss();
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_STACKLESS_COUNT; ++i)
+		coro_new_stackless(bench_stackless_f, &frame, sizeof(frame));
+	duration = bench_now_ns() - start;
+	rss = bench_rss() - rss;
+	long long run_start = bench_now_ns();
+	switches = bench_run_all();
+	long long run_duration = bench_now_ns() - run_start;
+	coro_sched_destroy();
+	printf("stackless: %d stackless, %.0f bytes RSS and %.2f ns to "
+	       "create each, %.2f ns per step\n", BENCH_STACKLESS_COUNT,
+	       (double)rss / BENCH_STACKLESS_COUNT,
+	       (double)duration / BENCH_STACKLESS_COUNT,
+	       (double)run_duration / switches);
+
+	count = BENCH_STACKLESS_YIELDS;
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	rss = bench_rss();
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_STACKFUL_COUNT; ++i)
+		coro_new_with_stack(bench_yield_f, &count, 16 * 1024);
+	duration = bench_now_ns() - start;
+	rss = bench_rss() - rss;
+	run_start = bench_now_ns();
+	switches = bench_run_all();
+	run_duration = bench_now_ns() - run_start;
+	coro_sched_destroy();
+	printf("stackless: %d stackful, %.0f bytes RSS and %.2f ns to "
+	       "create each, %.2f ns per yield\n", BENCH_STACKFUL_COUNT,
+	       (double)rss / BENCH_STACKFUL_COUNT,
+	       (double)duration / BENCH_STACKFUL_COUNT,
+	       (double)run_duration / switches);
+}
+
+/** Events per thread kept by the trace benchmark. */
+enum {
+	BENCH_TRACE_CAPACITY = 1 << 16,
+};
+
+/**
+ * The yield ping-pong with tracing off and on. The difference is
+ * the cost of recording a switch - two events. With accounting on
+ * the clock read is shared by both.
+ */
+static void
+bench_trace(void)
+{
+	for (int is_accounting = 0; is_accounting <= 1; ++is_accounting) {
+		double cost[2];
+		for (int is_tracing = 0; is_tracing <= 1; ++is_tracing) {
+			int count = BENCH_YIELD_COUNT;
+			coro_sched_init();
+			coro_sched_set_accounting(is_accounting);
+			if (is_tracing)
+				coro_trace_start(BENCH_TRACE_CAPACITY);
+			coro_new(bench_yield_f, &count);
+			coro_new(bench_yield_f, &count);
+			long long start = bench_now_ns();
+			long long switches = bench_run_all();
+			long long duration = bench_now_ns() - start;
+			coro_trace_stop();
+			coro_sched_destroy();
+			cost[is_tracing] = (double)duration / switches;
+		}
+		printf("trace: accounting %s, %.2f ns per yield untraced, "
+		       "%.2f ns traced, %.2f ns per recorded switch\n",
+		       is_accounting ? "on" : "off", cost[0], cost[1],
+		       cost[1] - cost[0]);
+	}
+}
+
+enum {
+	/** Batch coroutines keeping the scheduler busy. */
+	BENCH_CLASS_BATCH = 16,
+	/** How long a batch coroutine runs between yields, in ns. */
+	BENCH_CLASS_SLICE = 20000,
+	/** Wakeups of the sleeper coroutine. */
+	BENCH_CLASS_WAKEUPS = 1000,
+	/** Latency coroutines in the starvation test. */
+	BENCH_CLASS_SPINNERS = 2,
+	/** Length of the starvation test, in ns. */
+	BENCH_CLASS_SPIN_TIME = 200000000,
+};
+
+struct bench_class_arg {
+	/** The coroutine being woken up, and its class. */
+	struct coro *sleeper;
+	enum coro_class sleeper_class;
+	bool is_sleeping;
+	long long wakeup_time;
+	/** Delays between a wakeup and the run, in ns. */
+	long long delays[BENCH_CLASS_WAKEUPS];
+	int delay_count;
+	bool is_stopped;
+	/** Runs of each class in the starvation test. */
+	long long runs[CORO_CLASS_COUNT];
+	long long stop_time;
+};
+
+struct bench_class_spinner {
+	struct bench_class_arg *arg;
+	enum coro_class cls;
+};
+
+static void
+bench_class_spin(long long nsec)
+{
+	long long end = bench_now_ns() + nsec;
+	while (bench_now_ns() < end)
+		;
+}
+
+static int
+bench_class_batch_f(void *arg)
+{
+	struct bench_class_arg *a = arg;
+	while (!a->is_stopped) {
+		bench_class_spin(BENCH_CLASS_SLICE);
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+bench_class_sleeper_f(void *arg)
+{
+	struct bench_class_arg *a = arg;
+	coro_set_class(coro_this(), a->sleeper_class);
+	while (!a->is_stopped) {
+		a->is_sleeping = true;
+		coro_suspend();
+		if (!a->is_stopped)
+			a->delays[a->delay_count++] =
+				bench_now_ns() - a->wakeup_time;
+	}
+	return 0;
+}
+
+/** A batch coroutine which also wakes the sleeper up. */
+static int
+bench_class_waker_f(void *arg)
+{
+	struct bench_class_arg *a = arg;
+	while (a->delay_count < BENCH_CLASS_WAKEUPS) {
+		bench_class_spin(BENCH_CLASS_SLICE);
+		if (a->is_sleeping) {
+			a->is_sleeping = false;
+			a->wakeup_time = bench_now_ns();
+			coro_wakeup(a->sleeper);
+		}
+		coro_yield();
+	}
+	a->is_stopped = true;
+	coro_wakeup(a->sleeper);
+	return 0;
+}
+
+static int
+bench_class_spinner_f(void *arg)
+{
+	struct bench_class_spinner *s = arg;
+	coro_set_class(coro_this(), s->cls);
+	coro_yield();
+	while (bench_now_ns() < s->arg->stop_time) {
+		++s->arg->runs[s->cls];
+		bench_class_spin(BENCH_CLASS_SLICE / 10);
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+bench_class_cmp(const void *l, const void *r)
+{
+	long long a = *(const long long *)l, b = *(const long long *)r;
+	return a < b ? -1 : a > b;
+}
+
+/**
+ * Wake-up delay of a coroutine woken up periodically while batch
+ * coroutines keep running and yielding. In the batch class it waits
+ * for the whole round, in the latency class it runs next. Then
+ * latency coroutines spin against the batch ones - the burst limit
+ * still leaves the batch class its share of runs.
+ */
+static void
+bench_class(void)
+{
+	struct bench_class_arg *a = malloc(sizeof(*a));
+	for (int cls = CORO_CLASS_BATCH; cls >= CORO_CLASS_LATENCY; --cls) {
+		memset(a, 0, sizeof(*a));
+		a->sleeper_class = cls;
+		coro_sched_init();
+		coro_sched_set_accounting(false);
+		a->sleeper = coro_new(bench_class_sleeper_f, a);
+		coro_new(bench_class_waker_f, a);
+		for (int i = 0; i < BENCH_CLASS_BATCH; ++i)
+			coro_new(bench_class_batch_f, a);
+		bench_run_all();
+		coro_sched_destroy();
+		int n = a->delay_count;
+		qsort(a->delays, n, sizeof(a->delays[0]), bench_class_cmp);
+		printf("class: %s sleeper, %d batch coroutines, wake-up delay "
+		       "p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		       cls == CORO_CLASS_LATENCY ? "latency" : "batch",
+		       BENCH_CLASS_BATCH + 1, a->delays[n / 2] / 1e3,
+		       a->delays[n * 99 / 100] / 1e3, a->delays[n - 1] / 1e3);
+	}
+
+	memset(a, 0, sizeof(*a));
+	struct bench_class_spinner spinners[BENCH_CLASS_BATCH +
+					    BENCH_CLASS_SPINNERS];
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	a->stop_time = bench_now_ns() + BENCH_CLASS_SPIN_TIME;
+	for (int i = 0; i < BENCH_CLASS_BATCH + BENCH_CLASS_SPINNERS; ++i) {
+		spinners[i].arg = a;
+		spinners[i].cls = i < BENCH_CLASS_SPINNERS ?
+				  CORO_CLASS_LATENCY : CORO_CLASS_BATCH;
+		coro_new(bench_class_spinner_f, &spinners[i]);
+	}
+	bench_run_all();
+	coro_sched_destroy();
+	long long runs = a->runs[CORO_CLASS_LATENCY] +
+			 a->runs[CORO_CLASS_BATCH];
+	printf("class: %d latency spinners against %d batch ones, "
+	       "batch got %.1f%% of %lld runs, 1/%d expected\n",
+	       BENCH_CLASS_SPINNERS, BENCH_CLASS_BATCH,
+	       a->runs[CORO_CLASS_BATCH] * 100.0 / runs, runs,
+	       CORO_LATENCY_BURST + 1);
+	free(a);
+}
+
+enum {
+	/** Empty calls for the round trip cost. */
+	BENCH_BLOCKING_CALLS = 100000,
+	/** Coroutines each making a slow call. */
+	BENCH_BLOCKING_SLOW = 64,
+	/** How long the slow call blocks, in us. */
+	BENCH_BLOCKING_SLEEP = 10000,
+};
+
+static void *
+bench_blocking_nop(void *arg)
+{
+	return arg;
+}
+
+static void *
+bench_blocking_sleep(void *arg)
+{
+	usleep(BENCH_BLOCKING_SLEEP);
+	return arg;
+}
+
+static int
+bench_blocking_nop_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < BENCH_BLOCKING_CALLS; ++i)
+		coro_blocking_call(bench_blocking_nop, NULL);
+	return 0;
+}
+
+static int
+bench_blocking_slow_f(void *arg)
+{
+	if (arg != NULL)
+		coro_blocking_call(bench_blocking_sleep, NULL);
+	else
+		bench_blocking_sleep(NULL);
+	return 0;
+}
+
+/**
+ * Round trip of an empty call through a helper thread, then
+ * coroutines making a slow blocking call each - in place, one after
+ * another, and offloaded, in parallel on the helper threads.
+ */
+static void
+bench_blocking(void)
+{
+	coro_sched_init();
+	coro_sched_set_accounting(false);
+	coro_new(bench_blocking_nop_f, NULL);
+	long long start = bench_now_ns();
+	bench_run_all();
+	long long duration = bench_now_ns() - start;
+	coro_sched_destroy();
+	printf("blocking: %.2f us per empty call round trip\n",
+	       duration / 1e3 / BENCH_BLOCKING_CALLS);
+
+	for (int is_offloaded = 0; is_offloaded <= 1; ++is_offloaded) {
+		coro_sched_init();
+		for (int i = 0; i < BENCH_BLOCKING_SLOW; ++i)
+			coro_new(bench_blocking_slow_f,
+				 is_offloaded ? &is_offloaded : NULL);
+		start = bench_now_ns();
+		bench_run_all();
+		duration = bench_now_ns() - start;
+		coro_sched_destroy();
+		printf("blocking: %d coroutines sleeping %d ms %s, %.1f ms "
+		       "total\n", BENCH_BLOCKING_SLOW,
+		       BENCH_BLOCKING_SLEEP / 1000,
+		       is_offloaded ? "offloaded" : "in place", duration / 1e6);
+	}
+}
+
+enum {
+	/** Numbers in the files of the load benchmark. */
+	BENCH_LOAD_COUNT = 100000000,
+};
+
+/** The way solution.c read the files before numio. */
+static int
+bench_load_fscanf(const char *path, struct numio_array *arr)
+{
+	memset(arr, 0, sizeof(*arr));
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	size_t capacity = 16;
+	int *data = malloc(capacity * sizeof(*data));
+	int value;
+	while (fscanf(f, "%d", &value) == 1) {
+		if (arr->size == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity * sizeof(*data));
+		}
+		data[arr->size++] = value;
+	}
+	fclose(f);
+	arr->data = data;
+	return 0;
+}
+
+static void
+bench_load_run(const char *name, const char *path,
+	       int (*load)(const char *path, struct numio_array *arr))
+{
+	struct numio_array arr;
+	long long start = bench_now_ns();
+	if (load(path, &arr) != 0) {
+		perror(path);
+		exit(-1);
+	}
+	/* Touch every number, a mapping may be faulted in lazily. */
+	long long sum = 0;
+	for (size_t i = 0; i < arr.size; ++i)
+		sum += arr.data[i];
+	long long duration = bench_now_ns() - start;
+	if (arr.size != BENCH_LOAD_COUNT) {
+		printf("load: %s read %zu numbers\n", name, arr.size);
+		exit(-1);
+	}
+	printf("load: %-8s %.0f ms, %.2f ns per number (sum %lld)\n", name,
+	       duration / 1e6, (double)duration / arr.size, sum);
+	numio_array_destroy(&arr);
+}
+
+/**
+ * Load the same random numbers from a text file - the old fscanf()
+ * way and with numio - and from a binary file. The files are just
+ * written, so they are in the page cache: it is the parsing cost,
+ * not the disk.
+ */
+static void
+bench_load(void)
+{
+	const char *text_path = "/tmp/bench_load.txt";
+	const char *bin_path = "/tmp/bench_load.bin";
+	int *data = malloc(BENCH_LOAD_COUNT * sizeof(*data));
+	if (data == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	srand(1);
+	for (int i = 0; i < BENCH_LOAD_COUNT; ++i)
+		data[i] = rand() - RAND_MAX / 2;
+	if (numio_save_text(text_path, data, BENCH_LOAD_COUNT) != 0 ||
+	    numio_save_binary(bin_path, data, BENCH_LOAD_COUNT) != 0) {
+		perror("save");
+		exit(-1);
+	}
+	free(data);
+	bench_load_run("fscanf", text_path, bench_load_fscanf);
+	bench_load_run("text", text_path, numio_load_text);
+	bench_load_run("binary", bin_path, numio_load_binary);
+	unlink(text_path);
+	unlink(bin_path);
+}
+
+enum {
+	/** Numbers in the text of the parse benchmark. */
+	BENCH_PARSE_COUNT = 20000000,
+};
+
+/**
+ * Parse in-memory text shaped like generator.py output: numbers up
+ * to 2^31 by default, and up to 10000 as in the test files, separated
+ * by single spaces. Compares the vectorized parser to the scalar one.
+ */
+static void
+bench_parse(void)
+{
+	const int maxes[] = {INT32_MAX, 10000};
+	int *data = malloc(BENCH_PARSE_COUNT * sizeof(*data));
+	char *text = malloc(BENCH_PARSE_COUNT * 12ULL);
+	if (data == NULL || text == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	/* Fault the pages in, not to count it as the parsing time. */
+	memset(data, 0, BENCH_PARSE_COUNT * sizeof(*data));
+	for (int m = 0; m < (int)(sizeof(maxes) / sizeof(maxes[0])); ++m) {
+		srand(1);
+		size_t size = 0;
+		for (int i = 0; i < BENCH_PARSE_COUNT; ++i) {
+			size += sprintf(text + size, "%d",
+					(int)(((long long)rand() << 16 ^ rand()) %
+					      ((long long)maxes[m] + 1)));
+			if (i + 1 != BENCH_PARSE_COUNT)
+				text[size++] = ' ';
+		}
+		for (int is_simd = 0; is_simd <= 1; ++is_simd) {
+			size_t count;
+			long long start = bench_now_ns();
+			int rc = is_simd ?
+				 numio_parse_text(text, size, data, &count) :
+				 numio_parse_text_scalar(text, size, data,
+							 &count);
+			long long duration = bench_now_ns() - start;
+			if (rc != 0 || count != BENCH_PARSE_COUNT) {
+				printf("parse: failed\n");
+				exit(-1);
+			}
+			printf("parse: max %d, %-6s %.2f GB/s, %.2f ns per "
+			       "number\n", maxes[m],
+			       is_simd ? "simd" : "scalar",
+			       (double)size / duration,
+			       (double)duration / count);
+		}
+	}
+	free(text);
+	free(data);
+}
+
+enum {
+	/** Numbers written by the save benchmark. */
+	BENCH_SAVE_COUNT = 10000000,
+};
+
+/** The way solution.c wrote result.txt before numio. */
+static int
+bench_save_fprintf(const char *path, const int *data, size_t size)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	for (size_t i = 0; i < size; i++) {
+		fprintf(f, "%d", data[i]);
+		if (i < size - 1)
+			fprintf(f, " ");
+		else
+			fprintf(f, "\n");
+	}
+	return fclose(f);
+}
+
+/** Write the same random numbers as text with fprintf() and numio. */
+static void
+bench_save(void)
+{
+	const char *path = "/tmp/bench_save.txt";
+	int *data = malloc(BENCH_SAVE_COUNT * sizeof(*data));
+	if (data == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	srand(1);
+	for (int i = 0; i < BENCH_SAVE_COUNT; ++i)
+		data[i] = rand() - RAND_MAX / 2;
+	for (int is_numio = 0; is_numio <= 1; ++is_numio) {
+		long long start = bench_now_ns();
+		int rc = is_numio ?
+			 numio_save_text(path, data, BENCH_SAVE_COUNT) :
+			 bench_save_fprintf(path, data, BENCH_SAVE_COUNT);
+		long long duration = bench_now_ns() - start;
+		struct stat st;
+		if (rc != 0 || stat(path, &st) != 0) {
+			perror(path);
+			exit(-1);
+		}
+		printf("save: %-7s %.0f ms, %.2f ns per number, %.1f MB/s\n",
+		       is_numio ? "numio" : "fprintf", duration / 1e6,
+		       (double)duration / BENCH_SAVE_COUNT,
+		       st.st_size * 1e3 / duration);
+	}
+	unlink(path);
+	free(data);
+}
+
+/** Longest stretch of sorting between two yield callbacks. */
+struct bench_sort_gap {
+	long long last;
+	long long max;
+};
+
+static void
+bench_sort_yield(void *arg)
+{
+	struct bench_sort_gap *gap = arg;
+	long long now = bench_now_ns();
+	if (now - gap->last > gap->max)
+		gap->max = now - gap->last;
+	gap->last = now;
+}
+
+static int
+bench_sort_cmp(const void *a, const void *b)
+{
+	int l = *(const int *)a;
+	int r = *(const int *)b;
+	return (l > r) - (l < r);
+}
+
+/**
+ * Sort random numbers of sizes from 16 to 10M with each numsort
+ * algorithm and qsort(), and find the longest run between two yield
+ * callbacks of numsort.
+ */
+static void
+bench_sort(void)
+{
+	const size_t sizes[] = {16, 100, 1000, 10000, 100000, 1000000,
+				10000000};
+	const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+	const size_t max_size = sizes[size_count - 1];
+	int *src = malloc(max_size * sizeof(*src));
+	int *data = malloc(max_size * sizeof(*data));
+	if (src == NULL || data == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	srand(1);
+	for (size_t i = 0; i < max_size; ++i)
+		src[i] = rand() - RAND_MAX / 2;
+	struct bench_sort_gap gap;
+	struct numsort sorter;
+	numsort_create(&sorter, bench_sort_yield, &gap);
+	for (int k = 0; k < size_count; ++k) {
+		size_t size = sizes[k];
+		/* Small arrays are sorted many times, to be measurable. */
+		size_t rounds = max_size / size < 1000 ? max_size / size : 1000;
+		printf("sort: %8zu numbers,", size);
+		for (int algo = NUMSORT_RADIX; algo <= NUMSORT_ALGO_COUNT;
+		     ++algo) {
+			long long duration = 0;
+			gap.max = 0;
+			for (size_t r = 0; r < rounds; ++r) {
+				size_t offset = size < max_size ?
+						r * size % (max_size - size) : 0;
+				memcpy(data, src + offset,
+				       size * sizeof(*data));
+				long long start = bench_now_ns();
+				gap.last = start;
+				if (algo == NUMSORT_ALGO_COUNT)
+					qsort(data, size, sizeof(*data),
+					      bench_sort_cmp);
+				else
+					numsort_sort(&sorter, data, size, algo);
+				duration += bench_now_ns() - start;
+			}
+			printf(" %s %.2f ns", algo == NUMSORT_ALGO_COUNT ?
+			       "qsort" : numsort_algo_name(algo),
+			       (double)duration / rounds / size);
+			if (size == max_size && algo != NUMSORT_ALGO_COUNT)
+				printf(" (yield gap %.0f us)", gap.max / 1e3);
+		}
+		printf(" per number\n");
+	}
+	numsort_destroy(&sorter);
+	free(data);
+	free(src);
+}
+
+enum {
+	/** Numbers in all the runs of the merge benchmark. */
+	BENCH_MERGE_COUNT = 1 << 23,
+	BENCH_MERGE_MAX_RUNS = 1024,
+};
+
+/**
+ * The way solution.c merged the files before the loser tree: by
+ * pairs, round after round, each round copying all the numbers.
+ * Here it is at least without an allocation per merge.
+ */
+static void
+bench_merge_pairwise(struct numsort_run *runs, int count, int *out,
+		     int *tmp)
+{
+	/* The last round must write into out. */
+	int rounds = 0;
+	for (int c = count; c > 1; c = (c + 1) / 2)
+		++rounds;
+	int *dst = rounds % 2 == 1 ? out : tmp;
+	for (; count > 1; count = (count + 1) / 2) {
+		int *pos = dst;
+		for (int i = 0; i < count; i += 2) {
+			struct numsort_run *l = &runs[i];
+			struct numsort_run *r = &runs[i + 1];
+			struct numsort_run *merged = &runs[i / 2];
+			const int *a = l->data, *a_end = a + l->size;
+			const int *b = NULL, *b_end = NULL;
+			if (i + 1 < count) {
+				b = r->data;
+				b_end = b + r->size;
+			}
+			int *start = pos;
+			while (a < a_end && b < b_end)
+				*pos++ = *b < *a ? *b++ : *a++;
+			while (a < a_end)
+				*pos++ = *a++;
+			while (b < b_end)
+				*pos++ = *b++;
+			merged->data = start;
+			merged->size = pos - start;
+		}
+		dst = dst == out ? tmp : out;
+	}
+}
+
+/**
+ * Merge 8M numbers split into 2-1024 sorted runs with the loser tree
+ * and pairwise.
+ */
+static void
+bench_merge(void)
+{
+	int *src = malloc(BENCH_MERGE_COUNT * sizeof(*src));
+	int *out = malloc(BENCH_MERGE_COUNT * sizeof(*out));
+	int *tmp = malloc(BENCH_MERGE_COUNT * sizeof(*tmp));
+	if (src == NULL || out == NULL || tmp == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	struct numsort sorter;
+	numsort_create(&sorter, NULL, NULL);
+	struct numsort_run runs[BENCH_MERGE_MAX_RUNS];
+	/* Touch the buffers, not to count the page faults. */
+	memset(out, 0, BENCH_MERGE_COUNT * sizeof(*out));
+	memset(tmp, 0, BENCH_MERGE_COUNT * sizeof(*tmp));
+	for (int count = 2; count <= BENCH_MERGE_MAX_RUNS; count *= 2) {
+		srand(1);
+		for (int i = 0; i < BENCH_MERGE_COUNT; ++i)
+			src[i] = rand() - RAND_MAX / 2;
+		size_t run_size = BENCH_MERGE_COUNT / count;
+		for (int i = 0; i < count; ++i) {
+			numsort_sort(&sorter, src + i * run_size, run_size,
+				     NUMSORT_AUTO);
+		}
+		printf("merge: %4d runs,", count);
+		for (int is_tree = 1; is_tree >= 0; --is_tree) {
+			for (int i = 0; i < count; ++i) {
+				runs[i].data = src + i * run_size;
+				runs[i].size = run_size;
+			}
+			long long start = bench_now_ns();
+			if (is_tree)
+				numsort_merge(&sorter, runs, count, out);
+			else
+				bench_merge_pairwise(runs, count, out, tmp);
+			long long duration = bench_now_ns() - start;
+			for (int i = 1; i < BENCH_MERGE_COUNT; ++i) {
+				if (out[i - 1] > out[i]) {
+					printf(" not sorted\n");
+					exit(-1);
+				}
+			}
+			printf(" %s %.2f ns", is_tree ? "loser tree" : "pairwise",
+			       (double)duration / BENCH_MERGE_COUNT);
+		}
+		printf(" per number\n");
+	}
+	numsort_destroy(&sorter);
+	free(tmp);
+	free(out);
+	free(src);
+}
+
+enum {
+	/** Numbers in the binary input of the external sort benchmark. */
+	BENCH_EXTSORT_COUNT = 16000000,
+};
+
+/**
+ * Sort 64MB of random binary numbers into a text file with memory
+ * budgets from all the numbers and more down to the smallest one, to
+ * see the cost of each extra merge pass.
+ */
+static void
+bench_extsort(void)
+{
+	const char *in_path = "/tmp/bench_extsort.bin";
+	const char *out_path = "/tmp/bench_extsort.txt";
+	const size_t budgets[] = {256 << 20, 64 << 20, 16 << 20, 4 << 20};
+	int *data = malloc(BENCH_EXTSORT_COUNT * sizeof(*data));
+	if (data == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	srand(1);
+	for (int i = 0; i < BENCH_EXTSORT_COUNT; ++i)
+		data[i] = rand() - RAND_MAX / 2;
+	if (numio_save_binary(in_path, data, BENCH_EXTSORT_COUNT) != 0) {
+		perror("save");
+		exit(-1);
+	}
+	free(data);
+	int budget_count = sizeof(budgets) / sizeof(budgets[0]);
+	for (int i = 0; i < budget_count; ++i) {
+		struct extsort_stats stats;
+		long long start = bench_now_ns();
+		if (extsort_sort(&in_path, 1, out_path, "/tmp", budgets[i],
+				 &stats) != 0) {
+			perror("extsort_sort");
+			exit(-1);
+		}
+		long long duration = bench_now_ns() - start;
+		printf("extsort: %3zu MB, %4d runs, %d passes, %.2f ns per "
+		       "number, %lld MB read, %lld MB written\n",
+		       budgets[i] >> 20, stats.runs, stats.passes,
+		       (double)duration / stats.numbers,
+		       stats.bytes_read >> 20, stats.bytes_written >> 20);
+	}
+	unlink(in_path);
+	unlink(out_path);
+}
+
+enum {
+	/** Numbers sorted by the parallel sort benchmark. */
+	BENCH_PSORT_COUNT = 16000000,
+	/** Threads, chunks and merge slices at most. */
+	BENCH_PSORT_THREADS_MAX = 64,
+};
+
+/** A chunk to sort, then a slice of the result to merge. */
+struct bench_psort_part {
+	int *data;
+	size_t size;
+	const struct numsort_run *runs;
+	int run_count;
+	size_t begin;
+	size_t end;
+	int *out;
+};
+
+static int
+bench_psort_sort_f(void *arg)
+{
+	struct bench_psort_part *part = arg;
+	struct numsort sorter;
+	numsort_create(&sorter, NULL, NULL);
+	numsort_sort(&sorter, part->data, part->size, NUMSORT_AUTO);
+	numsort_destroy(&sorter);
+	return 0;
+}
+
+static int
+bench_psort_merge_f(void *arg)
+{
+	struct bench_psort_part *part = arg;
+	size_t begins[BENCH_PSORT_THREADS_MAX];
+	size_t ends[BENCH_PSORT_THREADS_MAX];
+	struct numsort_run parts[BENCH_PSORT_THREADS_MAX];
+	numsort_split(part->runs, part->run_count, part->begin, begins);
+	numsort_split(part->runs, part->run_count, part->end, ends);
+	for (int i = 0; i < part->run_count; ++i) {
+		parts[i].data = part->runs[i].data + begins[i];
+		parts[i].size = ends[i] - begins[i];
+	}
+	struct numsort merger;
+	numsort_create(&merger, NULL, NULL);
+	numsort_merge(&merger, parts, part->run_count, part->out + part->begin);
+	numsort_destroy(&merger);
+	return 0;
+}
+
+/** Start a coroutine per part and wait for all of them. */
+static long long
+bench_psort_phase(coro_f func, struct bench_psort_part *parts, int count)
+{
+	long long start = bench_now_ns();
+	for (int i = 0; i < count; ++i)
+		coro_new(func, &parts[i]);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	return bench_now_ns() - start;
+}
+
+/**
+ * Sort BENCH_PSORT_COUNT random numbers as chunks, one per thread,
+ * then merge them by slices of the result cut with numsort_split(),
+ * also one per thread.
+ */
+static void
+bench_psort_run(int thread_count, const int *src, int *data, int *out,
+		long long *first_duration)
+{
+	struct bench_psort_part parts[BENCH_PSORT_THREADS_MAX];
+	struct numsort_run runs[BENCH_PSORT_THREADS_MAX];
+	memcpy(data, src, BENCH_PSORT_COUNT * sizeof(*data));
+	coro_sched_init_mt(thread_count);
+	for (int i = 0; i < thread_count; ++i) {
+		size_t begin = (size_t)BENCH_PSORT_COUNT * i / thread_count;
+		size_t end = (size_t)BENCH_PSORT_COUNT * (i + 1) / thread_count;
+		parts[i].data = data + begin;
+		parts[i].size = end - begin;
+		runs[i].data = data + begin;
+		runs[i].size = end - begin;
+		parts[i].runs = runs;
+		parts[i].run_count = thread_count;
+		parts[i].begin = begin;
+		parts[i].end = end;
+		parts[i].out = out;
+	}
+	long long sort_duration =
+		bench_psort_phase(bench_psort_sort_f, parts, thread_count);
+	long long merge_duration =
+		bench_psort_phase(bench_psort_merge_f, parts, thread_count);
+	coro_sched_destroy();
+	for (int i = 1; i < BENCH_PSORT_COUNT; ++i) {
+		if (out[i - 1] > out[i]) {
+			printf("psort: not sorted\n");
+			exit(-1);
+		}
+	}
+	long long duration = sort_duration + merge_duration;
+	if (*first_duration == 0)
+		*first_duration = duration;
+	printf("psort: %2d threads, sort %.2f ns, merge %.2f ns per number, "
+	       "speedup %.2f\n", thread_count,
+	       (double)sort_duration / BENCH_PSORT_COUNT,
+	       (double)merge_duration / BENCH_PSORT_COUNT,
+	       (double)*first_duration / duration);
+}
+
+/** The parallel sort and merge on 1, 2, 4, ... threads. */
+static void
+bench_psort(void)
+{
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int *src = malloc(BENCH_PSORT_COUNT * sizeof(*src));
+	int *data = malloc(BENCH_PSORT_COUNT * sizeof(*data));
+	int *out = malloc(BENCH_PSORT_COUNT * sizeof(*out));
+	if (src == NULL || data == NULL || out == NULL) {
+		perror("malloc");
+		exit(-1);
+	}
+	srand(1);
+	for (int i = 0; i < BENCH_PSORT_COUNT; ++i)
+		src[i] = rand() - RAND_MAX / 2;
+	memset(out, 0, BENCH_PSORT_COUNT * sizeof(*out));
+	long long first_duration = 0;
+	for (int i = 1; (i <= cpu_count && i <= BENCH_PSORT_THREADS_MAX) || i == 1;
+	     i *= 2)
+		bench_psort_run(i, src, data, out, &first_duration);
+	free(out);
+	free(data);
+	free(src);
+}
+
+struct bench {
+	const char *name;
+	void (*func)(void);
+};
+
+static const struct bench benches[] = {
+	{"yield", bench_yield},
+	{"create", bench_create},
+	{"stack", bench_stack},
+	{"scale", bench_scale},
+	{"mt", bench_mt},
+	{"io", bench_io},
+	{"chan", bench_chan},
+	{"timer", bench_timer},
+	{"stackless", bench_stackless},
+	{"trace", bench_trace},
+	{"class", bench_class},
+	{"blocking", bench_blocking},
+	{"load", bench_load},
+	{"parse", bench_parse},
+	{"save", bench_save},
+	{"sort", bench_sort},
+	{"merge", bench_merge},
+	{"extsort", bench_extsort},
+	{"psort", bench_psort},
+};
+
+int
+main(int argc, char **argv)
+{
+	int bench_count = sizeof(benches) / sizeof(benches[0]);
+	for (int i = 0; i < bench_count; ++i) {
+		bool is_selected = argc == 1;
+		for (int j = 1; j < argc && !is_selected; ++j)
+			is_selected = strcmp(argv[j], benches[i].name) == 0;
+		if (is_selected)
+			benches[i].func();
+	}
+	return 0;
+}
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "extsort.h"
+#include "numio.h"
+#include "numsort.h"
+
+/** A sorted run in a spill file. */
+struct extsort_run {
+	off_t offset;
+	/** In numbers. */
+	size_t size;
+};
+
+/** Runs of one pass, one after another in the same spill file. */
+struct extsort_level {
+	/** -1 until the first run is written. */
+	int fd;
+	off_t size;
+	struct extsort_run *runs;
+	int count;
+	int capacity;
+};
+
+struct extsort {
+	const char *tmp_dir;
+	size_t memory;
+	struct extsort_stats *stats;
+	struct numsort sorter;
+	/** Numbers of the run being read, sorted when it is full. */
+	int *run;
+	size_t run_size;
+	size_t fill;
+	/** Input text, the end of it is a number cut in the middle. */
+	char *text;
+	/** Runs of the last pass. */
+	struct extsort_level level;
+};
+
+/** A run being merged. */
+struct extsort_source {
+	int fd;
+	off_t offset;
+	/** Numbers of the run not read yet. */
+	size_t left;
+	int *buf;
+	size_t buf_size;
+};
+
+struct extsort_merge {
+	struct extsort *ext;
+	struct extsort_source *sources;
+	/** errno of a failed read, the merge stops then. */
+	int error;
+};
+
+/** Read up to @a size bytes, less only at the end of the file. */
+static ssize_t
+extsort_read(int fd, void *buf, size_t size)
+{
+	char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = read(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		pos += rc;
+		size -= rc;
+	}
+	return pos - (char *)buf;
+}
+
+static int
+extsort_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = pread(fd, pos, size, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0) {
+			/* The spill file is shorter than written. */
+			errno = EIO;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+		offset += rc;
+	}
+	return 0;
+}
+
+static int
+extsort_write(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+static void
+extsort_level_create(struct extsort_level *level)
+{
+	memset(level, 0, sizeof(*level));
+	level->fd = -1;
+}
+
+static void
+extsort_level_destroy(struct extsort_level *level)
+{
+	if (level->fd >= 0)
+		close(level->fd);
+	free(level->runs);
+	extsort_level_create(level);
+}
+
+/** Start a new run at the end of the level's spill file. */
+static int
+extsort_level_begin_run(struct extsort *ext, struct extsort_level *level)
+{
+	if (level->fd < 0) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/extsort.XXXXXX", ext->tmp_dir);
+		level->fd = mkstemp(path);
+		if (level->fd < 0)
+			return -1;
+		unlink(path);
+	}
+	if (level->count == level->capacity) {
+		int capacity = level->capacity == 0 ? 16 : 2 * level->capacity;
+		struct extsort_run *runs = realloc(level->runs,
+						   capacity * sizeof(*runs));
+		if (runs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		level->runs = runs;
+		level->capacity = capacity;
+	}
+	struct extsort_run *run = &level->runs[level->count++];
+	run->offset = level->size;
+	run->size = 0;
+	return 0;
+}
+
+/** Append numbers to the last run of the level. */
+static int
+extsort_level_write(struct extsort *ext, struct extsort_level *level,
+		    const int *data, size_t size)
+{
+	if (extsort_write(level->fd, data, size * sizeof(*data)) != 0)
+		return -1;
+	level->size += size * sizeof(*data);
+	level->runs[level->count - 1].size += size;
+	ext->stats->bytes_written += size * sizeof(*data);
+	return 0;
+}
+
+/** Sort the numbers read so far and spill them as a run. */
+static int
+extsort_spill(struct extsort *ext)
+{
+	numsort_sort(&ext->sorter, ext->run, ext->fill, NUMSORT_AUTO);
+	if (extsort_level_begin_run(ext, &ext->level) != 0 ||
+	    extsort_level_write(ext, &ext->level, ext->run, ext->fill) != 0)
+		return -1;
+	ext->fill = 0;
+	return 0;
+}
+
+static int
+extsort_read_binary(struct extsort *ext, int fd)
+{
+	char magic[NUMIO_MAGIC_SIZE];
+	ssize_t rc = extsort_read(fd, magic, sizeof(magic));
+	if (rc != sizeof(magic)) {
+		if (rc >= 0)
+			errno = EILSEQ;
+		return -1;
+	}
+	ext->stats->bytes_read += sizeof(magic);
+	while (true) {
+		size_t size = (ext->run_size - ext->fill) * sizeof(int);
+		rc = extsort_read(fd, ext->run + ext->fill, size);
+		if (rc < 0)
+			return -1;
+		ext->stats->bytes_read += rc;
+		if (rc % sizeof(int) != 0) {
+			errno = EILSEQ;
+			return -1;
+		}
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		for (size_t i = 0; i < rc / sizeof(int); ++i) {
+			int *num = &ext->run[ext->fill + i];
+			*num = (int)__builtin_bswap32((uint32_t)*num);
+		}
+#endif
+		ext->fill += rc / sizeof(int);
+		if ((size_t)rc < size)
+			return 0;
+		if (extsort_spill(ext) != 0)
+			return -1;
+	}
+}
+
+static int
+extsort_read_text(struct extsort *ext, int fd)
+{
+	size_t carry = 0;
+	while (true) {
+		ssize_t rc = extsort_read(fd, ext->text + carry,
+					  EXTSORT_TEXT_CHUNK - carry);
+		if (rc < 0)
+			return -1;
+		ext->stats->bytes_read += rc;
+		size_t size = carry + rc;
+		bool is_eof = size < EXTSORT_TEXT_CHUNK;
+		/* Parse up to the last separator, the rest goes next time. */
+		size_t cut = size;
+		while (!is_eof && cut > 0 && ext->text[cut - 1] != ' ' &&
+		       (ext->text[cut - 1] < '\t' || ext->text[cut - 1] > '\r'))
+			--cut;
+		if (!is_eof && cut == 0) {
+			errno = EILSEQ;
+			return -1;
+		}
+		if (ext->run_size - ext->fill < cut / 2 + 1 &&
+		    extsort_spill(ext) != 0)
+			return -1;
+		size_t count;
+		if (numio_parse_text(ext->text, cut, ext->run + ext->fill,
+				     &count) != 0)
+			return -1;
+		ext->fill += count;
+		if (is_eof)
+			return 0;
+		carry = size - cut;
+		memmove(ext->text, ext->text + cut, carry);
+	}
+}
+
+/** The first pass: read the input into runs. */
+static int
+extsort_read_file(struct extsort *ext, const char *path)
+{
+	int format = numio_format_of(path);
+	if (format < 0)
+		return -1;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	int rc = format == NUMIO_FORMAT_BINARY ?
+		 extsort_read_binary(ext, fd) : extsort_read_text(ext, fd);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return rc;
+}
+
+static void
+extsort_refill(void *arg, int run, struct numsort_run *r)
+{
+	struct extsort_merge *merge = arg;
+	struct extsort_source *src = &merge->sources[run];
+	size_t size = src->left < src->buf_size ? src->left : src->buf_size;
+	r->data = src->buf;
+	r->size = 0;
+	if (size == 0 || merge->error != 0)
+		return;
+	if (extsort_pread(src->fd, src->buf, size * sizeof(int),
+			  src->offset) != 0) {
+		merge->error = errno;
+		return;
+	}
+	src->offset += size * sizeof(int);
+	src->left -= size;
+	merge->ext->stats->bytes_read += size * sizeof(int);
+	r->size = size;
+	/* The kernel reads the next part while this one is merged. */
+	if (src->left > 0) {
+		size_t next = src->left < src->buf_size ?
+			      src->left : src->buf_size;
+		posix_fadvise(src->fd, src->offset, next * sizeof(int),
+			      POSIX_FADV_WILLNEED);
+	}
+}
+
+/**
+ * Merge @a count runs of the level starting from @a first into a new
+ * run of @a to, or into @a writer when @a to is NULL. The buffer of
+ * ext->memory bytes is split between the runs and the output.
+ */
+static int
+extsort_merge_runs(struct extsort *ext, int first, int count, int *buf,
+		   struct extsort_level *to, struct numio_writer *writer)
+{
+	size_t chunk = ext->memory / sizeof(int) / (count + 1);
+	struct extsort_source *sources = calloc(count, sizeof(*sources));
+	struct numsort_run *runs = calloc(count, sizeof(*runs));
+	if (sources == NULL || runs == NULL) {
+		free(sources);
+		free(runs);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0; i < count; ++i) {
+		struct extsort_run *run = &ext->level.runs[first + i];
+		sources[i].fd = ext->level.fd;
+		sources[i].offset = run->offset;
+		sources[i].left = run->size;
+		sources[i].buf = buf + i * chunk;
+		sources[i].buf_size = chunk;
+	}
+	int *out = buf + count * chunk;
+	struct extsort_merge merge = {ext, sources, 0};
+	struct numsort_merger merger;
+	int rc = numsort_merger_create(&merger, runs, count, extsort_refill,
+				       &merge);
+	if (rc == 0 && to != NULL)
+		rc = extsort_level_begin_run(ext, to);
+	size_t size;
+	while (rc == 0 && (size = numsort_merger_next(&merger, out,
+						      chunk)) > 0) {
+		if (to != NULL)
+			rc = extsort_level_write(ext, to, out, size);
+		else
+			rc = numio_writer_write(writer, out, size);
+	}
+	if (rc == 0 && merge.error != 0) {
+		errno = merge.error;
+		rc = -1;
+	}
+	numsort_merger_destroy(&merger);
+	free(runs);
+	free(sources);
+	return rc;
+}
+
+/** Merge the runs, more passes if they are too many for one. */
+static int
+extsort_merge_all(struct extsort *ext, struct numio_writer *writer)
+{
+	size_t fan_in = ext->memory / EXTSORT_CHUNK_MIN - 1;
+	if (fan_in > EXTSORT_FAN_IN_MAX)
+		fan_in = EXTSORT_FAN_IN_MAX;
+	if (fan_in < 2)
+		fan_in = 2;
+	int *buf = malloc(ext->memory);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int rc = 0;
+	while (rc == 0 && (size_t)ext->level.count > fan_in) {
+		struct extsort_level next;
+		extsort_level_create(&next);
+		for (int first = 0; rc == 0 && first < ext->level.count;
+		     first += fan_in) {
+			int count = ext->level.count - first;
+			if ((size_t)count > fan_in)
+				count = fan_in;
+			rc = extsort_merge_runs(ext, first, count, buf, &next,
+						NULL);
+		}
+		extsort_level_destroy(&ext->level);
+		ext->level = next;
+		++ext->stats->passes;
+	}
+	if (rc == 0) {
+		rc = extsort_merge_runs(ext, 0, ext->level.count, buf, NULL,
+					writer);
+		++ext->stats->passes;
+	}
+	free(buf);
+	return rc;
+}
+
+/** All the passes, from the input files to the result writer. */
+static int
+extsort_run_passes(struct extsort *ext, const char *const *paths, int count,
+		   struct numio_writer *writer)
+{
+	for (int i = 0; i < count; ++i) {
+		if (extsort_read_file(ext, paths[i]) != 0)
+			return -1;
+	}
+	free(ext->text);
+	ext->text = NULL;
+	struct extsort_stats *stats = ext->stats;
+	stats->passes = 1;
+	if (ext->level.count == 0) {
+		/* All the numbers fit the memory. */
+		stats->runs = ext->fill > 0;
+		stats->numbers = ext->fill;
+		numsort_sort(&ext->sorter, ext->run, ext->fill, NUMSORT_AUTO);
+		return numio_writer_write(writer, ext->run, ext->fill);
+	}
+	if (ext->fill > 0 && extsort_spill(ext) != 0)
+		return -1;
+	stats->runs = ext->level.count;
+	for (int i = 0; i < ext->level.count; ++i)
+		stats->numbers += ext->level.runs[i].size;
+	/* The merge takes the whole budget. */
+	free(ext->run);
+	ext->run = NULL;
+	numsort_destroy(&ext->sorter);
+	return extsort_merge_all(ext, writer);
+}
+
+int
+extsort_sort(const char *const *paths, int count, const char *out_path,
+	     const char *tmp_dir, size_t memory, struct extsort_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		      0644);
+	if (fd < 0)
+		return -1;
+	struct numio_writer writer;
+	if (numio_writer_create(&writer, fd) != 0) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct extsort ext;
+	memset(&ext, 0, sizeof(ext));
+	ext.tmp_dir = tmp_dir;
+	ext.memory = memory < EXTSORT_MEMORY_MIN ? EXTSORT_MEMORY_MIN : memory;
+	ext.stats = stats;
+	numsort_create(&ext.sorter, NULL, NULL);
+	extsort_level_create(&ext.level);
+	/* Radix sort needs a scratch as big as the run. */
+	ext.run_size = (ext.memory - EXTSORT_TEXT_CHUNK) / (2 * sizeof(int));
+	ext.run = malloc(ext.run_size * sizeof(int));
+	ext.text = malloc(EXTSORT_TEXT_CHUNK);
+	int rc = -1;
+	if (ext.run == NULL || ext.text == NULL)
+		errno = ENOMEM;
+	else if (extsort_run_passes(&ext, paths, count, &writer) == 0)
+		rc = numio_writer_finish(&writer);
+	int err = errno;
+	stats->bytes_written += writer.bytes;
+	numio_writer_destroy(&writer);
+	if (close(fd) != 0 && rc == 0) {
+		err = errno;
+		rc = -1;
+	}
+	extsort_level_destroy(&ext.level);
+	numsort_destroy(&ext.sorter);
+	free(ext.text);
+	free(ext.run);
+	errno = err;
+	return rc;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Sort of files bigger than the memory. The input is cut into runs
+ * which fit the memory budget. The runs are sorted and spilled to a
+ * temporary file in the native int32 form, then merged by as many at
+ * once as the budget allows, until one is left. The last merge
+ * writes the text result.
+ */
+
+enum {
+	/** Smallest read of a run in a merge, bigger reads go faster. */
+	EXTSORT_CHUNK_MIN = 256 << 10,
+	/** The input text is read by this many bytes. */
+	EXTSORT_TEXT_CHUNK = 256 << 10,
+	/** Smaller budgets are raised to this. */
+	EXTSORT_MEMORY_MIN = 4 << 20,
+	/** Most runs merged at once, whatever the budget. */
+	EXTSORT_FAN_IN_MAX = 1024,
+};
+
+struct extsort_stats {
+	/** Reads of all the numbers: the run forming one and the merges. */
+	int passes;
+	/** Runs made by the first pass. */
+	int runs;
+	long long numbers;
+	/** The input, the result and the spill files together. */
+	long long bytes_read;
+	long long bytes_written;
+};
+
+/**
+ * Sort the numbers of text or binary files into the text file
+ * @a out_path. The numbers, the radix sort scratch and the input text
+ * take @a memory bytes at most, the text output buffer of numio is on
+ * top of that. If all the numbers fit, nothing is spilled. The spill
+ * files are made in @a tmp_dir and unlinked right away, so they are
+ * gone even if the process crashes.
+ * @retval 0 Success.
+ * @retval -1 Error, see errno. EILSEQ means a broken input file.
+ */
+int
+extsort_sort(const char *const *paths, int count, const char *out_path,
+	     const char *tmp_dir, size_t memory, struct extsort_stats *stats);
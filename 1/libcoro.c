@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -5,151 +6,3218 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "libcoro.h"
+#include "libcoro_stackless.h"
+#include "libcoro_trace.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * io_uring backend of the coroutine I/O. It is built when the kernel
+ * headers have io_uring, and used only if asked for and the running
+ * kernel supports it. Define CORO_NO_URING to leave it out.
+ */
+#if !defined(CORO_NO_URING) && defined(__linux__) && \
+	__has_include(<linux/io_uring.h>)
+#define CORO_HAS_URING 1
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#define CORO_HAS_URING 0
+#endif
+
+/*
+ * AddressSanitizer does not know about the stack switches. The frames
+ * a finished coroutine never returned from leave their redzones in
+ * the shadow of its stack, and a new coroutine on the reused stack
+ * would hit them. The stacks are unpoisoned when taken from the pool.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_HAS_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_HAS_ASAN 1
+#endif
+#endif
+#ifndef CORO_HAS_ASAN
+#define CORO_HAS_ASAN 0
+#endif
+#if CORO_HAS_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+/*
+ * Context switch backend. On x86-64 and aarch64 a coroutine context
+ * is just a stack pointer: the switch pushes callee-saved registers
+ * onto the stack being left, saves the stack pointer, loads the new
+ * one and pops the registers of the coroutine being entered. Nothing
+ * else is touched - no signal mask, no shadow stack, no syscalls.
+ * Elsewhere, or with CORO_USE_SIGJMP defined, the switch falls back
+ * to sigsetjmp()/siglongjmp().
+ */
+#if !defined(CORO_USE_SIGJMP) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_ASM 0
+#endif
+
+#if CORO_CTX_ASM
+
+/**
+ * Save callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, and resume the context saved in
+ * @a to_sp. Returns when somebody switches back to @a from_sp.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp)
+	__attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, @function\n"
+"coro_ctx_switch:\n"
+	"pushq %rbp\n"
+	"pushq %rbx\n"
+	"pushq %r12\n"
+	"pushq %r13\n"
+	"pushq %r14\n"
+	"pushq %r15\n"
+	"movq %rsp, (%rdi)\n"
+	"movq %rsi, %rsp\n"
+	"popq %r15\n"
+	"popq %r14\n"
+	"popq %r13\n"
+	"popq %r12\n"
+	"popq %rbx\n"
+	"popq %rbp\n"
+	"ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+
+);
+
+#elif defined(__aarch64__)
+
+#define CORO_CTX_AARCH64_SAVE						\
+	"sub sp, sp, #160\n"						\
+	"stp x19, x20, [sp, #0]\n"					\
+	"stp x21, x22, [sp, #16]\n"					\
+	"stp x23, x24, [sp, #32]\n"					\
+	"stp x25, x26, [sp, #48]\n"					\
+	"stp x27, x28, [sp, #64]\n"					\
+	"stp x29, x30, [sp, #80]\n"					\
+	"stp d8, d9, [sp, #96]\n"					\
+	"stp d10, d11, [sp, #112]\n"					\
+	"stp d12, d13, [sp, #128]\n"					\
+	"stp d14, d15, [sp, #144]\n"
+
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".hidden coro_ctx_switch\n"
+	".type coro_ctx_switch, %function\n"
+"coro_ctx_switch:\n"
+	CORO_CTX_AARCH64_SAVE
+	"mov x9, sp\n"
+	"str x9, [x0]\n"
+	"mov sp, x1\n"
+	"ldp x19, x20, [sp, #0]\n"
+	"ldp x21, x22, [sp, #16]\n"
+	"ldp x23, x24, [sp, #32]\n"
+	"ldp x25, x26, [sp, #48]\n"
+	"ldp x27, x28, [sp, #64]\n"
+	"ldp x29, x30, [sp, #80]\n"
+	"ldp d8, d9, [sp, #96]\n"
+	"ldp d10, d11, [sp, #112]\n"
+	"ldp d12, d13, [sp, #128]\n"
+	"ldp d14, d15, [sp, #144]\n"
+	"add sp, sp, #160\n"
+	"ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+
+);
+
+#endif /* defined(__aarch64__) */
+
+/**
+ * Build an initial frame on top of a fresh stack, so the first
+ * coro_ctx_switch() into @a sp "returns" into @a entry. The
+ * registers popped by the switch are zero.
+ */
+static void
+coro_ctx_init(void **sp, void *stack, size_t stack_size, void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **frame;
+#if defined(__x86_64__)
+	/*
+	 * Six registers, then the return address of the switch,
+	 * then a fake return address of the entry itself - so it
+	 * starts with the stack aligned as after a normal call.
+	 */
+	frame = (void **)top - 8;
+	memset(frame, 0, 8 * sizeof(void *));
+	frame[6] = (void *)entry;
+#elif defined(__aarch64__)
+	/* 20 registers, x30 (the link register) is the 12th. */
+	frame = (void **)top - 20;
+	memset(frame, 0, 20 * sizeof(void *));
+	frame[11] = (void *)entry;
+#endif
+	*sp = frame;
+}
+
+#endif /* CORO_CTX_ASM */
+
+/** Where a coroutine is in its life cycle. */
+enum coro_state {
+	/** In a ready queue, waits for its turn to run. */
+	CORO_READY,
+	/** Works at this moment. */
+	CORO_RUNNING,
+	/**
+	 * Called coro_suspend() but is not switched out yet. A
+	 * wakeup in this state is remembered and makes the suspend a
+	 * no-op.
+	 */
+	CORO_SUSPENDING,
+	/** Suspended, in the waiting queue until a wakeup. */
+	CORO_WAITING,
+	/** Finished, in the finished queue until coro_sched_wait(). */
+	CORO_FINISHED,
+	/** Returned by coro_sched_wait(), in no queue. */
+	CORO_DEAD,
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
-	/** Stack, used by the coroutine. */
+	/** See coro_id(). */
+	unsigned long long id;
+	/**
+	 * Stack, used by the coroutine. It is the lowest usable
+	 * address, right above the guard page if there is one. The
+	 * coroutine object itself lives at the top of the stack.
+	 */
 	void *stack;
+	/** Usable stack size, from stack up to the object. */
+	size_t stack_size;
+	/** Stack pool size class, see coro_stack_pool. */
+	int stack_class;
+	/** Slab of an unguarded stack, NULL if it has a mapping of its own. */
+	struct coro_stack_slab *stack_slab;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+	/**
+	 * Step function of a stackless coroutine, NULL for a stackful
+	 * one. The frame follows the object, and there is no stack.
+	 */
+	coro_step_f step;
 	/** Last remembered coroutine context. */
+#if CORO_CTX_ASM
+	void *sp;
+#else
 	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
+#endif
+	/** Life cycle state, defines the queue the coroutine is in. */
+	enum coro_state state;
+	/** True, if woken up while in CORO_SUSPENDING state. */
+	bool is_wakeup_pending;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Time spent running, in nanoseconds. */
+	long long work_time;
+	/** Time spent ready to run or suspended, in nanoseconds. */
+	long long wait_time;
+	/** When the current run has started. 0, if not known yet. */
+	long long slice_start;
+	/** When the coroutine was switched out last time. */
+	long long switch_out_time;
+	/** Time budget of one run, in nanoseconds. */
+	long long quantum;
+	/** Scheduling class, selects the ready queue. */
+	enum coro_class sched_class;
+	/** Wake-up latency target, in nanoseconds. */
+	long long latency;
+	/** When a ready latency class coroutine is due to run. */
+	long long deadline;
+	/**
+	 * Links in one of the scheduler queues. A deleted coroutine
+	 * is kept in the stack pool via next.
+	 */
 	struct coro *next, *prev;
 };
 
+/** Intrusive FIFO of coroutines. */
+struct coro_queue {
+	struct coro *first, *last;
+};
+
+/** Append @a c to the end of @a q. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+/**
+ * Insert @a c into @a q sorted by deadline, after the coroutines
+ * with the same one. Deadlines mostly grow, so the search goes from
+ * the end and usually stops right away.
+ */
+static inline void
+coro_queue_insert_by_deadline(struct coro_queue *q, struct coro *c)
+{
+	struct coro *prev = q->last;
+	while (prev != NULL && prev->deadline > c->deadline)
+		prev = prev->prev;
+	c->prev = prev;
+	c->next = prev != NULL ? prev->next : q->first;
+	if (c->next != NULL)
+		c->next->prev = c;
+	else
+		q->last = c;
+	if (prev != NULL)
+		prev->next = c;
+	else
+		q->first = c;
+}
+
+/** Remove @a c from any position of @a q. */
+static inline void
+coro_queue_remove(struct coro_queue *q, struct coro *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+	c->next = c->prev = NULL;
+}
+
+/** Take the first coroutine of @a q, NULL if it is empty. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_remove(q, c);
+	return c;
+}
+
+/**
+ * What to do with the coroutine which has just been switched out.
+ * It is done by the context switched in - only then the old stack
+ * is not used anymore and the coroutine can be given to other
+ * threads.
+ */
+enum coro_switch_op {
+	/** Nothing, it is the scheduler or is queued already. */
+	CORO_SWITCH_NONE,
+	/** It yielded, put it back into the ready queue. */
+	CORO_SWITCH_YIELD,
+	/** It is suspended, put it into the waiting queue. */
+	CORO_SWITCH_SUSPEND,
+	/** It has finished, put it into the finished queue. */
+	CORO_SWITCH_FINISH,
+};
+
+/**
+ * A thread running coroutines. In the single-threaded mode there
+ * is one worker - the thread which called coro_sched_init(). It
+ * runs coroutines inside coro_sched_wait(). In the M:N mode each
+ * worker has its own thread, and the main thread only waits for
+ * finished coroutines.
+ */
+struct coro_worker {
+	/**
+	 * Context of the worker's own stack. It is the scheduler
+	 * loop - it catches and returns dead coroutines to a user,
+	 * or looks for work when the ready queue is empty.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_coro;
+	/**
+	 * Coroutines ready to run, a queue per class in the order of
+	 * their turns. See coro_ready_pick().
+	 */
+	struct coro_queue ready[CORO_CLASS_COUNT];
+	/** Latency class runs in a row while batch ones were ready. */
+	int latency_streak;
+	/** Protects the ready queues in the M:N mode. */
+	pthread_mutex_t lock;
+	/** Coroutine switched out last time, and what to do with it. */
+	struct coro *switch_prev;
+	enum coro_switch_op switch_op;
+	/**
+	 * Stackless coroutine to run next. A coroutine switching out
+	 * can not run it on its own stack, so it is handed over to
+	 * the scheduler loop.
+	 */
+	struct coro *step_next;
+	/** Yields since the last non-blocking I/O poll. */
+	int poll_tick;
+	/** Thread number in the trace events. */
+	int trace_thread;
+	/**
+	 * Trace ring of the worker, allocated on the first event.
+	 * Only the worker's thread writes into it.
+	 */
+	struct coro_trace_event *trace;
+	/** Events ever written into the ring. */
+	uint64_t trace_pos;
+	/** Thread of the worker in the M:N mode. */
+	pthread_t thread;
+};
+
+/** Worker of the thread which called coro_sched_init*(). */
+static struct coro_worker coro_main_worker;
+/** Worker threads of the M:N mode. */
+static struct coro_worker *coro_workers = NULL;
+static int coro_worker_count = 0;
+/** True, if coroutines are run by the worker threads. */
+static bool coro_is_mt = false;
+/** Worker of the current thread, NULL if it is not a worker. */
+static __thread struct coro_worker *coro_worker_this = NULL;
+/**
+ * True, if in that moment the scheduler is waiting for a
+ * coroutine finish.
+ */
+static bool is_sched_waiting = false;
+/**
+ * In the M:N mode protects the waiting and finished queues, the
+ * counters below and the coroutine states.
+ */
+static pthread_mutex_t coro_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Protects the stack pool in the M:N mode. */
+static pthread_mutex_t coro_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a coroutine finishes or nothing can run. */
+static pthread_cond_t coro_finished_cond = PTHREAD_COND_INITIALIZER;
+/**
+ * Signaled for the idle workers when there is a ready coroutine.
+ * Has its own mutex, so a coroutine can be made ready while
+ * coro_sched_lock is held.
+ */
+static pthread_cond_t coro_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t coro_work_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Suspended coroutines, waiting for coro_wakeup(). */
+static struct coro_queue coro_waiting;
+/** Finished coroutines, not yet returned by coro_sched_wait(). */
+static struct coro_queue coro_finished;
+/** Coroutines which are neither finished nor waiting. */
+static int coro_active_count = 0;
+/** Coroutines in all the ready queues of the M:N mode. Atomic. */
+static int coro_ready_count = 0;
+/** Workers sleeping on coro_work_cond. Atomic. */
+static int coro_idle_count = 0;
+/** Round-robin counter to spread coroutines created outside. */
+static unsigned coro_next_worker = 0;
+/** True, if the worker threads should exit. */
+static bool coro_is_shutdown = false;
+/** True, if work and wait time is measured on each switch. */
+static bool coro_is_accounting = true;
+/** Last given coroutine id. Atomic. */
+static unsigned long long coro_last_id = 0;
+/** True, if the scheduler events are recorded. */
+static bool coro_is_tracing = false;
+/** Trace ring capacity - 1, the capacity is a power of two. */
+static uint64_t coro_trace_mask = 0;
+
+enum {
+	/** Index of the readers in coro_fd.waiters. */
+	CORO_IO_DIR_READ = 0,
+	/** Index of the writers in coro_fd.waiters. */
+	CORO_IO_DIR_WRITE = 1,
+	/** Max events taken from epoll at once. */
+	CORO_EPOLL_BATCH = 128,
+	/**
+	 * Busy coroutines poll for I/O without blocking once per so
+	 * many yields, so the I/O waiters are not starved.
+	 */
+	CORO_POLL_PERIOD = 64,
+};
+
+/** A coroutine waiting for I/O. Lives on the stack of the waiter. */
+struct coro_io_waiter {
+	struct coro *c;
+	struct coro_io_waiter *next;
+};
+
+/** Coroutines waiting for readiness of one descriptor. */
+struct coro_fd {
+	struct coro_io_waiter *waiters[2];
+};
+
+enum {
+	/** Helper threads of coro_blocking_call() at most. */
+	CORO_BLOCKING_THREADS_MAX = 16,
+};
+
+/**
+ * A call of coro_blocking_call(). Lives on the stack of the calling
+ * coroutine until the result is delivered.
+ */
+struct coro_blocking_task {
+	coro_blocking_f func;
+	void *arg;
+	void *result;
+	struct coro *c;
+	/** True, once the result is delivered to the coroutine. */
+	bool is_done;
+	struct coro_blocking_task *next;
+};
+
+/**
+ * A coroutine waiting on a channel, mutex etc. Lives on the stack of
+ * the waiter.
+ */
+struct coro_waiter {
+	struct coro *c;
+	/** False, once the waiter is taken off the list to wake up. */
+	bool is_queued;
+	struct coro_waiter *next, *prev;
+};
+
+/** FIFO of coroutines waiting on one primitive. */
+struct coro_wait_list {
+	struct coro_waiter *first, *last;
+};
+
+struct coro_chan {
+	/** Ring buffer of messages. */
+	void **msgs;
+	int capacity;
+	/** Index of the oldest message and the number of messages. */
+	int head;
+	int count;
+	bool is_closed;
+	/** Waiting for a free slot, and for a message. */
+	struct coro_wait_list senders;
+	struct coro_wait_list receivers;
+};
+
+struct coro_wait_group {
+	int count;
+	struct coro_wait_list waiters;
+};
+
+struct coro_mutex {
+	bool is_locked;
+	struct coro_wait_list waiters;
+};
+
+struct coro_cond {
+	struct coro_wait_list waiters;
+};
+
+/**
+ * Epoll descriptor of the reactor. Created with the first I/O
+ * wait. Descriptors are armed with EPOLLONESHOT on each wait, so
+ * a plain close() of a descriptor is fine for the reactor.
+ */
+static int coro_epoll_fd = -1;
+/**
+ * Eventfd to interrupt a worker blocked in epoll_wait() - in the M:N
+ * mode, or when a helper thread has finished a blocking call.
+ */
+static int coro_event_fd = -1;
+/** Descriptor states, indexed by the descriptors. */
+static struct coro_fd *coro_fds = NULL;
+static int coro_fd_count = 0;
+/** Coroutines waiting for I/O. */
+static int coro_io_wait_count = 0;
+/** True, if a worker is blocked in epoll_wait(). Atomic. */
+static bool coro_is_polling = false;
+
+/**
+ * Helper threads of coro_blocking_call(), started on demand. The
+ * lock protects all of their state and is taken after
+ * coro_sched_lock.
+ */
+static pthread_mutex_t coro_blocking_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Idle helper threads sleep on it. */
+static pthread_cond_t coro_blocking_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t coro_blocking_threads[CORO_BLOCKING_THREADS_MAX];
+static int coro_blocking_thread_count = 0;
+static int coro_blocking_idle_count = 0;
+static bool coro_blocking_is_stopped = false;
+/** Calls waiting for a helper thread, FIFO. */
+static struct coro_blocking_task *coro_blocking_first = NULL;
+static struct coro_blocking_task *coro_blocking_last = NULL;
+/** Calls done, but not delivered yet. */
+static struct coro_blocking_task *coro_blocking_done = NULL;
+/** Calls not delivered yet, queued, running or done. Atomic. */
+static int coro_blocking_count = 0;
+
+#if CORO_HAS_URING
+
+enum {
+	/** Submission queue size. */
+	CORO_URING_SQ_ENTRIES = 256,
+	/**
+	 * Completion queue size. More operations can be in flight,
+	 * the kernel keeps the overflow till the queue has room.
+	 */
+	CORO_URING_CQ_ENTRIES = 4096,
+	/**
+	 * Prepared operations are submitted by the scheduler when it
+	 * polls, or right away when there are so many of them.
+	 */
+	CORO_URING_BATCH = 32,
+};
+
+/**
+ * io_uring instance of the scheduler, its rings are mapped into
+ * memory shared with the kernel. Protected by coro_sched_lock.
+ */
+struct coro_uring {
+	/** Ring descriptor, -1 when epoll is used for I/O. */
+	int fd;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	/** Operations prepared, but not submitted yet. */
+	unsigned sq_pending;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static struct coro_uring coro_uring = {.fd = -1};
+
+/**
+ * An operation of a coroutine in io_uring. Lives on the stack of
+ * the coroutine till the completion comes, even after a timeout.
+ */
+struct coro_uring_req {
+	struct coro *c;
+	/** Result of the operation, or -errno. */
+	int res;
+	bool is_done;
+};
+
+#endif /* CORO_HAS_URING */
+
+/** True, if the coroutine I/O goes through io_uring. */
+static inline bool
+coro_io_is_uring(void)
+{
+#if CORO_HAS_URING
+	return coro_uring.fd >= 0;
+#else
+	return false;
+#endif
+}
+
+enum {
+	/** Each level of the timer wheel has 2^CORO_WHEEL_BITS slots. */
+	CORO_WHEEL_BITS = 6,
+	CORO_WHEEL_SIZE = 1 << CORO_WHEEL_BITS,
+	CORO_WHEEL_MASK = CORO_WHEEL_SIZE - 1,
+	CORO_WHEEL_LEVELS = 4,
+};
+
+/** Timer resolution - the wheel tick, in nanoseconds. */
+#define CORO_TIMER_TICK_NS 1000000LL
+/**
+ * Ticks covered by the wheel, about 4.6 hours. Farther timers are
+ * parked in the last slot and are re-inserted when it cascades.
+ */
+#define CORO_WHEEL_SPAN (1LL << (CORO_WHEEL_BITS * CORO_WHEEL_LEVELS))
+
+/** A coroutine waiting for a deadline. Lives on the stack of it. */
+struct coro_timer {
+	/** Tick at which the timer fires. */
+	long long expire;
+	struct coro *c;
+	/** True, if the timer has fired and is not in the wheel. */
+	bool is_expired;
+	/** Wheel slot the timer is in. */
+	int level;
+	int slot;
+	struct coro_timer *next, **prev;
+};
+
+/**
+ * Hierarchical timer wheel. Level 0 has a slot per tick for the
+ * next CORO_WHEEL_SIZE ticks, a slot of level N covers
+ * CORO_WHEEL_SIZE^N ticks. When a level wraps around, the next slot
+ * of the level above is cascaded - its timers are re-inserted into
+ * the finer levels. So adding, removing and firing a timer is O(1),
+ * and a timer is moved at most CORO_WHEEL_LEVELS - 1 times. Protected
+ * by coro_sched_lock.
+ */
+static struct coro_timer *coro_wheel[CORO_WHEEL_LEVELS][CORO_WHEEL_SIZE];
+/** Bit per non-empty slot, for each level. */
+static uint64_t coro_wheel_map[CORO_WHEEL_LEVELS];
+/** The next tick to process. Timers of the previous ones fired. */
+static long long coro_wheel_tick = 0;
+/** Timers in the wheel. */
+static int coro_timer_count = 0;
+/**
+ * Tick until which a worker sleeps in epoll_wait(), LLONG_MAX if
+ * until an event, -1 if nobody sleeps. An earlier timer has to wake
+ * the worker up.
+ */
+static long long coro_poll_deadline = -1;
+#if ! CORO_CTX_ASM
+/**
+ * Buffer, used by the coroutine constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static sigjmp_buf start_point;
+/** Coroutine being created by the signal handler. */
+static struct coro *coro_creating = NULL;
+/** Signal handlers are per process, so creation is serialized. */
+static pthread_mutex_t coro_create_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** Lock @a m if there are several threads. */
+static inline void
+coro_mutex_lock(pthread_mutex_t *m)
+{
+	if (coro_is_mt)
+		pthread_mutex_lock(m);
+}
+
+static inline void
+coro_mutex_unlock(pthread_mutex_t *m)
+{
+	if (coro_is_mt)
+		pthread_mutex_unlock(m);
+}
+
+/**
+ * Worker of the current thread. A coroutine can continue in another
+ * thread after any switch, so the compiler must not reuse an address
+ * of a thread-local variable computed before the switch. Hence the
+ * function is never inlined and does not look pure.
+ */
+static __attribute__((noinline)) struct coro_worker *
+coro_worker_current(void)
+{
+	__asm__ volatile("");
+	return coro_worker_this;
+}
+
+enum {
+	/** Stack size of the coroutines created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Smallest stack, enough for printf() and friends. */
+	CORO_STACK_SIZE_MIN = 16 * 1024,
+	/**
+	 * Stacks are pooled by size classes - powers of two from
+	 * the minimal size.
+	 */
+	CORO_STACK_CLASS_COUNT = 32,
+	/** Max number of free guarded stacks kept in one class. */
+	CORO_STACK_POOL_MAX = 4096,
+	/** Address space of a slab of unguarded stacks. */
+	CORO_STACK_SLAB_SIZE = 64 * 1024 * 1024,
+};
+
+/**
+ * A mapping cut into unguarded stacks of one class, used when the
+ * guarded stacks have taken their share of vm.max_map_count. Its
+ * stacks are never unmapped one by one, they stay in the pool when
+ * free.
+ */
+struct coro_stack_slab {
+	struct coro_stack_slab *next;
+	char *map;
+	size_t map_size;
+	/** Stacks cut from the mapping so far, from its start. */
+	int stack_count;
+	/** Stacks taken from the pool, the mapping is busy until 0. */
+	int used_count;
+};
+
+/**
+ * Free coroutines with their stacks, kept for reuse. A class i
+ * holds stacks of CORO_STACK_SIZE_MIN << i bytes.
+ */
+struct coro_stack_class {
+	struct coro *free_list;
+	int free_count;
+	/** The slab new unguarded stacks of the class are cut from. */
+	struct coro_stack_slab *slab;
+};
+
+static struct coro_stack_class coro_stack_pool[CORO_STACK_CLASS_COUNT];
+/** Cached sysconf(_SC_PAGESIZE). */
+static size_t coro_page_size = 0;
+/**
+ * Cache color of the next mapped stack. Without it all the objects
+ * and stack tops would have the same offset in a page and fight for
+ * the same cache sets.
+ */
+static unsigned coro_stack_color = 0;
+/** All the slabs, of all the classes. */
+static struct coro_stack_slab *coro_stack_slabs = NULL;
+/**
+ * Set when a guarded stack could not be mapped for the lack of
+ * memory or of mappings. New stacks come from slabs since then, till
+ * coro_sched_destroy().
+ */
+static bool coro_stack_is_unguarded = false;
+/** Guarded stacks mapped, in use or in the pool. */
+static int coro_stack_guarded_count = 0;
+/**
+ * Most guarded stacks at once: they take half of vm.max_map_count,
+ * the other half is left to the slabs, malloc() and the rest of the
+ * process. Read on the first stack, 0 is unknown yet.
+ */
+static int coro_stack_guarded_max = 0;
+
+/** Guarded stacks the mapping limit leaves room for. */
+static int
+coro_stack_guarded_limit(void)
+{
+	long long max_map_count = 65530;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lld", &max_map_count) != 1)
+			max_map_count = 65530;
+		fclose(f);
+	}
+	/* Two mappings per stack, half of all for the stacks. */
+	return max_map_count / 4 < INT_MAX ? max_map_count / 4 : INT_MAX;
+}
+
+/** Size class of a stack able to hold @a stack_size bytes. */
+static int
+coro_stack_class_of(size_t stack_size)
+{
+	int cls = 0;
+	while (cls < CORO_STACK_CLASS_COUNT - 1 &&
+	       ((size_t)CORO_STACK_SIZE_MIN << cls) < stack_size)
+		++cls;
+	return cls;
+}
+
+/**
+ * Put the coroutine object on top of the @a size bytes of @a stack,
+ * the stack grows down from it.
+ */
+static struct coro *
+coro_stack_place(char *stack, size_t size, int cls)
+{
+	uintptr_t top = (uintptr_t)stack + size - sizeof(struct coro) -
+			(coro_stack_color++ % 64) * 64;
+	struct coro *c = (struct coro *)(top & ~(uintptr_t)63);
+	c->stack = stack;
+	c->stack_size = (char *)c - stack;
+	c->stack_class = cls;
+	c->stack_slab = NULL;
+	return c;
+}
+
+/**
+ * Map a stack of its own with a guard page. The mapping is reserved,
+ * not committed: pages are backed by memory only when touched. The
+ * lowest page is PROT_NONE, so a stack overflow is a segfault instead
+ * of a silent corruption of somebody else's memory. That costs two
+ * mappings per stack, see coro_stack_slab_new() for when they are
+ * over.
+ */
+static struct coro *
+coro_stack_map(int cls)
+{
+	size_t stack_size = (size_t)CORO_STACK_SIZE_MIN << cls;
+	size_t map_size = stack_size + coro_page_size;
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			 MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (mprotect(map, coro_page_size, PROT_NONE) != 0) {
+		int err = errno;
+		munmap(map, map_size);
+		errno = err;
+		return NULL;
+	}
+	return coro_stack_place(map + coro_page_size, stack_size, cls);
+}
+
+/**
+ * Cut an unguarded stack from the slab of the class, mapping a new
+ * slab when it is full. A slab is one mapping for many stacks, so
+ * vm.max_map_count (65530 by default) does not limit the count of
+ * coroutines. The stacks are cut one by one, a slab commits no
+ * memory for the stacks not used yet.
+ */
+static struct coro *
+coro_stack_slab_new(int cls)
+{
+	struct coro_stack_class *pool = &coro_stack_pool[cls];
+	size_t stack_size = (size_t)CORO_STACK_SIZE_MIN << cls;
+	struct coro_stack_slab *slab = pool->slab;
+	if (slab == NULL ||
+	    (size_t)(slab->stack_count + 1) * stack_size > slab->map_size) {
+		slab = malloc(sizeof(*slab));
+		if (slab == NULL)
+			return NULL;
+		slab->map_size = stack_size > CORO_STACK_SLAB_SIZE ?
+				 stack_size : CORO_STACK_SLAB_SIZE / stack_size *
+				 stack_size;
+		slab->map = mmap(NULL, slab->map_size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+				 MAP_STACK, -1, 0);
+		if (slab->map == MAP_FAILED) {
+			int err = errno;
+			free(slab);
+			errno = err;
+			return NULL;
+		}
+		slab->stack_count = 0;
+		slab->used_count = 0;
+		slab->next = coro_stack_slabs;
+		coro_stack_slabs = slab;
+		pool->slab = slab;
+	}
+	char *stack = slab->map + slab->stack_count++ * stack_size;
+	struct coro *c = coro_stack_place(stack, stack_size, cls);
+	c->stack_slab = slab;
+	++slab->used_count;
+	return c;
+}
+
+/**
+ * Take a coroutine object with a stack of the given class from the
+ * pool or make a new one: a guarded stack while they are under
+ * coro_stack_guarded_max and the mappings last, then one from a slab.
+ * @retval NULL No memory, errno is set.
+ */
+static struct coro *
+coro_stack_new(int cls)
+{
+	struct coro_stack_class *pool = &coro_stack_pool[cls];
+	struct coro *c = pool->free_list;
+	if (c != NULL) {
+		pool->free_list = c->next;
+		--pool->free_count;
+		if (c->stack_slab != NULL)
+			++c->stack_slab->used_count;
+#if CORO_HAS_ASAN
+		ASAN_UNPOISON_MEMORY_REGION(c->stack, c->stack_size);
+#endif
+		return c;
+	}
+	if (coro_page_size == 0)
+		coro_page_size = sysconf(_SC_PAGESIZE);
+	if (coro_stack_guarded_max == 0)
+		coro_stack_guarded_max = coro_stack_guarded_limit();
+	if (! coro_stack_is_unguarded &&
+	    coro_stack_guarded_count < coro_stack_guarded_max) {
+		c = coro_stack_map(cls);
+		if (c != NULL) {
+			++coro_stack_guarded_count;
+			return c;
+		}
+		if (errno != ENOMEM)
+			return NULL;
+		coro_stack_is_unguarded = true;
+	}
+	return coro_stack_slab_new(cls);
+}
+
+/** Return the coroutine stack into the pool or unmap it. */
+static void
+coro_stack_delete(struct coro *c)
+{
+	int cls = c->stack_class;
+	struct coro_stack_class *pool = &coro_stack_pool[cls];
+	if (c->stack_slab != NULL)
+		--c->stack_slab->used_count;
+	if (c->stack_slab != NULL || pool->free_count < CORO_STACK_POOL_MAX) {
+		c->next = pool->free_list;
+		pool->free_list = c;
+		++pool->free_count;
+		return;
+	}
+	char *map = (char *)c->stack - coro_page_size;
+	size_t map_size = ((size_t)CORO_STACK_SIZE_MIN << cls) +
+			  coro_page_size;
+	if (munmap(map, map_size) != 0)
+		handle_error();
+	--coro_stack_guarded_count;
+}
+
+unsigned long long
+coro_id(const struct coro *c)
+{
+	return c->id;
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+/**
+ * Clock of the accounting. Monotonic, and on Linux it is read via
+ * vDSO without entering the kernel.
+ */
+static inline long long
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long
+coro_work_time(const struct coro *c)
+{
+	/* The current run is not added until the switch out. */
+	if (c->state == CORO_RUNNING && c->slice_start != 0)
+		return c->work_time + coro_clock_ns() - c->slice_start;
+	return c->work_time;
+}
+
+long long
+coro_wait_time(const struct coro *c)
+{
+	return c->wait_time;
+}
+
+void
+coro_set_quantum(struct coro *c, long long usec)
+{
+	c->quantum = usec * 1000;
+}
+
+void
+coro_set_class(struct coro *c, enum coro_class cls)
+{
+	c->sched_class = cls;
+}
+
+void
+coro_set_latency(struct coro *c, long long usec)
+{
+	c->latency = usec * 1000;
+}
+
+void
+coro_sched_set_accounting(bool is_enabled)
+{
+	coro_is_accounting = is_enabled;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->state == CORO_FINISHED || c->state == CORO_DEAD;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	if (c->step != NULL) {
+		free(c);
+		return;
+	}
+	coro_mutex_lock(&coro_stack_lock);
+	coro_stack_delete(c);
+	coro_mutex_unlock(&coro_stack_lock);
+}
+
+/**
+ * Remember the current context in @a from and resume @a to. Returns
+ * when somebody resumes @a from back. The caller is responsible for
+ * updating the worker's this_coro.
+ */
+static inline void
+coro_ctx_jump(struct coro *from, struct coro *to)
+{
+#if CORO_CTX_ASM
+	coro_ctx_switch(&from->sp, to->sp);
+#else
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+#endif
+}
+
+/** Interrupt epoll_wait() of a polling worker. */
+static void
+coro_reactor_notify(void)
+{
+	uint64_t one = 1;
+	if (write(coro_event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+/**
+ * Record an event about @a c into the trace ring of @a w. Called
+ * only when tracing is on. @a now 0 means read the clock.
+ */
+static void
+coro_trace_record(struct coro_worker *w, enum coro_trace_type type,
+		  const struct coro *c, int arg, long long now)
+{
+	if (w == NULL)
+		return;
+	if (w->trace == NULL) {
+		w->trace = malloc((coro_trace_mask + 1) * sizeof(*w->trace));
+		if (w->trace == NULL)
+			handle_error();
+	}
+	struct coro_trace_event *e = &w->trace[w->trace_pos++ &
+					       coro_trace_mask];
+	e->time = now != 0 ? now : coro_clock_ns();
+	e->coro_id = c->id;
+	e->type = type;
+	e->thread = w->trace_thread;
+	e->arg = arg;
+}
+
+/** Record switching out of @a from with @a op and into @a to. */
+static void __attribute__((noinline))
+coro_trace_switch(struct coro_worker *w, struct coro *from, struct coro *to,
+		  enum coro_switch_op op, long long now)
+{
+	if (now == 0)
+		now = coro_clock_ns();
+	if (from != &w->sched) {
+		if (op == CORO_SWITCH_FINISH)
+			coro_trace_record(w, CORO_TRACE_FINISH, from, 0, now);
+		else
+			coro_trace_record(w, CORO_TRACE_SWITCH_OUT, from,
+					  op == CORO_SWITCH_YIELD ?
+					  CORO_TRACE_OUT_YIELD :
+					  CORO_TRACE_OUT_SUSPEND, now);
+	}
+	if (to != &w->sched)
+		coro_trace_record(w, CORO_TRACE_SWITCH_IN, to, 0, now);
+}
+
+/** Append @a c to the ready queue of its class. */
+static inline void
+coro_ready_insert(struct coro_worker *w, struct coro *c)
+{
+	if (c->sched_class == CORO_CLASS_LATENCY)
+		coro_queue_insert_by_deadline(&w->ready[CORO_CLASS_LATENCY], c);
+	else
+		coro_queue_push(&w->ready[CORO_CLASS_BATCH], c);
+}
+
+/**
+ * Take the next coroutine to run from the ready queues of @a w:
+ * the latency class first, unless batch coroutines have waited
+ * through CORO_LATENCY_BURST latency runs.
+ */
+static inline struct coro *
+coro_ready_pick(struct coro_worker *w)
+{
+	struct coro_queue *latency = &w->ready[CORO_CLASS_LATENCY];
+	struct coro_queue *batch = &w->ready[CORO_CLASS_BATCH];
+	if (latency->first == NULL) {
+		w->latency_streak = 0;
+		return coro_queue_pop(batch);
+	}
+	if (batch->first == NULL)
+		return coro_queue_pop(latency);
+	if (w->latency_streak < CORO_LATENCY_BURST) {
+		++w->latency_streak;
+		return coro_queue_pop(latency);
+	}
+	w->latency_streak = 0;
+	return coro_queue_pop(batch);
+}
+
+/** Put @a c into the ready queue of @a w. */
+static void
+coro_ready_push(struct coro_worker *w, struct coro *c)
+{
+	c->state = CORO_READY;
+	/* Only the latency class pays for the clock read. */
+	if (c->sched_class == CORO_CLASS_LATENCY)
+		c->deadline = coro_clock_ns() + c->latency;
+	if (! coro_is_mt) {
+		coro_ready_insert(w, c);
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	coro_ready_insert(w, c);
+	pthread_mutex_unlock(&w->lock);
+	/*
+	 * Pairs with the check in the idle worker: either it sees
+	 * the new coroutine, or here the worker is seen idle.
+	 */
+	__atomic_add_fetch(&coro_ready_count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_idle_count, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&coro_work_lock);
+		pthread_cond_signal(&coro_work_cond);
+		pthread_mutex_unlock(&coro_work_lock);
+	} else if (__atomic_load_n(&coro_is_polling, __ATOMIC_SEQ_CST)) {
+		coro_reactor_notify();
+	}
+}
+
+/** Take the first ready coroutine of @a w, NULL if none. */
+static struct coro *
+coro_ready_pop(struct coro_worker *w)
+{
+	if (! coro_is_mt)
+		return coro_ready_pick(w);
+	if (__atomic_load_n(&w->ready[CORO_CLASS_LATENCY].first,
+			    __ATOMIC_RELAXED) == NULL &&
+	    __atomic_load_n(&w->ready[CORO_CLASS_BATCH].first,
+			    __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	pthread_mutex_lock(&w->lock);
+	struct coro *c = coro_ready_pick(w);
+	pthread_mutex_unlock(&w->lock);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_ready_count, 1, __ATOMIC_SEQ_CST);
+	return c;
+}
+
+/**
+ * Worker to give a new or woken up coroutine to. A worker keeps
+ * them for itself, other threads spread them round-robin.
+ */
+static struct coro_worker *
+coro_worker_for_push(void)
+{
+	struct coro_worker *w = coro_worker_current();
+	if (! coro_is_mt)
+		return &coro_main_worker;
+	if (w != NULL && w != &coro_main_worker)
+		return w;
+	unsigned i = __atomic_fetch_add(&coro_next_worker, 1,
+					__ATOMIC_RELAXED);
+	return &coro_workers[i % coro_worker_count];
+}
+
+/**
+ * Complete a switch on the side of the resumed context: deal with
+ * the coroutine which was switched out. Its stack is not used
+ * anymore, so now it can be given to other threads.
+ */
+static void
+coro_switch_finish(struct coro_worker *w)
+{
+	struct coro *c = w->switch_prev;
+	enum coro_switch_op op = w->switch_op;
+	w->switch_op = CORO_SWITCH_NONE;
+	switch (op) {
+	case CORO_SWITCH_NONE:
+		break;
+	case CORO_SWITCH_YIELD:
+		coro_ready_push(w, c);
+		break;
+	case CORO_SWITCH_SUSPEND:
+		coro_mutex_lock(&coro_sched_lock);
+		if (c->is_wakeup_pending) {
+			c->is_wakeup_pending = false;
+			coro_mutex_unlock(&coro_sched_lock);
+			coro_ready_push(w, c);
+			break;
+		}
+		c->state = CORO_WAITING;
+		coro_queue_push(&coro_waiting, c);
+		if (--coro_active_count == 0 && coro_is_mt)
+			pthread_cond_signal(&coro_finished_cond);
+		coro_mutex_unlock(&coro_sched_lock);
+		break;
+	case CORO_SWITCH_FINISH:
+		coro_mutex_lock(&coro_sched_lock);
+		c->state = CORO_FINISHED;
+		coro_queue_push(&coro_finished, c);
+		--coro_active_count;
+		if (coro_is_mt)
+			pthread_cond_signal(&coro_finished_cond);
+		coro_mutex_unlock(&coro_sched_lock);
+		break;
+	}
+}
+
+/**
+ * Switch the current coroutine of @a w to @a to. The switched out
+ * one is handled according to @a op.
+ */
+static void
+coro_switch(struct coro_worker *w, struct coro *to, enum coro_switch_op op)
+{
+	if (to->step != NULL) {
+		/* Stackless ones run on the scheduler's stack. */
+		w->step_next = to;
+		to = &w->sched;
+	}
+	struct coro *from = w->this_coro;
+	++from->switch_count;
+	long long now = 0;
+	if (coro_is_accounting) {
+		/* One clock read serves both sides of the switch. */
+		now = coro_clock_ns();
+		from->work_time += now - from->slice_start;
+		from->switch_out_time = now;
+		to->wait_time += now - to->switch_out_time;
+		to->slice_start = now;
+	} else {
+		to->slice_start = 0;
+	}
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_switch(w, from, to, op, now);
+	w->switch_prev = from;
+	w->switch_op = op;
+	to->state = CORO_RUNNING;
+	w->this_coro = to;
+	coro_ctx_jump(from, to);
+	/* Could be resumed by another thread. */
+	coro_switch_finish(coro_worker_current());
+}
+
+/**
+ * Give the CPU to the next ready coroutine, or to the scheduler if
+ * nobody is ready.
+ */
+static void
+coro_switch_out(struct coro_worker *w, enum coro_switch_op op)
+{
+	struct coro *to = coro_ready_pop(w);
+	coro_switch(w, to != NULL ? to : &w->sched, op);
+}
+
+/**
+ * Call the step function of the stackless coroutine @a c on the
+ * scheduler's stack of @a w, and handle its result like a switch
+ * out.
+ */
+static void
+coro_step(struct coro_worker *w, struct coro *c)
+{
+	struct coro *sched = w->this_coro;
+	++sched->switch_count;
+	long long now = 0;
+	if (coro_is_accounting) {
+		now = coro_clock_ns();
+		sched->work_time += now - sched->slice_start;
+		c->wait_time += now - c->switch_out_time;
+	}
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_record(w, CORO_TRACE_SWITCH_IN, c, 0, now);
+	c->state = CORO_RUNNING;
+	w->this_coro = c;
+	struct coro_frame *frame = coro_frame(c);
+	enum coro_step rc = c->step(frame);
+	w->this_coro = sched;
+	++c->switch_count;
+	long long end = 0;
+	if (coro_is_accounting) {
+		end = coro_clock_ns();
+		c->work_time += end - now;
+		c->switch_out_time = end;
+		sched->slice_start = end;
+	}
+	if (__builtin_expect(coro_is_tracing, false)) {
+		if (rc == CORO_STEP_FINISH)
+			coro_trace_record(w, CORO_TRACE_FINISH, c, 0, end);
+		else
+			coro_trace_record(w, CORO_TRACE_SWITCH_OUT, c,
+					  rc == CORO_STEP_YIELD ?
+					  CORO_TRACE_OUT_YIELD :
+					  CORO_TRACE_OUT_SUSPEND, end);
+	}
+	w->switch_prev = c;
+	switch (rc) {
+	case CORO_STEP_YIELD:
+		w->switch_op = CORO_SWITCH_YIELD;
+		break;
+	case CORO_STEP_SUSPEND:
+		w->switch_op = CORO_SWITCH_SUSPEND;
+		break;
+	case CORO_STEP_FINISH:
+		c->ret = frame->ret;
+		w->switch_op = CORO_SWITCH_FINISH;
+		break;
+	}
+	coro_switch_finish(w);
+}
+
+/**
+ * Next coroutine for the scheduler loop of @a w - a stackless one
+ * handed over to it, or the first ready one.
+ */
+static struct coro *
+coro_worker_next(struct coro_worker *w)
+{
+	struct coro *c = w->step_next;
+	if (c == NULL)
+		return coro_ready_pop(w);
+	w->step_next = NULL;
+	return c;
+}
+
+/** Run @a c from the scheduler loop of @a w. */
+static void
+coro_worker_run(struct coro_worker *w, struct coro *c)
+{
+	if (c->step != NULL)
+		coro_step(w, c);
+	else
+		coro_switch(w, c, CORO_SWITCH_NONE);
+}
+
+/**
+ * Suspend the current coroutine. The caller holds coro_sched_lock
+ * and has already published the coroutine for its waker. The lock
+ * is released here, and a wakeup coming right after that is not
+ * lost.
+ */
+static void
+coro_park_locked(struct coro_worker *w)
+{
+	w->this_coro->state = CORO_SUSPENDING;
+	coro_mutex_unlock(&coro_sched_lock);
+	coro_switch_out(w, CORO_SWITCH_SUSPEND);
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_worker *w = coro_worker_current();
+	coro_mutex_lock(&coro_sched_lock);
+	coro_park_locked(w);
+}
+
+/** Same as coro_wakeup(), but coro_sched_lock is already held. */
+static void
+coro_wakeup_locked(struct coro *c)
+{
+	/*
+	 * A stackless step can not suspend under the lock, so it is
+	 * treated as suspending all the time it runs.
+	 */
+	if (c->state == CORO_SUSPENDING ||
+	    (c->state == CORO_RUNNING && c->step != NULL)) {
+		c->is_wakeup_pending = true;
+		return;
+	}
+	if (c->state != CORO_WAITING)
+		return;
+	coro_queue_remove(&coro_waiting, c);
+	++coro_active_count;
+	coro_ready_push(coro_worker_for_push(), c);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	coro_wakeup_locked(c);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+/** Descriptor state, the table grows on demand. */
+static struct coro_fd *
+coro_fd_get(int fd)
+{
+	if (fd >= coro_fd_count) {
+		int count = coro_fd_count * 2;
+		if (count <= fd)
+			count = fd + 1;
+		struct coro_fd *fds = realloc(coro_fds, count * sizeof(*fds));
+		if (fds == NULL)
+			handle_error();
+		memset(fds + coro_fd_count, 0,
+		       (count - coro_fd_count) * sizeof(*fds));
+		coro_fds = fds;
+		coro_fd_count = count;
+	}
+	return &coro_fds[fd];
+}
+
+/** Arm the one-shot epoll event for the current waiters of @a fd. */
+static int
+coro_fd_arm(int fd, struct coro_fd *st)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	if (st->waiters[CORO_IO_DIR_READ] != NULL)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (st->waiters[CORO_IO_DIR_WRITE] != NULL)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+	if (epoll_ctl(coro_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+	return epoll_ctl(coro_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/** Wake up all the coroutines of the list and empty it. */
+static void
+coro_io_wake_all(struct coro_io_waiter **list)
+{
+	struct coro_io_waiter *w = *list;
+	*list = NULL;
+	while (w != NULL) {
+		/* The waiter can leave right after the wakeup. */
+		struct coro_io_waiter *next = w->next;
+		--coro_io_wait_count;
+		coro_wakeup_locked(w->c);
+		w = next;
+	}
+}
+
+/** Create the epoll descriptor, if not yet. */
+static void
+coro_reactor_create(void)
+{
+	if (coro_epoll_fd >= 0)
+		return;
+	coro_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (coro_epoll_fd < 0)
+		handle_error();
+}
+
+/** Create the eventfd of coro_reactor_notify(), if not yet. */
+static void
+coro_reactor_create_notify(void)
+{
+	if (coro_event_fd >= 0)
+		return;
+	coro_reactor_create();
+	coro_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (coro_event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = coro_event_fd;
+	if (epoll_ctl(coro_epoll_fd, EPOLL_CTL_ADD, coro_event_fd, &ev) != 0)
+		handle_error();
+}
+
+/** Put @a t into the wheel slot matching its expiration tick. */
+static void
+coro_wheel_insert(struct coro_timer *t)
+{
+	long long expire = t->expire;
+	if (expire < coro_wheel_tick)
+		expire = coro_wheel_tick;
+	if (expire - coro_wheel_tick >= CORO_WHEEL_SPAN)
+		expire = coro_wheel_tick + CORO_WHEEL_SPAN - 1;
+	long long delta = expire - coro_wheel_tick;
+	int level = 0;
+	while (delta >= 1LL << (CORO_WHEEL_BITS * (level + 1)))
+		++level;
+	int slot = (expire >> (CORO_WHEEL_BITS * level)) & CORO_WHEEL_MASK;
+	struct coro_timer **head = &coro_wheel[level][slot];
+	t->level = level;
+	t->slot = slot;
+	t->next = *head;
+	t->prev = head;
+	if (*head != NULL)
+		(*head)->prev = &t->next;
+	*head = t;
+	coro_wheel_map[level] |= 1ULL << slot;
+}
+
+/**
+ * Arm a timer for the current coroutine @a c to be woken up at
+ * @a deadline, in nanoseconds of coro_clock_ns().
+ */
+static void
+coro_timer_add(struct coro_timer *t, struct coro *c, long long deadline)
+{
+	t->c = c;
+	t->is_expired = false;
+	t->expire = (deadline + CORO_TIMER_TICK_NS - 1) / CORO_TIMER_TICK_NS;
+	coro_reactor_create();
+	if (coro_timer_count++ == 0) {
+		/* The wheel is empty, skip the ticks it slept through. */
+		long long now = coro_clock_ns() / CORO_TIMER_TICK_NS;
+		if (coro_wheel_tick < now)
+			coro_wheel_tick = now;
+	}
+	coro_wheel_insert(t);
+	if (coro_is_mt && coro_poll_deadline >= 0 &&
+	    t->expire < coro_poll_deadline)
+		coro_reactor_notify();
+}
+
+/** Take @a t out of the wheel. */
+static void
+coro_wheel_unlink(struct coro_timer *t)
+{
+	*t->prev = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	if (coro_wheel[t->level][t->slot] == NULL)
+		coro_wheel_map[t->level] &= ~(1ULL << t->slot);
+}
+
+/** Disarm a timer which has not fired. */
+static void
+coro_timer_remove(struct coro_timer *t)
+{
+	coro_wheel_unlink(t);
+	--coro_timer_count;
+}
+
+/**
+ * Move the timers of the current slot of each upper level to the
+ * finer ones. Called when coro_wheel_tick starts a new round of
+ * level 0.
+ */
+static void
+coro_wheel_cascade(void)
+{
+	for (int level = 1; level < CORO_WHEEL_LEVELS; ++level) {
+		int slot = (coro_wheel_tick >> (CORO_WHEEL_BITS * level)) &
+			   CORO_WHEEL_MASK;
+		struct coro_timer *t = coro_wheel[level][slot];
+		coro_wheel[level][slot] = NULL;
+		coro_wheel_map[level] &= ~(1ULL << slot);
+		while (t != NULL) {
+			struct coro_timer *next = t->next;
+			coro_wheel_insert(t);
+			t = next;
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+/** Fire the timers expiring at the tick @a now or earlier. */
+static void
+coro_wheel_advance(long long now)
+{
+	if (coro_timer_count == 0) {
+		if (coro_wheel_tick <= now)
+			coro_wheel_tick = now + 1;
+		return;
+	}
+	while (coro_wheel_tick <= now) {
+		int slot = coro_wheel_tick & CORO_WHEEL_MASK;
+		if (slot == 0)
+			coro_wheel_cascade();
+		uint64_t map = coro_wheel_map[0] >> slot;
+		if (map == 0) {
+			/* Nothing till the end of the round. */
+			long long next = (coro_wheel_tick | CORO_WHEEL_MASK) + 1;
+			coro_wheel_tick = next <= now ? next : now + 1;
+			continue;
+		}
+		long long at = coro_wheel_tick + __builtin_ctzll(map);
+		if (at > now) {
+			coro_wheel_tick = now + 1;
+			break;
+		}
+		struct coro_timer *t = coro_wheel[0][at & CORO_WHEEL_MASK];
+		coro_wheel[0][at & CORO_WHEEL_MASK] = NULL;
+		coro_wheel_map[0] &= ~(1ULL << (at & CORO_WHEEL_MASK));
+		while (t != NULL) {
+			struct coro_timer *next = t->next;
+			t->is_expired = true;
+			--coro_timer_count;
+			coro_wakeup_locked(t->c);
+			t = next;
+		}
+		coro_wheel_tick = at + 1;
+	}
+}
+
+/**
+ * The tick when the wheel has work - a timer fires or a slot
+ * cascades. LLONG_MAX, if there are no timers.
+ */
+static long long
+coro_wheel_next(void)
+{
+	if (coro_timer_count == 0)
+		return LLONG_MAX;
+	long long tick = coro_wheel_tick;
+	int slot = tick & CORO_WHEEL_MASK;
+	if (slot == 0)
+		return tick;
+	uint64_t map = coro_wheel_map[0] >> slot;
+	if (map != 0)
+		return tick + __builtin_ctzll(map);
+	/*
+	 * The timers in the slots behind are of the next round, it is
+	 * the nearest work then - no upper slot cascades before it.
+	 */
+	if (coro_wheel_map[0] != 0)
+		return (tick | CORO_WHEEL_MASK) + 1;
+	long long next = LLONG_MAX;
+	for (int level = 1; level < CORO_WHEEL_LEVELS; ++level) {
+		map = coro_wheel_map[level];
+		if (map == 0)
+			continue;
+		/*
+		 * The current slot was cascaded already, so the slots
+		 * are due in the order starting after it.
+		 */
+		int shift = CORO_WHEEL_BITS * level;
+		int from = (((tick >> shift) & CORO_WHEEL_MASK) + 1) &
+			   CORO_WHEEL_MASK;
+		map = (map >> from) | (map << ((64 - from) & 63));
+		long long at = ((tick >> shift) + __builtin_ctzll(map) + 1) <<
+			       shift;
+		if (at < next)
+			next = at;
+	}
+	return next;
+}
+
+/** Milliseconds till the tick @a tick, -1 for LLONG_MAX. */
+static int
+coro_wheel_timeout(long long tick)
+{
+	if (tick == LLONG_MAX)
+		return -1;
+	long long left = tick * CORO_TIMER_TICK_NS - coro_clock_ns();
+	if (left <= 0)
+		return 0;
+	left = (left + 999999) / 1000000;
+	return left > INT_MAX ? INT_MAX : left;
+}
+
+/**
+ * Wake up the coroutines whose blocking calls are done. The caller
+ * holds coro_sched_lock.
+ */
+static void
+coro_blocking_deliver_locked(void)
+{
+	if (__atomic_load_n(&coro_blocking_done, __ATOMIC_ACQUIRE) == NULL)
+		return;
+	pthread_mutex_lock(&coro_blocking_lock);
+	struct coro_blocking_task *t = coro_blocking_done;
+	coro_blocking_done = NULL;
+	pthread_mutex_unlock(&coro_blocking_lock);
+	while (t != NULL) {
+		/* The task is gone as soon as its coroutine runs. */
+		struct coro_blocking_task *next = t->next;
+		t->is_done = true;
+		__atomic_sub_fetch(&coro_blocking_count, 1, __ATOMIC_SEQ_CST);
+		coro_wakeup_locked(t->c);
+		t = next;
+	}
+}
+
+#if CORO_HAS_URING
+
+static int
+coro_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, coro_uring.fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+/** Check that the kernel knows all the operations used here. */
+static bool
+coro_uring_has_ops(int fd)
+{
+	static const int ops[] = {
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ACCEPT,
+		IORING_OP_CONNECT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+	};
+	size_t size = sizeof(struct io_uring_probe) +
+		      IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL)
+		handle_error();
+	bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			  probe, IORING_OP_LAST) == 0;
+	for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); ++i) {
+		ok = ops[i] <= probe->last_op &&
+		     (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+	free(probe);
+	return ok;
+}
+
+/**
+ * Set up the ring and add it to the epoll set, so the scheduler
+ * blocks on both in epoll_wait(). Returns -1, if the kernel can
+ * not do it.
+ */
+static int
+coro_uring_create(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = CORO_URING_CQ_ENTRIES;
+	int fd = syscall(__NR_io_uring_setup, CORO_URING_SQ_ENTRIES, &params);
+	if (fd < 0)
+		return -1;
+	unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+			IORING_FEAT_RW_CUR_POS;
+	if ((params.features & need) != need || ! coro_uring_has_ops(fd)) {
+		close(fd);
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+	char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		munmap(ring, ring_size);
+		close(fd);
+		return -1;
+	}
+	struct coro_uring *u = &coro_uring;
+	u->fd = fd;
+	u->ring = ring;
+	u->ring_size = ring_size;
+	u->sqes = sqes;
+	u->sqes_size = sqes_size;
+	u->sq_head = (unsigned *)(ring + params.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	u->sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+	u->sq_flags = (unsigned *)(ring + params.sq_off.flags);
+	u->sq_array = (unsigned *)(ring + params.sq_off.array);
+	u->sq_entries = params.sq_entries;
+	u->sq_pending = 0;
+	u->cq_head = (unsigned *)(ring + params.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	u->cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+	coro_reactor_create();
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(coro_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		handle_error();
+	return 0;
+}
+
+static void
+coro_uring_destroy(void)
+{
+	struct coro_uring *u = &coro_uring;
+	if (u->fd < 0)
+		return;
+	if (coro_epoll_fd >= 0)
+		epoll_ctl(coro_epoll_fd, EPOLL_CTL_DEL, u->fd, NULL);
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+/** Hand the prepared operations over to the kernel. */
+static void
+coro_uring_submit(void)
+{
+	struct coro_uring *u = &coro_uring;
+	while (u->sq_pending > 0) {
+		int rc = coro_uring_enter(u->sq_pending, 0, 0);
+		if (rc >= 0) {
+			u->sq_pending -= rc;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		/*
+		 * Busy means completions the kernel could not put into the
+		 * full queue. They are flushed by the next reap, and the
+		 * rest is submitted then.
+		 */
+		if (errno == EBUSY || errno == EAGAIN)
+			return;
+		handle_error();
+	}
+}
+
+/**
+ * Wake up the coroutines whose operations have completed. The
+ * completions are read from the shared memory, so there are no
+ * system calls unless the queue has overflown.
+ */
+static void
+coro_uring_reap_locked(void)
+{
+	struct coro_uring *u = &coro_uring;
+	while (true) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			struct coro_uring_req *req =
+				(struct coro_uring_req *)(uintptr_t)cqe->user_data;
+			/* Cancellations are not waited for. */
+			if (req == NULL)
+				continue;
+			req->res = cqe->res;
+			req->is_done = true;
+			--coro_io_wait_count;
+			coro_wakeup_locked(req->c);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		if ((__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+		     IORING_SQ_CQ_OVERFLOW) == 0)
+			break;
+		if (coro_uring_enter(0, 0, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			handle_error();
+	}
+	coro_uring_submit();
+}
+
+/**
+ * Take a free submission entry, submitting the prepared ones if
+ * the queue is full. The caller fills it and commits.
+ */
+static struct io_uring_sqe *
+coro_uring_sqe_get(void)
+{
+	struct coro_uring *u = &coro_uring;
+	unsigned tail = *u->sq_tail;
+	while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	       u->sq_entries) {
+		coro_uring_submit();
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+		    u->sq_entries)
+			coro_uring_reap_locked();
+	}
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	return sqe;
+}
+
+/** Make the filled entry visible to the kernel. */
+static void
+coro_uring_sqe_commit(void)
+{
+	struct coro_uring *u = &coro_uring;
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	if (++u->sq_pending >= CORO_URING_BATCH)
+		coro_uring_submit();
+	else if (coro_is_mt && coro_poll_deadline >= 0)
+		coro_reactor_notify();
+}
+
+#endif /* CORO_HAS_URING */
+
+/**
+ * Wait for I/O events, or only check for them if @a is_blocking is
+ * false. Blocking wait is limited by the nearest timer. Wake up the
+ * coroutines whose events have come, timers have expired or
+ * blocking calls are done.
+ */
+static void
+coro_reactor_poll(bool is_blocking)
+{
+	struct epoll_event events[CORO_EPOLL_BATCH];
+	int count = 0;
+	if (is_blocking) {
+		coro_mutex_lock(&coro_sched_lock);
+#if CORO_HAS_URING
+		if (coro_uring.fd >= 0)
+			coro_uring_submit();
+#endif
+		coro_poll_deadline = coro_wheel_next();
+		int timeout = coro_wheel_timeout(coro_poll_deadline);
+		coro_mutex_unlock(&coro_sched_lock);
+		count = epoll_wait(coro_epoll_fd, events, CORO_EPOLL_BATCH,
+				   timeout);
+	} else if (__atomic_load_n(&coro_io_wait_count,
+				   __ATOMIC_RELAXED) > 0 && ! coro_io_is_uring()) {
+		count = epoll_wait(coro_epoll_fd, events, CORO_EPOLL_BATCH, 0);
+	}
+	if (count < 0) {
+		if (errno != EINTR)
+			handle_error();
+		count = 0;
+	}
+	coro_mutex_lock(&coro_sched_lock);
+	if (is_blocking)
+		coro_poll_deadline = -1;
+	for (int i = 0; i < count; ++i) {
+		int fd = events[i].data.fd;
+		uint32_t e = events[i].events;
+		if (fd == coro_event_fd) {
+			uint64_t value;
+			if (read(fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+#if CORO_HAS_URING
+		/* The completions are reaped below. */
+		if (fd == coro_uring.fd)
+			continue;
+#endif
+		struct coro_fd *st = &coro_fds[fd];
+		if ((e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) != 0)
+			coro_io_wake_all(&st->waiters[CORO_IO_DIR_READ]);
+		if ((e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0)
+			coro_io_wake_all(&st->waiters[CORO_IO_DIR_WRITE]);
+		/* One-shot - the other direction needs a new arm. */
+		if ((st->waiters[CORO_IO_DIR_READ] != NULL ||
+		     st->waiters[CORO_IO_DIR_WRITE] != NULL) &&
+		    coro_fd_arm(fd, st) != 0)
+			handle_error();
+	}
+#if CORO_HAS_URING
+	if (coro_uring.fd >= 0)
+		coro_uring_reap_locked();
+#endif
+	if (coro_timer_count > 0)
+		coro_wheel_advance(coro_clock_ns() / CORO_TIMER_TICK_NS);
+	coro_blocking_deliver_locked();
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+/** True, if some coroutines wait for I/O, timers or blocking calls. */
+static inline bool
+coro_reactor_is_waited(void)
+{
+	return __atomic_load_n(&coro_io_wait_count, __ATOMIC_SEQ_CST) > 0 ||
+	       __atomic_load_n(&coro_timer_count, __ATOMIC_SEQ_CST) > 0 ||
+	       __atomic_load_n(&coro_blocking_count, __ATOMIC_SEQ_CST) > 0;
+}
+
+/**
+ * Poll for I/O and timers without blocking once per
+ * CORO_POLL_PERIOD calls.
+ */
+static inline void
+coro_reactor_tick(struct coro_worker *w)
+{
+	if (coro_reactor_is_waited() && ++w->poll_tick >= CORO_POLL_PERIOD) {
+		w->poll_tick = 0;
+		coro_reactor_poll(false);
+	}
+}
+
+/**
+ * Deadline in nanoseconds of coro_clock_ns() after @a usec
+ * microseconds. -1 for a negative @a usec - no deadline.
+ */
+static long long
+coro_deadline(long long usec)
+{
+	if (usec < 0)
+		return -1;
+	return coro_clock_ns() + usec * 1000;
+}
+
+/**
+ * Park the current coroutine until a wakeup or @a deadline, -1 is
+ * none. The caller holds coro_sched_lock, and holds it again on
+ * return. Returns false, if the deadline has passed.
+ */
+static bool
+coro_park_until_locked(struct coro_worker *w, long long deadline)
+{
+	if (deadline < 0) {
+		coro_park_locked(w);
+		coro_mutex_lock(&coro_sched_lock);
+		return true;
+	}
+	if (deadline <= coro_clock_ns())
+		return false;
+	struct coro_timer t;
+	coro_timer_add(&t, w->this_coro, deadline);
+	coro_park_locked(w);
+	coro_mutex_lock(&coro_sched_lock);
+	if (t.is_expired)
+		return false;
+	coro_timer_remove(&t);
+	return true;
+}
+
+int
+coro_suspend_timeout(long long usec)
+{
+	struct coro_worker *w = coro_worker_current();
+	long long deadline = coro_deadline(usec);
+	coro_mutex_lock(&coro_sched_lock);
+	bool is_woken = coro_park_until_locked(w, deadline);
+	coro_mutex_unlock(&coro_sched_lock);
+	if (is_woken)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+void
+coro_sleep(long long usec)
+{
+	if (usec <= 0) {
+		coro_yield();
+		return;
+	}
+	long long deadline = coro_deadline(usec);
+	coro_mutex_lock(&coro_sched_lock);
+	/* Another worker can resume the coroutine after a wakeup. */
+	while (coro_park_until_locked(coro_worker_current(), deadline))
+		;
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+void
+coro_yield(void)
+{
+	struct coro_worker *w = coro_worker_current();
+	coro_reactor_tick(w);
+	struct coro *to = coro_ready_pop(w);
+	if (to == NULL)
+		return;
+	coro_switch(w, to, CORO_SWITCH_YIELD);
+}
+
+bool
+coro_yield_if_quantum_expired(void)
+{
+	struct coro *c = coro_this();
+	long long now = coro_clock_ns();
+	if (c->slice_start == 0) {
+		/* Accounting is off, the run starts being measured now. */
+		c->slice_start = now;
+		return false;
+	}
+	if (now - c->slice_start < c->quantum)
+		return false;
+	long long switch_count = c->switch_count;
+	coro_yield();
+	if (c->switch_count == switch_count) {
+		/*
+		 * Nobody else to run - a new quantum starts anyway. The
+		 * run goes on, so its time so far is kept.
+		 */
+		if (coro_is_accounting)
+			c->work_time += now - c->slice_start;
+		c->slice_start = now;
+		return false;
+	}
+	return true;
+}
+
+#if CORO_HAS_URING
+
+/**
+ * Queue an io_uring operation and park the current coroutine until
+ * it completes. The entry is filled by the caller from @a proto. On
+ * @a deadline the operation is cancelled, but its completion is
+ * still waited for - the request and the buffers live till then. An
+ * operation completed despite the cancel keeps its result.
+ * @retval >= 0 Result of the operation.
+ * @retval -1 Error in errno.
+ */
+static int
+coro_uring_io(const struct io_uring_sqe *proto, long long deadline)
+{
+	struct coro_worker *w = coro_worker_current();
+	struct coro_uring_req req;
+	req.c = w->this_coro;
+	req.res = 0;
+	req.is_done = false;
+	coro_mutex_lock(&coro_sched_lock);
+	struct io_uring_sqe *sqe = coro_uring_sqe_get();
+	*sqe = *proto;
+	sqe->user_data = (uintptr_t)&req;
+	coro_uring_sqe_commit();
+	++coro_io_wait_count;
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_record(w, CORO_TRACE_IO_PARK, req.c, proto->fd, 0);
+	bool is_cancelled = false;
+	while (! req.is_done) {
+		/* Another worker can resume the coroutine each time. */
+		w = coro_worker_current();
+		if (is_cancelled) {
+			coro_park_locked(w);
+			coro_mutex_lock(&coro_sched_lock);
+			continue;
+		}
+		if (coro_park_until_locked(w, deadline) || req.is_done)
+			continue;
+		sqe = coro_uring_sqe_get();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)&req;
+		coro_uring_sqe_commit();
+		is_cancelled = true;
+	}
+	coro_mutex_unlock(&coro_sched_lock);
+	if (req.res >= 0)
+		return req.res;
+	errno = is_cancelled && req.res == -ECANCELED ? ETIMEDOUT : -req.res;
+	return -1;
+}
+
+/**
+ * Same as coro_uring_io(), but for a non-blocking descriptor the
+ * kernel may fail the operation with EAGAIN. Then the readiness for
+ * @a events is waited for in the ring too, and the operation is
+ * repeated.
+ */
+static int
+coro_uring_io_retry(const struct io_uring_sqe *proto, short events,
+		    long long deadline)
+{
+	while (true) {
+		int rc = coro_uring_io(proto, deadline);
+		if (rc >= 0 || errno != EAGAIN)
+			return rc;
+		struct io_uring_sqe poll;
+		memset(&poll, 0, sizeof(poll));
+		poll.opcode = IORING_OP_POLL_ADD;
+		poll.fd = proto->fd;
+		poll.poll32_events = events;
+		if (coro_uring_io(&poll, deadline) < 0)
+			return -1;
+	}
+}
+
+/** Read or write at the current file position. */
+static ssize_t
+coro_uring_rw(int opcode, int fd, const void *buf, size_t size,
+	      long long deadline)
+{
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = opcode;
+	sqe.fd = fd;
+	sqe.addr = (uintptr_t)buf;
+	sqe.len = size > INT_MAX ? INT_MAX : size;
+	sqe.off = (uint64_t)-1;
+	return coro_uring_io_retry(&sqe, opcode == IORING_OP_READ ?
+				   POLLIN : POLLOUT, deadline);
+}
+
+#endif /* CORO_HAS_URING */
+
+/**
+ * Suspend the current coroutine until @a fd is ready for reading
+ * or writing - @a dir is CORO_IO_DIR_* - or until @a deadline.
+ */
+static int
+coro_io_wait(int fd, int dir, long long deadline)
+{
+#if CORO_HAS_URING
+	if (coro_io_is_uring()) {
+		struct io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.fd = fd;
+		sqe.poll32_events = dir == CORO_IO_DIR_READ ? POLLIN : POLLOUT;
+		return coro_uring_io(&sqe, deadline) < 0 ? -1 : 0;
+	}
+#endif
+	struct coro_worker *w = coro_worker_current();
+	struct coro_io_waiter waiter;
+	waiter.c = w->this_coro;
+	coro_mutex_lock(&coro_sched_lock);
+	coro_reactor_create();
+	struct coro_fd *st = coro_fd_get(fd);
+	waiter.next = st->waiters[dir];
+	st->waiters[dir] = &waiter;
+	if (coro_fd_arm(fd, st) != 0) {
+		int err = errno;
+		st->waiters[dir] = waiter.next;
+		coro_mutex_unlock(&coro_sched_lock);
+		errno = err;
+		return -1;
+	}
+	++coro_io_wait_count;
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_record(w, CORO_TRACE_IO_PARK, waiter.c, fd, 0);
+	bool is_woken = coro_park_until_locked(w, deadline);
+	/*
+	 * After a timeout or a spurious wakeup the waiter is still in
+	 * the list. The table could be reallocated meanwhile.
+	 */
+	struct coro_io_waiter **pos = &coro_fds[fd].waiters[dir];
+	for (; *pos != NULL; pos = &(*pos)->next) {
+		if (*pos == &waiter) {
+			*pos = waiter.next;
+			--coro_io_wait_count;
+			break;
+		}
+	}
+	coro_mutex_unlock(&coro_sched_lock);
+	if (is_woken)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+enum coro_io_backend
+coro_sched_set_io_backend(enum coro_io_backend backend)
+{
+#if CORO_HAS_URING
+	coro_mutex_lock(&coro_sched_lock);
+	if (backend == CORO_IO_URING && coro_uring.fd < 0)
+		coro_uring_create();
+	else if (backend == CORO_IO_EPOLL)
+		coro_uring_destroy();
+	coro_mutex_unlock(&coro_sched_lock);
+#else
+	(void)backend;
+#endif
+	return coro_io_is_uring() ? CORO_IO_URING : CORO_IO_EPOLL;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	return coro_read_timeout(fd, buf, size, -1);
+}
+
+ssize_t
+coro_read_timeout(int fd, void *buf, size_t size, long long usec)
+{
+	long long deadline = coro_deadline(usec);
+#if CORO_HAS_URING
+	if (coro_io_is_uring())
+		return coro_uring_rw(IORING_OP_READ, fd, buf, size, deadline);
+#endif
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_io_wait(fd, CORO_IO_DIR_READ, deadline) != 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	return coro_write_timeout(fd, buf, size, -1);
+}
+
+ssize_t
+coro_write_timeout(int fd, const void *buf, size_t size, long long usec)
+{
+	long long deadline = coro_deadline(usec);
+	const char *pos = buf;
+	size_t left = size;
+	while (left > 0) {
+#if CORO_HAS_URING
+		/* The ring waits for EAGAIN itself. */
+		ssize_t rc = coro_io_is_uring() ?
+			     coro_uring_rw(IORING_OP_WRITE, fd, pos, left,
+					   deadline) :
+			     write(fd, pos, left);
+#else
+		ssize_t rc = write(fd, pos, left);
+#endif
+		if (rc >= 0) {
+			pos += rc;
+			left -= rc;
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_io_wait(fd, CORO_IO_DIR_WRITE, deadline) != 0)
+			return -1;
+	}
+	return size;
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	return coro_accept_timeout(fd, addr, addrlen, -1);
+}
+
+int
+coro_accept_timeout(int fd, struct sockaddr *addr, socklen_t *addrlen,
+		    long long usec)
+{
+	long long deadline = coro_deadline(usec);
+#if CORO_HAS_URING
+	if (coro_io_is_uring()) {
+		struct io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ACCEPT;
+		sqe.fd = fd;
+		sqe.addr = (uintptr_t)addr;
+		sqe.addr2 = (uintptr_t)addrlen;
+		sqe.accept_flags = SOCK_NONBLOCK;
+		return coro_uring_io_retry(&sqe, POLLIN, deadline);
+	}
+#endif
+	while (true) {
+		int rc = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_io_wait(fd, CORO_IO_DIR_READ, deadline) != 0)
+			return -1;
+	}
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	return coro_connect_timeout(fd, addr, addrlen, -1);
+}
+
+int
+coro_connect_timeout(int fd, const struct sockaddr *addr,
+		     socklen_t addrlen, long long usec)
+{
+	if (connect(fd, addr, addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	if (coro_io_wait(fd, CORO_IO_DIR_WRITE, coro_deadline(usec)) != 0)
+		return -1;
+	int err;
+	socklen_t len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Helper thread of coro_blocking_call(). Runs the queued calls and
+ * hands the results over to the reactor.
+ */
+static void *
+coro_blocking_thread_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_blocking_lock);
+	while (true) {
+		struct coro_blocking_task *t = coro_blocking_first;
+		if (t == NULL) {
+			if (coro_blocking_is_stopped)
+				break;
+			++coro_blocking_idle_count;
+			pthread_cond_wait(&coro_blocking_cond,
+					  &coro_blocking_lock);
+			--coro_blocking_idle_count;
+			continue;
+		}
+		coro_blocking_first = t->next;
+		if (coro_blocking_first == NULL)
+			coro_blocking_last = NULL;
+		pthread_mutex_unlock(&coro_blocking_lock);
+		t->result = t->func(t->arg);
+		pthread_mutex_lock(&coro_blocking_lock);
+		t->next = coro_blocking_done;
+		__atomic_store_n(&coro_blocking_done, t, __ATOMIC_RELEASE);
+		/* The reactor takes the whole list on one notification. */
+		if (t->next == NULL)
+			coro_reactor_notify();
+	}
+	pthread_mutex_unlock(&coro_blocking_lock);
+	return NULL;
+}
+
+void *
+coro_blocking_call(coro_blocking_f func, void *arg)
+{
+	struct coro_worker *w = coro_worker_current();
+	struct coro_blocking_task task;
+	task.func = func;
+	task.arg = arg;
+	task.result = NULL;
+	task.c = w->this_coro;
+	task.is_done = false;
+	task.next = NULL;
+	coro_mutex_lock(&coro_sched_lock);
+	coro_reactor_create_notify();
+	__atomic_add_fetch(&coro_blocking_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&coro_blocking_lock);
+	if (coro_blocking_last != NULL)
+		coro_blocking_last->next = &task;
+	else
+		coro_blocking_first = &task;
+	coro_blocking_last = &task;
+	if (coro_blocking_idle_count > 0 ||
+	    coro_blocking_thread_count == CORO_BLOCKING_THREADS_MAX) {
+		pthread_cond_signal(&coro_blocking_cond);
+	} else {
+		errno = pthread_create(
+			&coro_blocking_threads[coro_blocking_thread_count],
+			NULL, coro_blocking_thread_f, NULL);
+		if (errno != 0)
+			handle_error();
+		++coro_blocking_thread_count;
+	}
+	pthread_mutex_unlock(&coro_blocking_lock);
+	/*
+	 * Wakeups from anybody but the reactor are spurious. The
+	 * coroutine can be resumed by another worker each time.
+	 */
+	while (! task.is_done) {
+		coro_park_locked(coro_worker_current());
+		coro_mutex_lock(&coro_sched_lock);
+	}
+	coro_mutex_unlock(&coro_sched_lock);
+	return task.result;
+}
+
+static void
+coro_wait_list_push(struct coro_wait_list *l, struct coro_waiter *w)
+{
+	w->is_queued = true;
+	w->next = NULL;
+	w->prev = l->last;
+	if (l->last != NULL)
+		l->last->next = w;
+	else
+		l->first = w;
+	l->last = w;
+}
+
+static void
+coro_wait_list_remove(struct coro_wait_list *l, struct coro_waiter *w)
+{
+	if (w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		l->first = w->next;
+	if (w->next != NULL)
+		w->next->prev = w->prev;
+	else
+		l->last = w->prev;
+	w->is_queued = false;
+}
+
+/** Wake up the first waiter of @a l, if any. */
+static void
+coro_wait_list_wake_one(struct coro_wait_list *l)
+{
+	struct coro_waiter *w = l->first;
+	if (w == NULL)
+		return;
+	coro_wait_list_remove(l, w);
+	coro_wakeup_locked(w->c);
+}
+
+static void
+coro_wait_list_wake_all(struct coro_wait_list *l)
+{
+	while (l->first != NULL)
+		coro_wait_list_wake_one(l);
+}
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
- */
-static struct coro coro_sched;
-/**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
- */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
-/**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Park the current coroutine on @a l until it is woken up or
+ * @a deadline passes. The caller holds coro_sched_lock, and holds
+ * it again on return. The wakeup can be spurious - from
+ * coro_wakeup() - so the caller checks its condition in a loop.
+ * Returns false on timeout. A wakeup from @a l which comes together
+ * with the timeout wins, so it is not lost.
  */
-static sigjmp_buf start_point;
+static bool
+coro_wait_locked(struct coro_wait_list *l, long long deadline)
+{
+	struct coro_worker *w = coro_worker_current();
+	struct coro_waiter waiter;
+	waiter.c = w->this_coro;
+	coro_wait_list_push(l, &waiter);
+	bool is_woken = coro_park_until_locked(w, deadline);
+	if (! waiter.is_queued)
+		return true;
+	coro_wait_list_remove(l, &waiter);
+	return is_woken;
+}
 
-/** Add a new coroutine to the beginning of the list. */
-static void
-coro_list_add(struct coro *c)
+struct coro_chan *
+coro_chan_new(int capacity)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	if (capacity < 1)
+		capacity = 1;
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		handle_error();
+	ch->msgs = malloc(capacity * sizeof(*ch->msgs));
+	if (ch->msgs == NULL)
+		handle_error();
+	ch->capacity = capacity;
+	return ch;
 }
 
-/** Remove a coroutine from the list. */
-static void
-coro_list_delete(struct coro *c)
+void
+coro_chan_delete(struct coro_chan *ch)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	free(ch->msgs);
+	free(ch);
 }
 
 int
-coro_status(const struct coro *c)
+coro_chan_send(struct coro_chan *ch, void *msg)
 {
-	return c->ret;
+	return coro_chan_send_timeout(ch, msg, -1);
 }
 
-long long
-coro_switch_count(const struct coro *c)
+int
+coro_chan_send_timeout(struct coro_chan *ch, void *msg, long long usec)
 {
-	return c->switch_count;
+	long long deadline = coro_deadline(usec);
+	bool is_timed_out = false;
+	coro_mutex_lock(&coro_sched_lock);
+	while (!ch->is_closed && ch->count == ch->capacity && !is_timed_out)
+		is_timed_out = !coro_wait_locked(&ch->senders, deadline);
+	if (ch->is_closed || ch->count == ch->capacity) {
+		coro_mutex_unlock(&coro_sched_lock);
+		errno = ch->is_closed ? EPIPE : ETIMEDOUT;
+		return -1;
+	}
+	int tail = ch->head + ch->count;
+	if (tail >= ch->capacity)
+		tail -= ch->capacity;
+	ch->msgs[tail] = msg;
+	++ch->count;
+	coro_wait_list_wake_one(&ch->receivers);
+	coro_mutex_unlock(&coro_sched_lock);
+	return 0;
 }
 
-bool
-coro_is_finished(const struct coro *c)
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
 {
-	return c->is_finished;
+	return coro_chan_recv_timeout(ch, msg, -1);
+}
+
+int
+coro_chan_recv_timeout(struct coro_chan *ch, void **msg, long long usec)
+{
+	long long deadline = coro_deadline(usec);
+	bool is_timed_out = false;
+	coro_mutex_lock(&coro_sched_lock);
+	while (!ch->is_closed && ch->count == 0 && !is_timed_out)
+		is_timed_out = !coro_wait_locked(&ch->receivers, deadline);
+	if (ch->count == 0) {
+		coro_mutex_unlock(&coro_sched_lock);
+		errno = ch->is_closed ? EPIPE : ETIMEDOUT;
+		return -1;
+	}
+	*msg = ch->msgs[ch->head];
+	if (++ch->head == ch->capacity)
+		ch->head = 0;
+	--ch->count;
+	coro_wait_list_wake_one(&ch->senders);
+	coro_mutex_unlock(&coro_sched_lock);
+	return 0;
 }
 
 void
-coro_delete(struct coro *c)
+coro_chan_close(struct coro_chan *ch)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	ch->is_closed = true;
+	coro_wait_list_wake_all(&ch->senders);
+	coro_wait_list_wake_all(&ch->receivers);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+struct coro_wait_group *
+coro_wait_group_new(void)
+{
+	struct coro_wait_group *wg = calloc(1, sizeof(*wg));
+	if (wg == NULL)
+		handle_error();
+	return wg;
+}
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg)
+{
+	free(wg);
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	wg->count += count;
+	if (wg->count <= 0)
+		coro_wait_list_wake_all(&wg->waiters);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	coro_wait_group_wait_timeout(wg, -1);
+}
+
+int
+coro_wait_group_wait_timeout(struct coro_wait_group *wg, long long usec)
+{
+	long long deadline = coro_deadline(usec);
+	bool is_timed_out = false;
+	coro_mutex_lock(&coro_sched_lock);
+	while (wg->count > 0 && !is_timed_out)
+		is_timed_out = !coro_wait_locked(&wg->waiters, deadline);
+	bool is_done = wg->count <= 0;
+	coro_mutex_unlock(&coro_sched_lock);
+	if (is_done)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	struct coro_mutex *m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		handle_error();
+	return m;
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	free(m);
+}
+
+/** Lock @a m under coro_sched_lock. Returns false on timeout. */
+static bool
+coro_mutex_acquire_locked(struct coro_mutex *m, long long deadline)
 {
-	free(c->stack);
-	free(c);
+	bool is_timed_out = false;
+	while (m->is_locked && !is_timed_out)
+		is_timed_out = !coro_wait_locked(&m->waiters, deadline);
+	if (m->is_locked)
+		return false;
+	m->is_locked = true;
+	return true;
 }
 
-/** Switch the current coroutine to an arbitrary one. */
 static void
-coro_yield_to(struct coro *to)
+coro_mutex_release_locked(struct coro_mutex *m)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	m->is_locked = false;
+	coro_wait_list_wake_one(&m->waiters);
 }
 
 void
-coro_yield(void)
+coro_mutex_acquire(struct coro_mutex *m)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	coro_mutex_acquire_timeout(m, -1);
+}
+
+int
+coro_mutex_acquire_timeout(struct coro_mutex *m, long long usec)
+{
+	long long deadline = coro_deadline(usec);
+	coro_mutex_lock(&coro_sched_lock);
+	bool is_acquired = coro_mutex_acquire_locked(m, deadline);
+	coro_mutex_unlock(&coro_sched_lock);
+	if (is_acquired)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+bool
+coro_mutex_try_acquire(struct coro_mutex *m)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	bool is_acquired = !m->is_locked;
+	m->is_locked = true;
+	coro_mutex_unlock(&coro_sched_lock);
+	return is_acquired;
+}
+
+void
+coro_mutex_release(struct coro_mutex *m)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	coro_mutex_release_locked(m);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	struct coro_cond *cond = calloc(1, sizeof(*cond));
+	if (cond == NULL)
+		handle_error();
+	return cond;
+}
+
+void
+coro_cond_delete(struct coro_cond *cond)
+{
+	free(cond);
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m)
+{
+	coro_cond_wait_timeout(cond, m, -1);
+}
+
+int
+coro_cond_wait_timeout(struct coro_cond *cond, struct coro_mutex *m,
+		       long long usec)
+{
+	long long deadline = coro_deadline(usec);
+	coro_mutex_lock(&coro_sched_lock);
+	/*
+	 * Releasing the mutex and joining the waiters is atomic under
+	 * the scheduler lock, so a signal in between is not lost.
+	 */
+	coro_mutex_release_locked(m);
+	bool is_signaled = coro_wait_locked(&cond->waiters, deadline);
+	/* The mutex is owned on return even after a timeout. */
+	coro_mutex_acquire_locked(m, -1);
+	coro_mutex_unlock(&coro_sched_lock);
+	if (is_signaled)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	coro_wait_list_wake_one(&cond->waiters);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_mutex_lock(&coro_sched_lock);
+	coro_wait_list_wake_all(&cond->waiters);
+	coro_mutex_unlock(&coro_sched_lock);
+}
+
+/** Reset the worker and make it the owner of the current thread. */
+static void
+coro_worker_create(struct coro_worker *w)
+{
+	memset(w, 0, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	w->sched.state = CORO_RUNNING;
+	w->this_coro = &w->sched;
+	coro_worker_this = w;
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	coro_worker_create(&coro_main_worker);
+	memset(&coro_waiting, 0, sizeof(coro_waiting));
+	memset(&coro_finished, 0, sizeof(coro_finished));
+	coro_active_count = 0;
+	coro_ready_count = 0;
+	coro_idle_count = 0;
+	coro_is_shutdown = false;
+	coro_is_mt = false;
+	coro_is_accounting = true;
+	coro_is_tracing = false;
+	coro_last_id = 0;
+	memset(coro_wheel, 0, sizeof(coro_wheel));
+	memset(coro_wheel_map, 0, sizeof(coro_wheel_map));
+	coro_timer_count = 0;
+	coro_poll_deadline = -1;
+	coro_main_worker.sched.slice_start = coro_clock_ns();
+	coro_wheel_tick = coro_main_worker.sched.slice_start /
+			  CORO_TIMER_TICK_NS;
+}
+
+/**
+ * Become the worker which blocks in epoll_wait() for everybody.
+ * Only one worker polls at a time, and only when there are I/O or
+ * timer waiters. Returns false, if the worker should sleep instead.
+ */
+static bool
+coro_worker_try_poll(void)
+{
+	if (! coro_reactor_is_waited() ||
+	    __atomic_exchange_n(&coro_is_polling, true, __ATOMIC_SEQ_CST))
+		return false;
+	/*
+	 * Pairs with coro_ready_push(): either the new coroutine is
+	 * seen here, or the poller is seen there and notified.
+	 */
+	if (__atomic_load_n(&coro_ready_count, __ATOMIC_SEQ_CST) == 0 &&
+	    ! coro_is_shutdown)
+		coro_reactor_poll(true);
+	__atomic_store_n(&coro_is_polling, false, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/**
+ * Worker thread of the M:N mode. Runs coroutines from its own
+ * queue, steals from the others when it is empty, and sleeps when
+ * there is nothing to run at all.
+ */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_this = w;
+	int id = w - coro_workers;
+	while (true) {
+		struct coro *c = coro_worker_next(w);
+		for (int i = 1; c == NULL && i < coro_worker_count; ++i) {
+			int victim = (id + i) % coro_worker_count;
+			c = coro_ready_pop(&coro_workers[victim]);
+		}
+		if (c != NULL) {
+			coro_worker_run(w, c);
+			continue;
+		}
+		if (coro_worker_try_poll())
+			continue;
+		pthread_mutex_lock(&coro_work_lock);
+		__atomic_add_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&coro_ready_count,
+				       __ATOMIC_SEQ_CST) == 0 &&
+		       ! coro_is_shutdown)
+			pthread_cond_wait(&coro_work_cond, &coro_work_lock);
+		__atomic_sub_fetch(&coro_idle_count, 1, __ATOMIC_SEQ_CST);
+		bool is_shutdown = coro_is_shutdown;
+		pthread_mutex_unlock(&coro_work_lock);
+		if (is_shutdown)
+			break;
+	}
+	return NULL;
+}
+
+void
+coro_sched_init_mt(int thread_count)
+{
+	coro_sched_init();
+	if (thread_count < 1)
+		thread_count = 1;
+	coro_workers = calloc(thread_count, sizeof(*coro_workers));
+	if (coro_workers == NULL)
+		handle_error();
+	coro_worker_count = thread_count;
+	coro_is_mt = true;
+	coro_reactor_create_notify();
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &coro_workers[i];
+		w->trace_thread = i + 1;
+		pthread_mutex_init(&w->lock, NULL);
+		w->sched.state = CORO_RUNNING;
+		w->this_coro = &w->sched;
+		errno = pthread_create(&w->thread, NULL, coro_worker_f, w);
+		if (errno != 0)
+			handle_error();
+	}
+}
+
+/** Wait for a finished coroutine in the M:N mode. */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+	pthread_mutex_lock(&coro_sched_lock);
+	struct coro *c;
+	while ((c = coro_queue_pop(&coro_finished)) == NULL &&
+	       (coro_active_count > 0 || coro_io_wait_count > 0 ||
+		coro_timer_count > 0 || coro_blocking_count > 0))
+		pthread_cond_wait(&coro_finished_cond, &coro_sched_lock);
+	if (c != NULL)
+		c->state = CORO_DEAD;
+	pthread_mutex_unlock(&coro_sched_lock);
+	return c;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	if (coro_is_mt)
+		return coro_sched_wait_mt();
+	struct coro_worker *w = &coro_main_worker;
+	while (true) {
+		struct coro *c = coro_queue_pop(&coro_finished);
+		if (c != NULL) {
+			c->state = CORO_DEAD;
+			return c;
+		}
+		c = coro_worker_next(w);
+		if (c == NULL) {
+			if (coro_io_wait_count == 0 && coro_timer_count == 0 &&
+			    coro_blocking_count == 0)
+				return NULL;
+			coro_reactor_poll(true);
+			continue;
 		}
 		is_sched_waiting = true;
-		coro_yield_to(coro_list);
+		coro_worker_run(w, c);
 		is_sched_waiting = false;
 	}
-	return NULL;
+}
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_is_mt) {
+		pthread_mutex_lock(&coro_work_lock);
+		coro_is_shutdown = true;
+		pthread_cond_broadcast(&coro_work_cond);
+		pthread_mutex_unlock(&coro_work_lock);
+		coro_reactor_notify();
+		for (int i = 0; i < coro_worker_count; ++i) {
+			pthread_join(coro_workers[i].thread, NULL);
+			pthread_mutex_destroy(&coro_workers[i].lock);
+			free(coro_workers[i].trace);
+		}
+		free(coro_workers);
+		coro_workers = NULL;
+		coro_worker_count = 0;
+		coro_is_mt = false;
+	}
+	pthread_mutex_lock(&coro_blocking_lock);
+	coro_blocking_is_stopped = true;
+	pthread_cond_broadcast(&coro_blocking_cond);
+	pthread_mutex_unlock(&coro_blocking_lock);
+	for (int i = 0; i < coro_blocking_thread_count; ++i)
+		pthread_join(coro_blocking_threads[i], NULL);
+	coro_blocking_thread_count = 0;
+	coro_blocking_is_stopped = false;
+	if (coro_event_fd >= 0) {
+		close(coro_event_fd);
+		coro_event_fd = -1;
+	}
+#if CORO_HAS_URING
+	coro_uring_destroy();
+#endif
+	if (coro_epoll_fd >= 0) {
+		close(coro_epoll_fd);
+		coro_epoll_fd = -1;
+	}
+	free(coro_fds);
+	coro_fds = NULL;
+	coro_fd_count = 0;
+	coro_is_tracing = false;
+	free(coro_main_worker.trace);
+	coro_main_worker.trace = NULL;
+	for (int cls = 0; cls < CORO_STACK_CLASS_COUNT; ++cls) {
+		struct coro_stack_class *pool = &coro_stack_pool[cls];
+		size_t map_size = ((size_t)CORO_STACK_SIZE_MIN << cls) +
+				  coro_page_size;
+		while (pool->free_list != NULL) {
+			struct coro *c = pool->free_list;
+			pool->free_list = c->next;
+			if (c->stack_slab != NULL)
+				continue;
+			if (munmap((char *)c->stack - coro_page_size,
+				   map_size) != 0)
+				handle_error();
+			--coro_stack_guarded_count;
+		}
+		pool->free_count = 0;
+		pool->slab = NULL;
+	}
+	/* A slab with a stack of a coroutine not deleted is left. */
+	while (coro_stack_slabs != NULL) {
+		struct coro_stack_slab *slab = coro_stack_slabs;
+		coro_stack_slabs = slab->next;
+		if (slab->used_count != 0)
+			continue;
+		if (munmap(slab->map, slab->map_size) != 0)
+			handle_error();
+		free(slab);
+	}
+	coro_stack_is_unguarded = false;
+}
+
+/** Drop the trace ring of @a w, the next event allocates a new one. */
+static void
+coro_trace_reset(struct coro_worker *w)
+{
+	free(w->trace);
+	w->trace = NULL;
+	w->trace_pos = 0;
+}
+
+void
+coro_trace_start(size_t capacity)
+{
+	uint64_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	coro_trace_reset(&coro_main_worker);
+	for (int i = 0; i < coro_worker_count; ++i)
+		coro_trace_reset(&coro_workers[i]);
+	coro_trace_mask = size - 1;
+	__atomic_store_n(&coro_is_tracing, true, __ATOMIC_SEQ_CST);
+}
+
+void
+coro_trace_stop(void)
+{
+	__atomic_store_n(&coro_is_tracing, false, __ATOMIC_SEQ_CST);
+}
+
+/** Write the events left in the ring of @a w, oldest first. */
+static int
+coro_trace_save_ring(FILE *f, const struct coro_worker *w)
+{
+	if (w->trace == NULL)
+		return 0;
+	uint64_t size = coro_trace_mask + 1;
+	uint64_t begin = w->trace_pos > size ? w->trace_pos - size : 0;
+	for (uint64_t pos = begin; pos < w->trace_pos; ++pos) {
+		const struct coro_trace_event *e =
+			&w->trace[pos & coro_trace_mask];
+		if (fwrite(e, sizeof(*e), 1, f) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+int
+coro_trace_save(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+	struct coro_trace_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CORO_TRACE_MAGIC, sizeof(header.magic));
+	header.version = CORO_TRACE_VERSION;
+	header.event_size = sizeof(struct coro_trace_event);
+	int rc = fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : -1;
+	if (rc == 0)
+		rc = coro_trace_save_ring(f, &coro_main_worker);
+	for (int i = 0; i < coro_worker_count && rc == 0; ++i)
+		rc = coro_trace_save_ring(f, &coro_workers[i]);
+	int err = errno;
+	if (fclose(f) != 0 && rc == 0) {
+		rc = -1;
+		err = errno;
+	}
+	errno = err;
+	return rc;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	struct coro_worker *w = coro_worker_current();
+	return w != NULL ? w->this_coro : NULL;
+}
+
+/**
+ * Run the coroutine function and give the finished coroutine back
+ * to the scheduler.
+ */
+static void __attribute__((noreturn))
+coro_run(struct coro *c)
+{
+	c->ret = c->func(c->func_arg);
+	struct coro_worker *w = coro_worker_current();
+	if (coro_is_mt) {
+		coro_switch_out(w, CORO_SWITCH_FINISH);
+		__builtin_unreachable();
+	}
+	/* Can not return - 'ret' address is invalid already! */
+	if (! is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	/* Let the scheduler return the coroutine right away. */
+	coro_switch(w, &w->sched, CORO_SWITCH_FINISH);
+	__builtin_unreachable();
+}
+
+/** Start of a coroutine on its first switch-in. */
+static void __attribute__((noreturn))
+coro_start(void)
+{
+	struct coro_worker *w = coro_worker_current();
+	coro_switch_finish(w);
+	coro_run(w->this_coro);
+}
+
+#if CORO_CTX_ASM
+
+/**
+ * The first instruction of every coroutine. It is entered by the
+ * very first switch into the frame made by coro_ctx_init(), and
+ * the switcher has already set this_coro of its worker.
+ */
+static void
+coro_entry(void)
+{
+	coro_start();
+}
+
+/**
+ * Prepare a context which starts the coroutine on its own stack.
+ * No syscalls - the initial frame is written right into the stack
+ * memory.
+ */
+static void
+coro_ctx_create(struct coro *c)
+{
+	coro_ctx_init(&c->sp, c->stack, c->stack_size, coro_entry);
 }
 
+#else /* ! CORO_CTX_ASM */
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -160,8 +3228,8 @@ static void
 coro_body(int signum)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	struct coro *c = coro_creating;
+	coro_creating = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -172,30 +3240,18 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_start();
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Without a way to write a frame for sigsetjmp() by hand the only
+ * portable way onto a new stack is a signal delivered on an
+ * alternative stack.
+ */
+static void
+coro_ctx_create(struct coro *c)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	coro_mutex_lock(&coro_create_lock);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -203,7 +3259,7 @@ coro_new(coro_f func, void *func_arg)
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -219,20 +3275,18 @@ coro_new(coro_f func, void *func_arg)
 	/* Create that new stack. */
 	stack_t oldst, newst;
 	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_size = c->stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	coro_creating = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		while (coro_creating != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -249,10 +3303,83 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	coro_mutex_unlock(&coro_create_lock);
+}
+
+#endif /* ! CORO_CTX_ASM */
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_with_stack(func, func_arg, CORO_STACK_SIZE_DEFAULT);
+}
+
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size)
+{
+	coro_mutex_lock(&coro_stack_lock);
+	struct coro *c = coro_stack_new(coro_stack_class_of(stack_size));
+	coro_mutex_unlock(&coro_stack_lock);
+	if (c == NULL)
+		return NULL;
+	c->ret = 0;
+	c->id = __atomic_add_fetch(&coro_last_id, 1, __ATOMIC_RELAXED);
+	c->step = NULL;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_wakeup_pending = false;
+	c->switch_count = 0;
+	c->work_time = 0;
+	c->wait_time = 0;
+	c->slice_start = 0;
+	c->switch_out_time = coro_is_accounting ? coro_clock_ns() : 0;
+	c->quantum = 0;
+	c->sched_class = CORO_CLASS_BATCH;
+	c->latency = 0;
+	coro_ctx_create(c);
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_record(coro_worker_current(), CORO_TRACE_CREATE, c,
+				  0, 0);
 
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	coro_mutex_lock(&coro_sched_lock);
+	++coro_active_count;
+	coro_mutex_unlock(&coro_sched_lock);
+	coro_ready_push(coro_worker_for_push(), c);
+	return c;
+}
+
+struct coro *
+coro_new_stackless(coro_step_f step, const void *frame, size_t frame_size)
+{
+	size_t alloc_size = frame_size;
+	if (alloc_size < sizeof(struct coro_frame))
+		alloc_size = sizeof(struct coro_frame);
+	struct coro *c = calloc(1, sizeof(*c) + alloc_size);
+	if (c == NULL)
+		return NULL;
+	c->id = __atomic_add_fetch(&coro_last_id, 1, __ATOMIC_RELAXED);
+	c->step = step;
+	c->stack_class = -1;
+	c->sched_class = CORO_CLASS_BATCH;
+	if (frame != NULL)
+		memcpy(coro_frame(c), frame, frame_size);
+	c->switch_out_time = coro_is_accounting ? coro_clock_ns() : 0;
+	if (__builtin_expect(coro_is_tracing, false))
+		coro_trace_record(coro_worker_current(), CORO_TRACE_CREATE, c,
+				  0, 0);
+
+	coro_mutex_lock(&coro_sched_lock);
+	++coro_active_count;
+	coro_mutex_unlock(&coro_sched_lock);
+	coro_ready_push(coro_worker_for_push(), c);
 	return c;
 }
+
+struct coro_frame *
+coro_frame(struct coro *c)
+{
+	return (struct coro_frame *)(c + 1);
+}
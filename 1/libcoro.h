@@ -1,6 +1,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
@@ -10,23 +13,65 @@ void
 coro_sched_init(void);
 
 /**
- * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * M:N mode: coroutines are run by @a thread_count worker threads.
+ * Each worker has its own ready queue, and an idle worker steals
+ * coroutines from the others. A coroutine can be resumed by any of
+ * them after a switch. The current thread does not run coroutines,
+ * it only waits for them in coro_sched_wait(). Stop the workers
+ * with coro_sched_destroy().
+ */
+void
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Release scheduler resources: stop the worker threads, unmap the
+ * stacks cached for reuse. All the coroutines should be deleted
+ * already.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Block until any coroutine has finished. It is returned. NULL,
+ * if no coroutine can run - either there are none, or all of them
+ * are suspended.
  */
 struct coro *
 coro_sched_wait(void);
 
-/** Currently working coroutine. */
+/** Currently working coroutine of this thread. */
 struct coro *
 coro_this(void);
 
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
+ * @retval NULL No memory for the coroutine, errno is set.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the stack is @a stack_size bytes,
+ * rounded up to a power of two. A few hundred bytes on its top are
+ * taken by the coroutine object. Stacks are taken from a pool of
+ * mappings with a guard page below them, and their memory is
+ * committed only when touched. So a big stack costs address space,
+ * not RAM, and an overflow crashes with SIGSEGV right away. When
+ * the process is out of mappings (vm.max_map_count), new stacks are
+ * cut from shared mappings without guard pages instead.
+ * @retval NULL No memory for the coroutine, errno is set.
+ */
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Unique number of the coroutine, given in the order of creation
+ * starting from 1. Counted anew by coro_sched_init*().
+ */
+unsigned long long
+coro_id(const struct coro *c);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,6 +79,73 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Time the coroutine has been running, in nanoseconds. Measured by
+ * the scheduler on each switch, so the time spent by others while
+ * this one was yielding or suspended is not included. For the
+ * running coroutine the current run is included as well.
+ */
+long long
+coro_work_time(const struct coro *c);
+
+/**
+ * Time the coroutine has spent ready to run or suspended, in
+ * nanoseconds.
+ */
+long long
+coro_wait_time(const struct coro *c);
+
+/**
+ * Set the time budget of one coroutine run, in microseconds. See
+ * coro_yield_if_quantum_expired(). 0 by default.
+ */
+void
+coro_set_quantum(struct coro *c, long long usec);
+
+/**
+ * Scheduling classes, from the highest priority. A ready coroutine
+ * of the latency class always runs before the batch ones, except
+ * that after CORO_LATENCY_BURST latency runs in a row a waiting
+ * batch coroutine gets a turn, so the batch class never starves.
+ * Inside the latency class the earliest deadline goes first, inside
+ * the batch class it is FIFO.
+ */
+enum coro_class {
+	/** Interactive work, woken up often, runs briefly. */
+	CORO_CLASS_LATENCY,
+	/** Throughput work. The default. */
+	CORO_CLASS_BATCH,
+	CORO_CLASS_COUNT,
+};
+
+/** Latency class runs in a row, after which a batch one is run. */
+enum { CORO_LATENCY_BURST = 16 };
+
+/**
+ * Set the scheduling class of the coroutine. It takes effect the
+ * next time the coroutine becomes ready. A new coroutine is ready
+ * right away, so the first run is in the batch class.
+ */
+void
+coro_set_class(struct coro *c, enum coro_class cls);
+
+/**
+ * Set the wake-up latency target of a latency class coroutine, in
+ * microseconds. Each time it becomes ready its deadline is the
+ * current time plus the target, and the ready latency coroutines
+ * run in the order of their deadlines. 0 by default, which makes
+ * them FIFO.
+ */
+void
+coro_set_latency(struct coro *c, long long usec);
+
+/**
+ * Turn work and wait time measurement on or off. It costs one clock
+ * read per switch. On by default, reset by coro_sched_init().
+ */
+void
+coro_sched_set_accounting(bool is_enabled);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +154,274 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Switch to the next ready coroutine. The current one goes to the
+ * ready queue of its class. Does nothing if no one else is ready.
+ */
 void
 coro_yield(void);
+
+/**
+ * Yield, but only if the current coroutine has been running for
+ * its quantum or longer since it was switched in. Meant for hot
+ * loops - most of the calls are just a clock read.
+ * @retval true The coroutine yielded.
+ * @retval false The quantum is not over, or nobody else could run.
+ */
+bool
+coro_yield_if_quantum_expired(void);
+
+/**
+ * Suspend the current coroutine until somebody calls
+ * coro_wakeup() on it.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Timeouts. The blocking calls have *_timeout() variants taking a
+ * timeout in microseconds, negative means none. On timeout they
+ * fail with errno ETIMEDOUT. Timers are kept in a hierarchical timer
+ * wheel of the scheduler with a millisecond tick, so a timeout is
+ * rounded up to the tick, and arming or cancelling it is O(1)
+ * without syscalls. When nothing can run, the scheduler sleeps till
+ * the nearest deadline.
+ */
+
+/**
+ * Same as coro_suspend(), but not longer than @a usec.
+ * @retval 0 Woken up.
+ * @retval -1 Timed out.
+ */
+int
+coro_suspend_timeout(long long usec);
+
+/**
+ * Sleep for @a usec microseconds, letting the others run. Wakeups
+ * do not interrupt the sleep. Not positive @a usec means just yield.
+ */
+void
+coro_sleep(long long usec);
+
+/**
+ * Make a suspended coroutine ready to run again. It is put to the
+ * ready queue of its class. Does nothing if @a c is not suspended.
+ * In the M:N mode a wakeup which comes while @a c is still
+ * switching out of coro_suspend() is not lost - the suspend
+ * returns right away.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Coroutine I/O. The descriptors have to be in the non-blocking
+ * mode. When an operation would block, the coroutine is parked on
+ * the epoll-based reactor of the scheduler and is woken up when
+ * the descriptor becomes ready, while the other coroutines run.
+ * When nothing is ready to run, the scheduler sleeps in
+ * epoll_wait(). The return values and errno are the same as of the
+ * corresponding system calls.
+ */
+
+/** Backends of the coroutine I/O. */
+enum coro_io_backend {
+	/** Wait for readiness in epoll, then do the system call. */
+	CORO_IO_EPOLL,
+	/**
+	 * Queue the operations to io_uring. The scheduler submits
+	 * them in batches when it polls, and takes the completions
+	 * from the ring memory, so under load an operation costs much
+	 * less than a system call. Regular files are read and written
+	 * asynchronously too.
+	 */
+	CORO_IO_URING,
+};
+
+/**
+ * Choose the I/O backend, epoll by default. Call it after
+ * coro_sched_init*() while no coroutine does I/O. If the kernel
+ * has no io_uring, it is disabled, or libcoro is built with
+ * CORO_NO_URING, epoll stays. Returns the backend in use.
+ */
+enum coro_io_backend
+coro_sched_set_io_backend(enum coro_io_backend backend);
+
+/** Read up to @a size bytes, wait until at least one is ready. */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+ssize_t
+coro_read_timeout(int fd, void *buf, size_t size, long long usec);
+
+/** Write all @a size bytes, wait for space as much as needed. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * The timeout is for the whole write. When it hits, a part of the
+ * data could be written already.
+ */
+ssize_t
+coro_write_timeout(int fd, const void *buf, size_t size, long long usec);
+
+/**
+ * Accept a connection, wait for it if there is none. The new
+ * descriptor is non-blocking.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+int
+coro_accept_timeout(int fd, struct sockaddr *addr, socklen_t *addrlen,
+		    long long usec);
+
+/** Connect and wait until the connection is established. */
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+int
+coro_connect_timeout(int fd, const struct sockaddr *addr,
+		     socklen_t addrlen, long long usec);
+
+typedef void *(*coro_blocking_f)(void *);
+
+/**
+ * Call @a func(@a arg) on a helper thread and return its result.
+ * Meant for what epoll can not wait for - open(), stat(), reads of
+ * regular files, DNS lookups. The coroutine is parked while the
+ * call runs, and the others go on. The result comes back through
+ * the reactor's eventfd. Helper threads are started on demand, at
+ * most 16, and are stopped by coro_sched_destroy(). Can be called
+ * only from stackful coroutines.
+ */
+void *
+coro_blocking_call(coro_blocking_f func, void *arg);
+
+/**
+ * Synchronization of coroutines. Blocking calls park the current
+ * coroutine, and let the others run, until the operation can be
+ * done. They can be called only from coroutines, and work in both
+ * the single-threaded and the M:N modes. The waiters are woken up
+ * in FIFO order. If all the coroutines are blocked on each other,
+ * coro_sched_wait() returns NULL.
+ */
+
+struct coro_chan;
+struct coro_wait_group;
+struct coro_mutex;
+struct coro_cond;
+
+/**
+ * Create a channel - a FIFO of at most @a capacity pointers. Less
+ * than 1 means 1.
+ */
+struct coro_chan *
+coro_chan_new(int capacity);
+
+/** Free the channel. Nobody should be waiting on it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Put @a msg into the channel, wait while it is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, errno is EPIPE.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+int
+coro_chan_send_timeout(struct coro_chan *ch, void *msg, long long usec);
+
+/**
+ * Take the oldest message from the channel, wait while it is
+ * empty. The messages sent before close can still be received.
+ * @retval 0 Success, the message is in @a msg.
+ * @retval -1 The channel is closed and empty, errno is EPIPE.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+int
+coro_chan_recv_timeout(struct coro_chan *ch, void **msg, long long usec);
+
+/** Close the channel and wake up everybody waiting on it. */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/** Create a wait group with the counter = 0. */
+struct coro_wait_group *
+coro_wait_group_new(void);
+
+void
+coro_wait_group_delete(struct coro_wait_group *wg);
+
+/**
+ * Add @a count to the counter. The waiters are woken up when it
+ * drops to 0. Can be called from outside of coroutines.
+ */
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count);
+
+/** Decrement the counter. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/** Wait until the counter is 0. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+int
+coro_wait_group_wait_timeout(struct coro_wait_group *wg, long long usec);
+
+/**
+ * Create a mutex for coroutines. Unlike a pthread mutex, a coroutine
+ * waiting for it does not block the thread. It is not recursive.
+ */
+struct coro_mutex *
+coro_mutex_new(void);
+
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/** Lock the mutex, wait while it is locked by someone else. */
+void
+coro_mutex_acquire(struct coro_mutex *m);
+
+int
+coro_mutex_acquire_timeout(struct coro_mutex *m, long long usec);
+
+/** Lock the mutex if it is free. Returns true on success. */
+bool
+coro_mutex_try_acquire(struct coro_mutex *m);
+
+/** Unlock the mutex and wake up the first waiter. */
+void
+coro_mutex_release(struct coro_mutex *m);
+
+/** Create a condition variable for coroutines. */
+struct coro_cond *
+coro_cond_new(void);
+
+void
+coro_cond_delete(struct coro_cond *cond);
+
+/**
+ * Release @a m, wait for a signal, lock @a m again. The wakeups can
+ * be spurious, so check the condition in a loop.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m);
+
+/** The mutex is locked again on return even after a timeout. */
+int
+coro_cond_wait_timeout(struct coro_cond *cond, struct coro_mutex *m,
+		       long long usec);
+
+/** Wake up the first waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
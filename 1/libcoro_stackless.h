@@ -0,0 +1,102 @@
+#pragma once
+
+#include "libcoro.h"
+
+/**
+ * Stackless coroutines. Such a coroutine is a step function, called
+ * by the scheduler again and again, and a frame - a struct with all
+ * the state which has to survive between the steps. A step runs on
+ * the stack of the scheduler and returns to it instead of switching
+ * contexts, so the coroutine costs only its frame and the coroutine
+ * object - no stack and no mappings.
+ *
+ * Stackless coroutines are the same struct coro as the stackful
+ * ones. They are in the same ready queues, woken up by
+ * coro_wakeup(), returned by coro_sched_wait() when finished, and
+ * freed with coro_delete(). coro_this() inside a step returns the
+ * stackless coroutine itself. A step must not switch by itself -
+ * no coro_yield(), coro_suspend(), coro_sleep(), coroutine I/O,
+ * channel send/recv, etc. Non-blocking calls, like coro_wakeup() or
+ * coro_wait_group_done(), are fine.
+ *
+ * A step function usually is a state machine written with the
+ * CORO_* macros below:
+ *
+ *     struct counter {
+ *         struct coro_frame base;
+ *         int i;
+ *     };
+ *
+ *     static enum coro_step
+ *     counter_f(struct coro_frame *frame)
+ *     {
+ *         struct counter *f = (struct counter *)frame;
+ *         CORO_BEGIN(frame);
+ *         for (f->i = 0; f->i < 10; ++f->i)
+ *             CORO_YIELD(frame);
+ *         CORO_END(frame, 0);
+ *     }
+ *
+ * Local variables of the step are lost on each CORO_YIELD() and
+ * CORO_SUSPEND(), so the state goes into the frame.
+ */
+
+/** Header of a stackless coroutine frame, embed it first. */
+struct coro_frame {
+	/** Where to resume, 0 at start. Managed by the CORO_* macros. */
+	int line;
+	/** Returned by coro_status() once the coroutine has finished. */
+	int ret;
+};
+
+/** What a step asks the scheduler to do. */
+enum coro_step {
+	/** Call the step again after the other ready coroutines. */
+	CORO_STEP_YIELD,
+	/**
+	 * Call the step again after coro_wakeup(). A wakeup which
+	 * comes while the step is running is not lost - the step is
+	 * called again right away.
+	 */
+	CORO_STEP_SUSPEND,
+	/** The coroutine has finished with frame->ret. */
+	CORO_STEP_FINISH,
+};
+
+typedef enum coro_step (*coro_step_f)(struct coro_frame *frame);
+
+/**
+ * Create a stackless coroutine. The frame of @a frame_size bytes is
+ * copied from @a frame into the coroutine object. NULL @a frame means
+ * a zeroed one. Then the coroutine is ready to run, like after
+ * coro_new().
+ * @retval NULL No memory, errno is set.
+ */
+struct coro *
+coro_new_stackless(coro_step_f step, const void *frame, size_t frame_size);
+
+/** Frame of a stackless coroutine. */
+struct coro_frame *
+coro_frame(struct coro *c);
+
+#define CORO_BEGIN(frame) switch ((frame)->line) { case 0:
+
+#define CORO_STEP_RETURN_(frame, step) do {				\
+	(frame)->line = __LINE__;					\
+	return (step);							\
+	case __LINE__:;							\
+} while (0)
+
+/** Let the others run, continue from here. */
+#define CORO_YIELD(frame) CORO_STEP_RETURN_(frame, CORO_STEP_YIELD)
+
+/** Wait for coro_wakeup(), continue from here. */
+#define CORO_SUSPEND(frame) CORO_STEP_RETURN_(frame, CORO_STEP_SUSPEND)
+
+/** Finish the coroutine with @a value. */
+#define CORO_RETURN(frame, value) do {					\
+	(frame)->ret = (value);						\
+	return CORO_STEP_FINISH;					\
+} while (0)
+
+#define CORO_END(frame, value) } CORO_RETURN(frame, value)
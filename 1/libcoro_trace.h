@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include "libcoro.h"
+
+/**
+ * Scheduler tracing. When it is on, each thread running coroutines
+ * records the scheduler events into its own ring buffer - no locks,
+ * no syscalls, one clock read per switch. When a ring is full, the
+ * oldest events are overwritten. When tracing is off, a switch pays
+ * only for one well-predicted branch.
+ *
+ * The rings are saved into a file with coro_trace_save(), and the
+ * trace_dump tool turns it into Chrome trace JSON (chrome://tracing,
+ * Perfetto) or folded stacks for flamegraph.pl.
+ */
+
+enum coro_trace_type {
+	/** A coroutine is created. */
+	CORO_TRACE_CREATE,
+	/** A coroutine starts running on the thread. */
+	CORO_TRACE_SWITCH_IN,
+	/**
+	 * A coroutine stops running on the thread. arg is the reason,
+	 * CORO_TRACE_OUT_*.
+	 */
+	CORO_TRACE_SWITCH_OUT,
+	/** A coroutine has finished, it stops running too. */
+	CORO_TRACE_FINISH,
+	/** A coroutine parks waiting for I/O on the descriptor arg. */
+	CORO_TRACE_IO_PARK,
+};
+
+/** Why a coroutine was switched out. */
+enum {
+	CORO_TRACE_OUT_YIELD = 1,
+	CORO_TRACE_OUT_SUSPEND = 2,
+};
+
+/** One event, as it is stored in the ring and in the file. */
+struct coro_trace_event {
+	/** CLOCK_MONOTONIC, in nanoseconds. */
+	int64_t time;
+	/** See coro_id(). */
+	uint64_t coro_id;
+	/** enum coro_trace_type. */
+	uint16_t type;
+	/** 0 - the thread of coro_sched_init*(), N - worker N. */
+	uint16_t thread;
+	int32_t arg;
+};
+
+#define CORO_TRACE_MAGIC "CORTRACE"
+#define CORO_TRACE_VERSION 1
+
+/** The file starts with this header, the events follow it. */
+struct coro_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+};
+
+/**
+ * Start recording with rings of @a capacity events per thread,
+ * rounded up to a power of two. The events recorded before are
+ * dropped. The scheduler has to be initialized already.
+ */
+void
+coro_trace_start(size_t capacity);
+
+/** Stop recording. The recorded events are kept. */
+void
+coro_trace_stop(void);
+
+/**
+ * Save the recorded events into the file @a path. Call it after
+ * coro_trace_stop(), before coro_sched_destroy() which frees the
+ * rings.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_save(const char *path);
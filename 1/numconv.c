@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <string.h>
+#include "numio.h"
+
+/**
+ * Convert a file of numbers of any format into text or binary:
+ *
+ *     $> ./numconv binary test1.txt test1.bin
+ *     $> ./numconv text test1.bin test1.txt
+ */
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 4 || (strcmp(argv[1], "text") != 0 &&
+			  strcmp(argv[1], "binary") != 0)) {
+		fprintf(stderr, "Usage: %s text|binary <input> <output>\n",
+			argv[0]);
+		return 1;
+	}
+	struct numio_array arr;
+	if (numio_load(argv[2], &arr) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	int rc = strcmp(argv[1], "text") == 0 ?
+		 numio_save_text(argv[3], arr.data, arr.size) :
+		 numio_save_binary(argv[3], arr.data, arr.size);
+	if (rc != 0)
+		perror(argv[3]);
+	numio_array_destroy(&arr);
+	return rc != 0;
+}
@@ -0,0 +1,625 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "numio.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NUMIO_HAS_SSSE3 1
+#include <immintrin.h>
+#else
+#define NUMIO_HAS_SSSE3 0
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+/** Binary files are little-endian, swap the numbers in place. */
+static void
+numio_swap(int *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (int)__builtin_bswap32((uint32_t)data[i]);
+}
+#endif
+
+static int
+numio_write_full(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** Whether @a c separates numbers in a text file. */
+static inline bool
+numio_is_space(char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * Parse a number at @a pos, where a separator is not expected.
+ * @retval End of the number, NULL if there is no number.
+ */
+static const char *
+numio_parse_number(const char *pos, const char *end, int *value)
+{
+	bool is_negative = *pos == '-';
+	if (is_negative)
+		++pos;
+	const char *start = pos;
+	uint32_t result = 0;
+	for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos)
+		result = result * 10 + (*pos - '0');
+	if (pos == start)
+		return NULL;
+	*value = (int)(is_negative ? 0 - result : result);
+	return pos;
+}
+
+/** Append the numbers of [pos, end) to out[*count]. */
+static int
+numio_parse_scalar(const char *pos, const char *end, int *out,
+		   size_t *count)
+{
+	size_t size = *count;
+	while (true) {
+		while (pos < end && numio_is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		pos = numio_parse_number(pos, end, &out[size]);
+		if (pos == NULL) {
+			*count = size;
+			errno = EILSEQ;
+			return -1;
+		}
+		++size;
+	}
+	*count = size;
+	return 0;
+}
+
+#if NUMIO_HAS_SSSE3
+
+/** Bit masks of the byte kinds in 64 bytes of text. */
+struct numio_block {
+	uint64_t digits;
+	uint64_t minuses;
+	uint64_t spaces;
+};
+
+typedef void (*numio_block_scan_f)(const char *pos,
+				   struct numio_block *block);
+
+__attribute__((target("ssse3")))
+static inline void
+numio_block_scan_sse(const char *pos, struct numio_block *block)
+{
+	const __m128i char_0 = _mm_set1_epi8('0');
+	const __m128i char_minus = _mm_set1_epi8('-');
+	const __m128i char_space = _mm_set1_epi8(' ');
+	const __m128i char_tab = _mm_set1_epi8('\t');
+	const __m128i nine = _mm_set1_epi8(9);
+	/* '\t', '\n', '\v', '\f' and '\r' go one after another. */
+	const __m128i ctrl_max = _mm_set1_epi8('\r' - '\t');
+	memset(block, 0, sizeof(*block));
+	for (int i = 0; i < 4; ++i) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)pos + i);
+		__m128i digit = _mm_sub_epi8(chunk, char_0);
+		__m128i ctrl = _mm_sub_epi8(chunk, char_tab);
+		__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine),
+						  digit);
+		__m128i is_space = _mm_or_si128(
+			_mm_cmpeq_epi8(chunk, char_space),
+			_mm_cmpeq_epi8(_mm_min_epu8(ctrl, ctrl_max), ctrl));
+		__m128i is_minus = _mm_cmpeq_epi8(chunk, char_minus);
+		block->digits |= (uint64_t)(uint16_t)
+			_mm_movemask_epi8(is_digit) << (i * 16);
+		block->spaces |= (uint64_t)(uint16_t)
+			_mm_movemask_epi8(is_space) << (i * 16);
+		block->minuses |= (uint64_t)(uint16_t)
+			_mm_movemask_epi8(is_minus) << (i * 16);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void
+numio_block_scan_avx2(const char *pos, struct numio_block *block)
+{
+	const __m256i char_0 = _mm256_set1_epi8('0');
+	const __m256i char_minus = _mm256_set1_epi8('-');
+	const __m256i char_space = _mm256_set1_epi8(' ');
+	const __m256i char_tab = _mm256_set1_epi8('\t');
+	const __m256i nine = _mm256_set1_epi8(9);
+	const __m256i ctrl_max = _mm256_set1_epi8('\r' - '\t');
+	memset(block, 0, sizeof(*block));
+	for (int i = 0; i < 2; ++i) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)pos + i);
+		__m256i digit = _mm256_sub_epi8(chunk, char_0);
+		__m256i ctrl = _mm256_sub_epi8(chunk, char_tab);
+		__m256i is_digit = _mm256_cmpeq_epi8(
+			_mm256_min_epu8(digit, nine), digit);
+		__m256i is_space = _mm256_or_si256(
+			_mm256_cmpeq_epi8(chunk, char_space),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, ctrl_max),
+					  ctrl));
+		__m256i is_minus = _mm256_cmpeq_epi8(chunk, char_minus);
+		block->digits |= (uint64_t)(uint32_t)
+			_mm256_movemask_epi8(is_digit) << (i * 32);
+		block->spaces |= (uint64_t)(uint32_t)
+			_mm256_movemask_epi8(is_space) << (i * 32);
+		block->minuses |= (uint64_t)(uint32_t)
+			_mm256_movemask_epi8(is_minus) << (i * 32);
+	}
+}
+
+/**
+ * The text is scanned by 64-byte blocks into bit masks, which give
+ * where the numbers start, so the numbers of a block do not wait for
+ * each other and are converted in parallel by the CPU. A number is
+ * converted with no loop over its digits: they are moved to the end
+ * of a vector, and the pairs, the fours and the eights of digits are
+ * summed up by multiply-add instructions.
+ *
+ * The scalar parser takes the tail of the text, the numbers longer
+ * than 10 digits, and the blocks with anything but numbers and
+ * separators - to find the error where it would.
+ *
+ * Inlined into each of the CPU variants below, with its own scan.
+ */
+__attribute__((target("ssse3"), always_inline))
+static inline int
+numio_parse_blocks(const char *pos, const char *end, int *out, size_t *count,
+		   numio_block_scan_f scan)
+{
+	const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+					   11, 12, 13, 14, 15);
+	const __m128i char_0 = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i mul_10 = _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1,
+					     10, 1, 10, 1, 10, 1, 10, 1);
+	const __m128i mul_100 = _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1);
+	const __m128i mul_10000 = _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1,
+						 10000, 1);
+	size_t size = *count;
+	/* End of the last parsed number, the scalar parser goes on here. */
+	const char *resume = pos;
+	/* Whether the last byte of the previous block is a digit, '-'. */
+	uint64_t prev_digit = 0;
+	uint64_t prev_minus = 0;
+	/* A number is read by 16 bytes even at the end of a block. */
+	for (; end - pos >= 64 + 16; pos += 64) {
+		struct numio_block block;
+		scan(pos, &block);
+		uint64_t next_digit = (uint8_t)(pos[64] - '0') <= 9;
+		uint64_t bad = ~(block.digits | block.minuses | block.spaces) |
+			       (block.minuses &
+				~(block.digits >> 1 | next_digit << 63));
+		if (bad != 0)
+			break;
+		uint64_t starts = block.digits &
+				  ~(block.digits << 1 | prev_digit);
+		uint64_t negatives = block.minuses << 1 | prev_minus;
+		prev_digit = block.digits >> 63;
+		prev_minus = block.minuses >> 63;
+		for (; starts != 0; starts &= starts - 1) {
+			int i = __builtin_ctzll(starts);
+			const char *start = pos + i;
+			uint32_t is_negative = (negatives >> i) & 1;
+			__m128i digits = _mm_sub_epi8(_mm_loadu_si128(
+				(const __m128i *)start), char_0);
+			unsigned is_digit = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_min_epu8(digits, nine), digits));
+			int len = __builtin_ctz(~is_digit);
+			if (len > 10) {
+				resume = numio_parse_number(
+					start - is_negative, end, &out[size++]);
+				continue;
+			}
+			/*
+			 * The shuffle indexes of the bytes before the number
+			 * are negative, and pshufb zeroes such bytes.
+			 */
+			digits = _mm_shuffle_epi8(digits, _mm_add_epi8(
+				iota, _mm_set1_epi8(len - 16)));
+			__m128i sum = _mm_maddubs_epi16(digits, mul_10);
+			sum = _mm_madd_epi16(sum, mul_100);
+			sum = _mm_packs_epi32(sum, sum);
+			sum = _mm_madd_epi16(sum, mul_10000);
+			uint32_t high = _mm_cvtsi128_si32(sum);
+			uint32_t low = _mm_cvtsi128_si32(
+				_mm_srli_si128(sum, 4));
+			uint32_t value = high * 100000000 + low;
+			out[size++] = (int)((value ^ (0 - is_negative)) +
+					    is_negative);
+			resume = start + len;
+		}
+	}
+	*count = size;
+	return numio_parse_scalar(resume, end, out, count);
+}
+
+__attribute__((target("ssse3")))
+static int
+numio_parse_ssse3(const char *pos, const char *end, int *out, size_t *count)
+{
+	return numio_parse_blocks(pos, end, out, count, numio_block_scan_sse);
+}
+
+__attribute__((target("avx2")))
+static int
+numio_parse_avx2(const char *pos, const char *end, int *out, size_t *count)
+{
+	return numio_parse_blocks(pos, end, out, count,
+				  numio_block_scan_avx2);
+}
+
+#endif /* NUMIO_HAS_SSSE3 */
+
+int
+numio_parse_text(const char *text, size_t size, int *out, size_t *count)
+{
+	*count = 0;
+#if NUMIO_HAS_SSSE3
+	if (__builtin_cpu_supports("avx2"))
+		return numio_parse_avx2(text, text + size, out, count);
+	if (__builtin_cpu_supports("ssse3"))
+		return numio_parse_ssse3(text, text + size, out, count);
+#endif
+	return numio_parse_scalar(text, text + size, out, count);
+}
+
+int
+numio_parse_text_scalar(const char *text, size_t size, int *out,
+			size_t *count)
+{
+	*count = 0;
+	return numio_parse_scalar(text, text + size, out, count);
+}
+
+int
+numio_format_of(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	char magic[NUMIO_MAGIC_SIZE];
+	ssize_t rc = read(fd, magic, sizeof(magic));
+	int err = errno;
+	close(fd);
+	if (rc < 0) {
+		errno = err;
+		return -1;
+	}
+	if (rc == NUMIO_MAGIC_SIZE &&
+	    memcmp(magic, NUMIO_MAGIC, NUMIO_MAGIC_SIZE) == 0)
+		return NUMIO_FORMAT_BINARY;
+	return NUMIO_FORMAT_TEXT;
+}
+
+size_t
+numio_text_capacity(size_t size)
+{
+	return size / 2 + 1;
+}
+
+static int
+numio_load_text_to(const char *path, int *buf, size_t capacity,
+		   struct numio_array *arr)
+{
+	memset(arr, 0, sizeof(*arr));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	size_t file_size = st.st_size;
+	const char *text = NULL;
+	if (file_size > 0) {
+		text = mmap(NULL, file_size, PROT_READ,
+			    MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (text == MAP_FAILED) {
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+	}
+	close(fd);
+	/*
+	 * The pages of the array beyond the real count are never touched,
+	 * and are given back by the realloc() below.
+	 */
+	bool is_data_external = buf != NULL &&
+				capacity >= numio_text_capacity(file_size);
+	int *data = is_data_external ? buf :
+		    malloc(numio_text_capacity(file_size) * sizeof(*data));
+	size_t size = 0;
+	int rc = -1;
+	if (data == NULL)
+		errno = ENOMEM;
+	else if (text == NULL)
+		rc = 0;
+	else
+		rc = numio_parse_text(text, file_size, data, &size);
+	int err = errno;
+	if (text != NULL)
+		munmap((void *)text, file_size);
+	if (rc != 0) {
+		if (!is_data_external)
+			free(data);
+		errno = err;
+		return -1;
+	}
+	arr->is_data_external = is_data_external;
+	arr->size = size;
+	if (is_data_external) {
+		arr->data = data;
+		return 0;
+	}
+	int *tmp = realloc(data, (size + 1) * sizeof(*data));
+	arr->data = tmp != NULL ? tmp : data;
+	return 0;
+}
+
+int
+numio_load(const char *path, struct numio_array *arr)
+{
+	return numio_load_to(path, NULL, 0, arr);
+}
+
+int
+numio_load_to(const char *path, int *buf, size_t capacity,
+	      struct numio_array *arr)
+{
+	int format = numio_format_of(path);
+	if (format < 0)
+		return -1;
+	if (format == NUMIO_FORMAT_BINARY)
+		return numio_load_binary(path, arr);
+	return numio_load_text_to(path, buf, capacity, arr);
+}
+
+int
+numio_load_text(const char *path, struct numio_array *arr)
+{
+	return numio_load_text_to(path, NULL, 0, arr);
+}
+
+int
+numio_load_binary(const char *path, struct numio_array *arr)
+{
+	memset(arr, 0, sizeof(*arr));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	size_t map_size = st.st_size;
+	if (map_size < NUMIO_MAGIC_SIZE ||
+	    (map_size - NUMIO_MAGIC_SIZE) % sizeof(int) != 0) {
+		close(fd);
+		errno = EILSEQ;
+		return -1;
+	}
+	/* The pages are read ahead right away, not faulted one by one. */
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return -1;
+	}
+	if (memcmp(map, NUMIO_MAGIC, NUMIO_MAGIC_SIZE) != 0) {
+		munmap(map, map_size);
+		errno = EILSEQ;
+		return -1;
+	}
+	arr->map = map;
+	arr->map_size = map_size;
+	arr->data = (int *)(map + NUMIO_MAGIC_SIZE);
+	arr->size = (map_size - NUMIO_MAGIC_SIZE) / sizeof(int);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	numio_swap(arr->data, arr->size);
+#endif
+	return 0;
+}
+
+void
+numio_array_destroy(struct numio_array *arr)
+{
+	if (arr->map != NULL)
+		munmap(arr->map, arr->map_size);
+	else if (!arr->is_data_external)
+		free(arr->data);
+	memset(arr, 0, sizeof(*arr));
+}
+
+/** "00", "01", ..., "99" - two digits at once. */
+static const char numio_digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+static inline int
+numio_digit_count(uint32_t value)
+{
+	static const uint32_t powers[] = {
+		0, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+		100000000, 1000000000,
+	};
+	/* log10(2) ~ 1233 / 4096, it gives the count or 1 more. */
+	int bits = 32 - __builtin_clz(value | 1);
+	int log = bits * 1233 >> 12;
+	return log + 1 - (value < powers[log]);
+}
+
+/**
+ * Write @a value at @a pos, the same as "%d" does.
+ * @retval End of the written number.
+ */
+static inline char *
+numio_format_int(char *pos, int value)
+{
+	uint32_t rest = value;
+	if (value < 0) {
+		*pos++ = '-';
+		rest = 0 - rest;
+	}
+	char *end = pos + numio_digit_count(rest);
+	pos = end;
+	/* The two pairs of a four do not wait for each other. */
+	while (rest >= 10000) {
+		uint32_t four = rest % 10000;
+		rest /= 10000;
+		pos -= 4;
+		memcpy(pos, &numio_digit_pairs[four / 100 * 2], 2);
+		memcpy(pos + 2, &numio_digit_pairs[four % 100 * 2], 2);
+	}
+	if (rest >= 100) {
+		pos -= 2;
+		memcpy(pos, &numio_digit_pairs[rest % 100 * 2], 2);
+		rest /= 100;
+	}
+	if (rest >= 10)
+		memcpy(pos - 2, &numio_digit_pairs[rest * 2], 2);
+	else
+		pos[-1] = '0' + rest;
+	return end;
+}
+
+int
+numio_writer_create(struct numio_writer *w, int fd)
+{
+	memset(w, 0, sizeof(*w));
+	w->buf = malloc(NUMIO_WRITE_BUFFER);
+	if (w->buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	w->fd = fd;
+	w->pos = w->buf;
+	return 0;
+}
+
+void
+numio_writer_destroy(struct numio_writer *w)
+{
+	free(w->buf);
+	memset(w, 0, sizeof(*w));
+}
+
+static int
+numio_writer_flush(struct numio_writer *w, char *end)
+{
+	if (numio_write_full(w->fd, w->buf, end - w->buf) != 0)
+		return -1;
+	w->bytes += end - w->buf;
+	w->pos = w->buf;
+	return 0;
+}
+
+int
+numio_writer_write(struct numio_writer *w, const int *data, size_t size)
+{
+	/* " -2147483648" is the longest. */
+	char *limit = w->buf + NUMIO_WRITE_BUFFER - 12;
+	char *pos = w->pos;
+	size_t i = 0;
+	if (size > 0 && !w->is_started) {
+		pos = numio_format_int(pos, data[i++]);
+		w->is_started = true;
+	}
+	for (; i < size; ++i) {
+		*pos++ = ' ';
+		pos = numio_format_int(pos, data[i]);
+		if (pos > limit) {
+			if (numio_writer_flush(w, pos) != 0)
+				return -1;
+			pos = w->buf;
+		}
+	}
+	w->pos = pos;
+	return 0;
+}
+
+int
+numio_writer_finish(struct numio_writer *w)
+{
+	if (w->is_started)
+		*w->pos++ = '\n';
+	return numio_writer_flush(w, w->pos);
+}
+
+int
+numio_save_text(const char *path, const int *data, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	struct numio_writer w;
+	int rc = numio_writer_create(&w, fd);
+	if (rc == 0) {
+		rc = numio_writer_write(&w, data, size);
+		if (rc == 0)
+			rc = numio_writer_finish(&w);
+		numio_writer_destroy(&w);
+	}
+	int err = errno;
+	if (close(fd) != 0 && rc == 0)
+		return -1;
+	errno = err;
+	return rc;
+}
+
+int
+numio_save_binary(const char *path, const int *data, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	int rc = numio_write_full(fd, NUMIO_MAGIC, NUMIO_MAGIC_SIZE);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	int chunk[4096];
+	for (size_t i = 0; rc == 0 && i < size; i += 4096) {
+		size_t count = size - i < 4096 ? size - i : 4096;
+		memcpy(chunk, data + i, count * sizeof(int));
+		numio_swap(chunk, count);
+		rc = numio_write_full(fd, chunk, count * sizeof(int));
+	}
+#else
+	if (rc == 0)
+		rc = numio_write_full(fd, data, size * sizeof(*data));
+#endif
+	int err = errno;
+	if (close(fd) != 0 && rc == 0)
+		return -1;
+	errno = err;
+	return rc;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Files of numbers to sort. A text file has decimal int32 numbers
+ * separated by whitespace. A binary file starts with NUMIO_MAGIC,
+ * followed by the numbers as little-endian int32. It is mapped into
+ * memory as is, without parsing.
+ */
+
+#define NUMIO_MAGIC "INT32LE\n"
+
+enum {
+	/** Size of the magic, and of the binary file header. */
+	NUMIO_MAGIC_SIZE = 8,
+	/** Text is formatted into a buffer of this size, then written. */
+	NUMIO_WRITE_BUFFER = 4 << 20,
+};
+
+enum numio_format {
+	NUMIO_FORMAT_TEXT,
+	NUMIO_FORMAT_BINARY,
+};
+
+/** Numbers loaded from a file. */
+struct numio_array {
+	int *data;
+	size_t size;
+	/** Mapping of a binary file, NULL if data is allocated. */
+	void *map;
+	size_t map_size;
+	/** Data is in the buffer of the caller, it is not freed. */
+	bool is_data_external;
+};
+
+/**
+ * Format of the file, told by its first bytes.
+ * @retval -1 Error, see errno.
+ */
+int
+numio_format_of(const char *path);
+
+/**
+ * Load a file of any format into @a arr. Free it with
+ * numio_array_destroy().
+ * @retval 0 Success.
+ * @retval -1 Error, see errno. EILSEQ means a broken file.
+ */
+int
+numio_load(const char *path, struct numio_array *arr);
+
+/**
+ * The same, but the numbers of a text file are parsed into @a buf of
+ * @a capacity numbers, and nothing is allocated. If the file has
+ * grown over numio_text_capacity() of @a capacity, or @a buf is NULL,
+ * the array is allocated as usual. Binary files are mapped anyway.
+ */
+int
+numio_load_to(const char *path, int *buf, size_t capacity,
+	      struct numio_array *arr);
+
+/** Map the whole text file and parse it. */
+int
+numio_load_text(const char *path, struct numio_array *arr);
+
+/**
+ * The most numbers a text of @a size bytes can have: size / 2 + 1,
+ * a number with its separator takes 2 bytes at least.
+ */
+size_t
+numio_text_capacity(size_t size);
+
+/**
+ * Parse the text numbers into @a out. It must have room for
+ * numio_text_capacity(size) numbers.
+ * SSSE3 is used when the CPU has it.
+ * @param[out] count How many numbers are parsed, also on error.
+ * @retval 0 Success.
+ * @retval -1 Not a number in the text, errno is EILSEQ.
+ */
+int
+numio_parse_text(const char *text, size_t size, int *out, size_t *count);
+
+/** The same, one byte at a time. */
+int
+numio_parse_text_scalar(const char *text, size_t size, int *out,
+			size_t *count);
+
+/**
+ * Map a binary file. The mapping is private: the numbers can be
+ * changed in place, the touched pages are copied then, and the file
+ * stays intact.
+ */
+int
+numio_load_binary(const char *path, struct numio_array *arr);
+
+void
+numio_array_destroy(struct numio_array *arr);
+
+/**
+ * Write the numbers separated by spaces, with a newline at the end.
+ * They are formatted by two digits at once, without stdio, and the
+ * text is written by NUMIO_WRITE_BUFFER bytes.
+ */
+int
+numio_save_text(const char *path, const int *data, size_t size);
+
+/** Text file written by parts, the same as numio_save_text() does. */
+struct numio_writer {
+	int fd;
+	char *buf;
+	char *pos;
+	/** Whether a number is written, the next ones go after a space. */
+	bool is_started;
+	/** Bytes written to the file so far. */
+	long long bytes;
+};
+
+/** The file descriptor is not owned by the writer. */
+int
+numio_writer_create(struct numio_writer *w, int fd);
+
+void
+numio_writer_destroy(struct numio_writer *w);
+
+int
+numio_writer_write(struct numio_writer *w, const int *data, size_t size);
+
+/** Write out the rest, with the newline at the end. */
+int
+numio_writer_finish(struct numio_writer *w);
+
+int
+numio_save_binary(const char *path, const int *data, size_t size);
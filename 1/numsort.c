@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "numsort.h"
+
+enum {
+	/** Ranges this small are insertion sorted. */
+	NUMSORT_INSERTION_MAX = 16,
+	/** The radix sort goes by bytes. */
+	NUMSORT_RADIX_BITS = 8,
+	NUMSORT_RADIX_BUCKETS = 1 << NUMSORT_RADIX_BITS,
+	NUMSORT_RADIX_PASSES = 32 / NUMSORT_RADIX_BITS,
+};
+
+static const char *const numsort_algo_names[] = {
+	"auto",
+	"radix",
+	"intro",
+};
+
+/** Account @a work elements, yield when a step of work is done. */
+static inline void
+numsort_tick(struct numsort *s, size_t work)
+{
+	s->work += work;
+	if (s->work < NUMSORT_STEP)
+		return;
+	s->work = 0;
+	if (s->yield != NULL)
+		s->yield(s->yield_arg);
+}
+
+static inline void
+numsort_swap(int *a, int *b)
+{
+	int tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+numsort_insertion(int *data, size_t size)
+{
+	for (size_t i = 1; i < size; ++i) {
+		int value = data[i];
+		size_t j = i;
+		for (; j > 0 && data[j - 1] > value; --j)
+			data[j] = data[j - 1];
+		data[j] = value;
+	}
+}
+
+static void
+numsort_sift_down(int *data, size_t size, size_t i)
+{
+	int value = data[i];
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && data[child + 1] > data[child])
+			++child;
+		if (data[child] <= value)
+			break;
+		data[i] = data[child];
+		i = child;
+	}
+	data[i] = value;
+}
+
+static void
+numsort_heap(struct numsort *s, int *data, size_t size)
+{
+	for (size_t i = size / 2; i > 0; --i) {
+		numsort_sift_down(data, size, i - 1);
+		numsort_tick(s, 1);
+	}
+	for (size_t end = size - 1; end > 0; --end) {
+		numsort_swap(&data[0], &data[end]);
+		numsort_sift_down(data, end, 0);
+		numsort_tick(s, 1);
+	}
+}
+
+/**
+ * Move the elements of data[0, end) for which the value is less than
+ * (or equal to) the pivot to the beginning. The branchless Lomuto
+ * scheme: every element is swapped, the split point moves or not.
+ * @retval Count of the moved elements.
+ */
+static size_t
+numsort_lomuto(struct numsort *s, int *data, size_t end, int pivot,
+	       bool or_equal)
+{
+	size_t store = 0;
+	for (size_t begin = 0; begin < end; begin += NUMSORT_STEP) {
+		size_t stop = end - begin < NUMSORT_STEP ?
+			      end : begin + NUMSORT_STEP;
+		for (size_t i = begin; i < stop; ++i) {
+			int value = data[i];
+			size_t is_left = or_equal ? value <= pivot :
+					 value < pivot;
+			data[i] = data[store];
+			data[store] = value;
+			store += is_left;
+		}
+		numsort_tick(s, stop - begin);
+	}
+	return store;
+}
+
+/**
+ * Partition around the median of the first, middle and last
+ * elements. data[0, *less) is less than the pivot, data[*greater,
+ * size) is greater or equal, between are the pivot copies.
+ */
+static void
+numsort_partition(struct numsort *s, int *data, size_t size, size_t *less,
+		  size_t *greater)
+{
+	size_t mid = size / 2;
+	size_t last = size - 1;
+	if (data[mid] < data[0])
+		numsort_swap(&data[mid], &data[0]);
+	if (data[last] < data[mid]) {
+		numsort_swap(&data[last], &data[mid]);
+		if (data[mid] < data[0])
+			numsort_swap(&data[mid], &data[0]);
+	}
+	numsort_swap(&data[mid], &data[last]);
+	int pivot = data[last];
+	size_t store = numsort_lomuto(s, data, last, pivot, false);
+	*less = store;
+	if (store == 0) {
+		/*
+		 * The pivot is the minimum. Gather its copies too, or runs
+		 * of equal numbers would be split off by one per round.
+		 */
+		store = numsort_lomuto(s, data, last, pivot, true);
+	}
+	numsort_swap(&data[store], &data[last]);
+	*greater = store + 1;
+}
+
+static void
+numsort_intro(struct numsort *s, int *data, size_t size, int depth)
+{
+	while (size > NUMSORT_INSERTION_MAX) {
+		if (depth-- == 0) {
+			numsort_heap(s, data, size);
+			return;
+		}
+		size_t less, greater;
+		numsort_partition(s, data, size, &less, &greater);
+		/* The smaller part is recursed into, the stack is log(n). */
+		if (less < size - greater) {
+			numsort_intro(s, data, less, depth);
+			data += greater;
+			size -= greater;
+		} else {
+			numsort_intro(s, data + greater, size - greater, depth);
+			size = less;
+		}
+	}
+	numsort_insertion(data, size);
+	numsort_tick(s, size);
+}
+
+/**
+ * Byte @a pass of the radix sort key. The sign bit is flipped, so the
+ * negative numbers go first in the unsigned order.
+ */
+static inline unsigned
+numsort_radix_digit(int value, int pass)
+{
+	uint32_t key = (uint32_t)value ^ 0x80000000u;
+	return (key >> (pass * NUMSORT_RADIX_BITS)) &
+	       (NUMSORT_RADIX_BUCKETS - 1);
+}
+
+/**
+ * LSD radix sort. All the byte counts are taken in one read of the
+ * array, then each byte is a stable scatter between the array and the
+ * scratch. A byte which is the same in all the numbers is skipped:
+ * small numbers take 2 passes, not 4.
+ * @retval false The scratch can not be allocated.
+ */
+static bool
+numsort_radix(struct numsort *s, int *data, size_t size)
+{
+	if (s->scratch_size < size) {
+		if (!s->is_scratch_external)
+			free(s->scratch);
+		s->is_scratch_external = false;
+		s->scratch = malloc(size * sizeof(*data));
+		if (s->scratch == NULL) {
+			s->scratch_size = 0;
+			return false;
+		}
+		s->scratch_size = size;
+	}
+	size_t counts[NUMSORT_RADIX_PASSES][NUMSORT_RADIX_BUCKETS];
+	memset(counts, 0, sizeof(counts));
+	for (size_t begin = 0; begin < size; begin += NUMSORT_STEP) {
+		size_t end = size - begin < NUMSORT_STEP ?
+			     size : begin + NUMSORT_STEP;
+		for (size_t i = begin; i < end; ++i) {
+			uint32_t key = (uint32_t)data[i] ^ 0x80000000u;
+			++counts[0][key & 0xff];
+			++counts[1][key >> 8 & 0xff];
+			++counts[2][key >> 16 & 0xff];
+			++counts[3][key >> 24];
+		}
+		numsort_tick(s, end - begin);
+	}
+	int *src = data;
+	int *dst = s->scratch;
+	for (int pass = 0; pass < NUMSORT_RADIX_PASSES; ++pass) {
+		size_t *offsets = counts[pass];
+		if (offsets[numsort_radix_digit(src[0], pass)] == size)
+			continue;
+		size_t offset = 0;
+		for (int b = 0; b < NUMSORT_RADIX_BUCKETS; ++b) {
+			size_t count = offsets[b];
+			offsets[b] = offset;
+			offset += count;
+		}
+		for (size_t begin = 0; begin < size; begin += NUMSORT_STEP) {
+			size_t end = size - begin < NUMSORT_STEP ?
+				     size : begin + NUMSORT_STEP;
+			for (size_t i = begin; i < end; ++i) {
+				int value = src[i];
+				dst[offsets[numsort_radix_digit(value,
+								pass)]++] =
+					value;
+			}
+			numsort_tick(s, end - begin);
+		}
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src == data)
+		return true;
+	for (size_t begin = 0; begin < size; begin += NUMSORT_STEP) {
+		size_t count = size - begin < NUMSORT_STEP ?
+			       size - begin : NUMSORT_STEP;
+		memcpy(data + begin, src + begin, count * sizeof(*data));
+		numsort_tick(s, count);
+	}
+	return true;
+}
+
+void
+numsort_create(struct numsort *s, numsort_yield_f yield, void *yield_arg)
+{
+	memset(s, 0, sizeof(*s));
+	s->yield = yield;
+	s->yield_arg = yield_arg;
+}
+
+void
+numsort_destroy(struct numsort *s)
+{
+	if (!s->is_scratch_external)
+		free(s->scratch);
+	memset(s, 0, sizeof(*s));
+}
+
+void
+numsort_set_scratch(struct numsort *s, int *scratch, size_t size)
+{
+	if (!s->is_scratch_external)
+		free(s->scratch);
+	s->scratch = scratch;
+	s->scratch_size = size;
+	s->is_scratch_external = true;
+}
+
+void
+numsort_sort(struct numsort *s, int *data, size_t size,
+	     enum numsort_algo algo)
+{
+	if (size < 2)
+		return;
+	if (algo == NUMSORT_AUTO) {
+		algo = size < NUMSORT_RADIX_MIN ? NUMSORT_INTRO :
+		       NUMSORT_RADIX;
+	}
+	if (algo == NUMSORT_RADIX && numsort_radix(s, data, size))
+		return;
+	/* Quicksort goes bad after 2 * log2(size) levels. */
+	int depth = 2 * (64 - __builtin_clzll(size));
+	numsort_intro(s, data, size, depth);
+}
+
+/**
+ * Key of a number in the loser tree: the number in the unsigned order
+ * above, the run index below. The keys are unique, so a comparison
+ * also breaks the ties by the run, and it is a single 64 bit compare.
+ */
+static inline uint64_t
+numsort_merge_key(int value, int run)
+{
+	return (uint64_t)((uint32_t)value ^ 0x80000000u) << 32 | (uint32_t)run;
+}
+
+/** Key of an empty run, greater than any real one. */
+static const uint64_t numsort_merge_end = UINT64_MAX;
+
+/** Key of the next number of a run, or the end key. */
+static inline uint64_t
+numsort_merger_key(struct numsort_merger *m, int run)
+{
+	struct numsort_run *r = &m->runs[run];
+	if (r->size == 0 && m->refill != NULL)
+		m->refill(m->refill_arg, run, r);
+	return r->size > 0 ? numsort_merge_key(r->data[0], run) :
+	       numsort_merge_end;
+}
+
+int
+numsort_merger_create(struct numsort_merger *m,
+		      const struct numsort_run *runs, int count,
+		      numsort_refill_f refill, void *refill_arg)
+{
+	memset(m, 0, sizeof(*m));
+	m->leaves = 1;
+	for (; m->leaves < count; m->leaves *= 2)
+		++m->levels;
+	/*
+	 * tree[1, leaves) are the losers of the matches, the leaves are
+	 * implicit. The winners of the matches are only needed to build
+	 * the tree, they take the rest.
+	 */
+	m->tree = malloc(3 * (size_t)m->leaves * sizeof(*m->tree));
+	m->runs = malloc(count * sizeof(*runs));
+	if (m->tree == NULL || (m->runs == NULL && count > 0)) {
+		numsort_merger_destroy(m);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (count > 0)
+		memcpy(m->runs, runs, count * sizeof(*runs));
+	m->count = count;
+	m->refill = refill;
+	m->refill_arg = refill_arg;
+	uint64_t *winners = m->tree + m->leaves;
+	for (int i = 0; i < m->leaves; ++i) {
+		winners[m->leaves + i] = i < count ?
+			numsort_merger_key(m, i) : numsort_merge_end;
+	}
+	for (int node = m->leaves - 1; node > 0; --node) {
+		uint64_t left = winners[2 * node];
+		uint64_t right = winners[2 * node + 1];
+		winners[node] = left < right ? left : right;
+		m->tree[node] = left < right ? right : left;
+	}
+	m->winner = winners[1];
+	return 0;
+}
+
+void
+numsort_merger_destroy(struct numsort_merger *m)
+{
+	free(m->tree);
+	free(m->runs);
+	memset(m, 0, sizeof(*m));
+}
+
+size_t
+numsort_merger_next(struct numsort_merger *m, int *out, size_t size)
+{
+	uint64_t *tree = m->tree;
+	uint64_t winner = m->winner;
+	size_t i = 0;
+	for (; i < size && winner != numsort_merge_end; ++i) {
+		int run = (uint32_t)winner;
+		out[i] = (int)((uint32_t)(winner >> 32) ^ 0x80000000u);
+		struct numsort_run *r = &m->runs[run];
+		++r->data;
+		--r->size;
+		uint64_t key = r->size > 0 ?
+			numsort_merge_key(r->data[0], run) :
+			numsort_merger_key(m, run);
+		/*
+		 * Replay the matches of the run up to the root: the new key
+		 * plays against the losers on its path, the smaller one goes
+		 * on. min/max compile into cmov.
+		 */
+		int node = (m->leaves + run) >> 1;
+		for (int level = 0; level < m->levels; ++level) {
+			uint64_t loser = tree[node];
+			tree[node] = loser < key ? key : loser;
+			key = loser < key ? loser : key;
+			node >>= 1;
+		}
+		winner = key;
+	}
+	m->winner = winner;
+	return i;
+}
+
+int
+numsort_merge(struct numsort *s, const struct numsort_run *runs, int count,
+	      int *out)
+{
+	if (count == 1) {
+		memcpy(out, runs[0].data, runs[0].size * sizeof(*out));
+		return 0;
+	}
+	struct numsort_merger m;
+	if (numsort_merger_create(&m, runs, count, NULL, NULL) != 0)
+		return -1;
+	size_t done;
+	while ((done = numsort_merger_next(&m, out, NUMSORT_STEP)) > 0) {
+		out += done;
+		numsort_tick(s, done);
+	}
+	numsort_merger_destroy(&m);
+	return 0;
+}
+
+/** Count of numbers of the run less than @a value, or not greater. */
+static size_t
+numsort_rank_of(const struct numsort_run *r, int64_t value, bool is_equal_in)
+{
+	size_t begin = 0;
+	size_t end = r->size;
+	while (begin < end) {
+		size_t mid = begin + (end - begin) / 2;
+		if (r->data[mid] < value || (is_equal_in && r->data[mid] == value))
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+void
+numsort_split(const struct numsort_run *runs, int count, size_t rank,
+	      size_t *pos)
+{
+	/*
+	 * Find the smallest value with at least rank numbers not greater
+	 * than it. All the smaller numbers go to the left, and its own
+	 * copies fill the rest of rank, the first runs first.
+	 */
+	int64_t low = INT32_MIN;
+	int64_t high = INT32_MAX;
+	while (low < high) {
+		int64_t mid = low + (high - low) / 2;
+		size_t not_greater = 0;
+		for (int i = 0; i < count && not_greater < rank; ++i)
+			not_greater += numsort_rank_of(&runs[i], mid, true);
+		if (not_greater >= rank)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	size_t less = 0;
+	for (int i = 0; i < count; ++i) {
+		pos[i] = numsort_rank_of(&runs[i], low, false);
+		less += pos[i];
+	}
+	size_t rest = rank > less ? rank - less : 0;
+	for (int i = 0; i < count && rest > 0; ++i) {
+		size_t equal = numsort_rank_of(&runs[i], low, true) - pos[i];
+		if (equal > rest)
+			equal = rest;
+		pos[i] += equal;
+		rest -= equal;
+	}
+}
+
+const char *
+numsort_algo_name(enum numsort_algo algo)
+{
+	return numsort_algo_names[algo];
+}
+
+enum numsort_algo
+numsort_algo_by_name(const char *name)
+{
+	int algo = 0;
+	for (; algo < NUMSORT_ALGO_COUNT; ++algo) {
+		if (strcmp(numsort_algo_names[algo], name) == 0)
+			break;
+	}
+	return algo;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Sorting of int32 arrays, meant to run inside coroutines: the work
+ * between two calls of the yield callback is about NUMSORT_STEP
+ * elements, whatever the array size.
+ */
+
+enum {
+	/** Elements of work between two yield callbacks. */
+	NUMSORT_STEP = 1 << 16,
+	/** Arrays this big and bigger are radix sorted by NUMSORT_AUTO. */
+	NUMSORT_RADIX_MIN = 64,
+};
+
+enum numsort_algo {
+	/** By the size: introsort for small arrays, radix for others. */
+	NUMSORT_AUTO,
+	/** LSD radix sort by bytes, needs a scratch of the same size. */
+	NUMSORT_RADIX,
+	/** Quicksort, heapsort on bad pivots, insertion sort on small. */
+	NUMSORT_INTRO,
+	NUMSORT_ALGO_COUNT,
+};
+
+typedef void (*numsort_yield_f)(void *arg);
+
+/** Sorter state, reused from array to array. */
+struct numsort {
+	/** Radix sort scratch, grows to the biggest array sorted. */
+	int *scratch;
+	size_t scratch_size;
+	/** The scratch is the caller's, it is not freed. */
+	bool is_scratch_external;
+	/** Called every NUMSORT_STEP elements of work, can be NULL. */
+	numsort_yield_f yield;
+	void *yield_arg;
+	/** Work since the last yield, in elements. */
+	size_t work;
+};
+
+void
+numsort_create(struct numsort *s, numsort_yield_f yield, void *yield_arg);
+
+void
+numsort_destroy(struct numsort *s);
+
+/**
+ * Give the sorter a scratch of @a size numbers owned by the caller,
+ * instead of its own. Radix sorts of arrays up to this size take no
+ * memory. A bigger array makes the sorter allocate its own scratch
+ * again.
+ */
+void
+numsort_set_scratch(struct numsort *s, int *scratch, size_t size);
+
+/**
+ * Sort @a data in place. When the radix sort scratch can not be
+ * allocated, introsort is used instead.
+ */
+void
+numsort_sort(struct numsort *s, int *data, size_t size,
+	     enum numsort_algo algo);
+
+/** A sorted array, one of the merged ones. */
+struct numsort_run {
+	const int *data;
+	size_t size;
+};
+
+/**
+ * Merge @a count sorted runs into @a out in one pass, with a loser
+ * tree. Each number is copied once, and takes log2(count) branchless
+ * comparisons. Equal numbers keep the order of their runs.
+ * @retval 0 Success.
+ * @retval -1 No memory for the tree.
+ */
+int
+numsort_merge(struct numsort *s, const struct numsort_run *runs, int count,
+	      int *out);
+
+/**
+ * Find where the first @a rank numbers of the merge of @a runs end:
+ * they are runs[i].data[0 .. pos[i]) of each run. Equal numbers are
+ * split in the order of the runs, as numsort_merge() puts them. So a
+ * merge can be cut into slices of any sizes, merged independently,
+ * and the concatenation of the slices is the same as the whole merge.
+ * Takes about 32 * count * log2(run size) comparisons.
+ */
+void
+numsort_split(const struct numsort_run *runs, int count, size_t rank,
+	      size_t *pos);
+
+/**
+ * Give run @a run its next part after the previous one is merged, or
+ * size 0 if the run is over.
+ */
+typedef void (*numsort_refill_f)(void *arg, int run, struct numsort_run *r);
+
+/** The loser tree merge by parts, of runs which come by parts. */
+struct numsort_merger {
+	/** Unmerged rest of the current part of each run. */
+	struct numsort_run *runs;
+	int count;
+	int leaves;
+	int levels;
+	uint64_t *tree;
+	uint64_t winner;
+	numsort_refill_f refill;
+	void *refill_arg;
+};
+
+/**
+ * @param runs First parts of the runs, empty ones are refilled
+ *        right away.
+ * @param refill NULL if the runs come whole.
+ */
+int
+numsort_merger_create(struct numsort_merger *m,
+		      const struct numsort_run *runs, int count,
+		      numsort_refill_f refill, void *refill_arg);
+
+void
+numsort_merger_destroy(struct numsort_merger *m);
+
+/**
+ * Merge up to @a size next numbers into @a out.
+ * @retval Count of merged numbers, less than @a size only when all
+ *         the runs are over.
+ */
+size_t
+numsort_merger_next(struct numsort_merger *m, int *out, size_t size);
+
+/** "auto", "radix", "intro". */
+const char *
+numsort_algo_name(enum numsort_algo algo);
+
+/** @retval NUMSORT_ALGO_COUNT Unknown name. */
+enum numsort_algo
+numsort_algo_by_name(const char *name);
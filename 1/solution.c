@@ -2,65 +2,182 @@
 #include <stdlib.h>
 #include <string.h>
 #include "libcoro.h"
+#include "libcoro_trace.h"
+#include "numio.h"
+#include "numsort.h"
+#include "extsort.h"
+#include "arena.h"
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /**
 The most practical sorting algorithm is a hybrid of algorithms; 
-So, this code will use quick sort for individual files and the 
-merge functionality of merge sort for merging already sorted arrays. 
+So, this code will use radix sort (introsort for small ones) for 
+individual files and a K-way merge of all the sorted arrays at 
+once. 
 */
 
-struct my_context {
+enum {
+    // Big files are cut into chunks for the worker threads, but not
+    // into chunks smaller than this many numbers.
+    SORT_CHUNK_MIN = 1 << 16,
+    // The pipeline: files loaded ahead of the sort at most, and the
+    // blocks of the result, in numbers, cycled between the merge and
+    // the writer - one is filled while the other is written.
+    SORT_LOAD_QUEUE = 2,
+    SORT_BLOCK = 1 << 16,
+    SORT_BLOCK_COUNT = 2,
+};
+
+/* One input file, sorted by whichever coroutine takes it. */
+struct file_context {
 	char *name;
-	/* TODO: ADD HERE WORK TIME, ... */
     int* numsVector;
-    int* size;
-    int* capacity;
-    struct timespec start_time;
-    struct timespec end_time;
-    long long int total_work_time_nsec;
-    int context_switch_count;
+    int size;
+    /* Room in buffer, enough for any text of the file size. */
+    int capacity;
+    int* buffer;
+    /* Where numsVector lives: the buffer, or a binary file mapping. */
+    struct numio_array nums;
+    /* File size, to give big files more threads. */
+    long long int bytes;
+    /* Sorted parts of numsVector, of equal sizes. */
+    int chunk_count;
+};
+
+/* Files not taken by any coroutine yet, shared by the whole pool. */
+struct work_list {
+    struct file_context **files;
+    int count;
+    /* Taken atomically: the coroutines can run on many threads. */
+    int next;
+    long long int total_bytes;
+    int thread_count;
+    /*
+     * Room for all the numbers: the radix sort scratch of the files,
+     * taken atomically, and then the result of the merge.
+     */
+    int *scratch;
+    size_t scratch_capacity;
+    size_t scratch_used;
+};
 
+struct pipeline;
+
+struct my_context {
+    int id;
+    struct work_list *work;
+    /* Loaded files come from it, NULL when the files are taken. */
+    struct pipeline *pipeline;
+    /* Time budget of one coroutine run, T / N. */
+    long long int quantum_usec;
+    enum numsort_algo sort_algo;
+    /* Keeps its radix sort scratch from file to file. */
+    struct numsort sorter;
+    int files_sorted;
+    long long int numbers_sorted;
+    /* Taken from the scheduler when the coroutine is done. */
+    long long int work_time_nsec;
+    long long int wait_time_nsec;
+    long long int context_switch_count;
 };
 
-int* ReadNumsFromFile(char* filename, int* numsVector, int* size, int* capacity){
-    *capacity = 2;
-    *size = 0;
-    numsVector = (int *)malloc( (*capacity) * sizeof(int));
-    FILE *test_file = fopen(filename, "r");
-    if (test_file == NULL)
-    {
-        printf("Error: FILE NOT FOUND\n");
+// Runs on a helper thread of libcoro: reads of a regular file
+// block, and epoll can not wait for them. Text files are parsed,
+// binary ones are just mapped.
+static void *ReadFileTask(void *arg) {
+    struct file_context *file = arg;
+    if (numio_load_to(file->name, file->buffer, file->capacity,
+                      &file->nums) != 0) {
+        printf("Error: can not load %s: %s\n", file->name, strerror(errno));
         return NULL;
     }
-    int num;
-    while (fscanf(test_file, "%d", &num) != EOF)
-    {
-        if ((*size) == (*capacity) )
-        {
-            (*capacity) *= 2;
-            numsVector = (int *)realloc(numsVector, (*capacity) * sizeof(int));
-            if (numsVector == NULL)
-            {
-                printf("Error: MEMORY ALLOCATION FAILED\n");
-                return NULL;
-            }
-        }
-        numsVector[(*size)++] = num;
+    file->size = file->nums.size;
+    return file->nums.data;
+}
+
+// The arena is sized by these, see ArenaSize().
+static size_t FileArenaSize(const char *name, long long int bytes) {
+    return arena_size_of(sizeof(struct file_context)) +
+        arena_size_of(strlen(name) + 1) +
+        arena_size_of(numio_text_capacity(bytes) * sizeof(int));
+}
+
+static struct file_context *
+file_context_new(struct arena *arena, const char *name, long long int bytes)
+{
+	struct file_context *file = arena_alloc(arena, sizeof(*file));
+    if (file == NULL) {
+        return NULL;
+    }
+	file->name = arena_alloc(arena, strlen(name) + 1);
+    if (file->name == NULL) {
+        return NULL;
+    }
+    strcpy(file->name, name);
+    file->size = 0;
+    file->capacity = numio_text_capacity(bytes);
+    // Without a buffer the file is loaded into its own allocation.
+    file->buffer = arena_alloc(arena, file->capacity * sizeof(int));
+    if (file->buffer == NULL) {
+        file->capacity = 0;
+    }
+    file->numsVector = NULL;
+    memset(&file->nums, 0, sizeof(file->nums));
+    file->bytes = bytes;
+    file->chunk_count = 1;
+	return file;
+}
+
+static void
+file_context_delete(struct file_context *file)
+{
+    // Frees a binary file mapping, the rest is in the arena.
+    numio_array_destroy(&file->nums);
+}
+
+// A part of the result region, as the radix sort scratch of a file:
+// the region is not used before the merge. NULL if the files have
+// grown since the arena was sized, then the sorter allocates.
+static int *TakeScratch(struct work_list *work, int size) {
+    size_t offset = __atomic_fetch_add(&work->scratch_used, size,
+                                       __ATOMIC_RELAXED);
+    if (offset + size > work->scratch_capacity) {
+        return NULL;
     }
-    fclose(test_file);
-    return numsVector;
+    return work->scratch + offset;
+}
+
+// Called by the sort engine after each bounded piece of work.
+static void SortYield(void *arg) {
+    (void)arg;
+    // Let the others work if this coroutine's quantum is over.
+    // The scheduler measures work time and switches itself.
+    coro_yield_if_quantum_expired();
 }
 
 static struct my_context *
-my_context_new(const char *name)
+my_context_new(struct arena *arena, int id, struct work_list *work,
+               struct pipeline *pipeline, long long int quantum_usec,
+               enum numsort_algo sort_algo)
 {
-	struct my_context *ctx = malloc(sizeof(*ctx));
-	ctx->name = strdup(name);
-    ctx->size = (int*)malloc(sizeof(int));
-    ctx->capacity = (int*)malloc(sizeof(int));
-    ctx->numsVector = 
-        ReadNumsFromFile(ctx->name, ctx->numsVector, ctx->size, ctx->capacity);
+	struct my_context *ctx = arena_alloc(arena, sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->id = id;
+    ctx->work = work;
+    ctx->pipeline = pipeline;
+    ctx->quantum_usec = quantum_usec;
+    ctx->sort_algo = sort_algo;
+    numsort_create(&ctx->sorter, SortYield, NULL);
+    ctx->files_sorted = 0;
+    ctx->numbers_sorted = 0;
+    ctx->work_time_nsec = 0;
+    ctx->wait_time_nsec = 0;
     ctx->context_switch_count = 0;
 	return ctx;
 }
@@ -68,258 +185,839 @@ my_context_new(const char *name)
 static void
 my_context_delete(struct my_context *ctx)
 {
-	free(ctx->name);
-    free(ctx->capacity);
+    numsort_destroy(&ctx->sorter);
 }
 
-// Utility functions for sorting 
-
-void swap(int *a, int *b) {
-    int t = *a;
-    *a = *b;
-    *b = t;
+// First number of chunk i of the file cut into chunk_count chunks.
+static size_t ChunkBegin(int size, int chunk_count, int i) {
+    return (size_t)size * i / chunk_count;
 }
 
-void Merge(int *arr, int s, int mid, int e) {
-    int n1 = mid - s + 1;
-    int n2 = e - mid;
-
-    int L[n1], R[n2];
-
-    for (int i = 0; i < n1; i++)
-        L[i] = arr[s + i];
-    for (int j = 0; j < n2; j++)
-        R[j] = arr[mid + 1 + j];
-
-    int i = 0, j = 0, k = s;
-
-    while (i < n1 && j < n2) {
-        if (L[i] <= R[j]) {
-            arr[k] = L[i];
-            i++;
-        } else {
-            arr[k] = R[j];
-            j++;
-        }
-        k++;
-    }
-
-    while (i < n1) {
-        arr[k] = L[i];
-        i++;
-        k++;
+// A file gets chunks by its share of all the input, so that no chunk
+// is much more than 1 / thread_count of the work. With as many files
+// as threads, or more, each file is sorted whole.
+static int ChunkCount(const struct file_context *file,
+                      const struct work_list *work) {
+    if (work->thread_count == 1 || work->total_bytes == 0) {
+        return 1;
     }
-
-    while (j < n2) {
-        arr[k] = R[j];
-        j++;
-        k++;
+    long long int count = (file->bytes * work->thread_count +
+                           work->total_bytes - 1) / work->total_bytes;
+    long long int max_count = file->size / SORT_CHUNK_MIN;
+    if (count > max_count) {
+        count = max_count;
     }
+    return count < 1 ? 1 : count;
 }
 
-long long int MergeSortHelper(int *arr, int s, int e, struct coro* this, struct my_context *ctx) {
-    if (s < e) {
-        int mid = (s + e) / 2;
-        int yield_total_time = 0;
-
-        struct timespec start_time, end_time;
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        long long int yield_start_time = start_time.tv_sec * 1000000000 + start_time.tv_nsec;
-
-        // Yield to the coroutine
-        ctx->context_switch_count += coro_switch_count(this);
-        coro_yield();
-
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-
-        long long int yield_end_time = end_time.tv_sec * 1000000000 + end_time.tv_nsec;
-        yield_total_time += yield_end_time - yield_start_time;
-
-        yield_total_time += MergeSortHelper(arr, s, mid, this, ctx);
-        yield_total_time += MergeSortHelper(arr, mid + 1, e, this, ctx);
-
-        Merge(arr, s, mid, e);
+// A chunk of a big file, sorted by a coroutine of its own, which an
+// idle worker thread steals.
+struct sort_chunk {
+    int *data;
+    size_t size;
+    /* NULL if the sorter should allocate one. */
+    int *scratch;
+    enum numsort_algo sort_algo;
+    long long int quantum_usec;
+    struct coro_wait_group *done;
+};
 
-        return yield_total_time;
+static int SortChunkFunc(void *arg) {
+    struct sort_chunk *chunk = arg;
+    coro_set_quantum(coro_this(), chunk->quantum_usec);
+    struct numsort sorter;
+    numsort_create(&sorter, SortYield, NULL);
+    if (chunk->scratch != NULL) {
+        numsort_set_scratch(&sorter, chunk->scratch, chunk->size);
     }
-
+    numsort_sort(&sorter, chunk->data, chunk->size, chunk->sort_algo);
+    numsort_destroy(&sorter);
+    coro_wait_group_done(chunk->done);
     return 0;
 }
 
-long long int MergeSort(int *numsVector, int s, int e, struct coro* this, char* name, struct my_context *ctx) {
-    if (e <= s) {
-        return 0;
+// Sorts the chunks of the file in parallel: the first one here, the
+// others in new coroutines. They are merged with all the files.
+static void SortChunks(struct my_context *ctx, struct file_context *file,
+                       int *scratch) {
+    int count = file->chunk_count;
+    struct sort_chunk *chunks = malloc(count * sizeof(struct sort_chunk));
+    if (chunks == NULL) {
+        // Then the file is sorted whole, and is one run of the merge.
+        file->chunk_count = 1;
+        numsort_set_scratch(&ctx->sorter, scratch,
+                            scratch != NULL ? file->size : 0);
+        numsort_sort(&ctx->sorter, file->numsVector, file->size,
+                     ctx->sort_algo);
+        return;
     }
+    struct coro_wait_group *done = coro_wait_group_new();
+    coro_wait_group_add(done, count - 1);
+    for (int i = 0; i < count; i++) {
+        size_t begin = ChunkBegin(file->size, count, i);
+        chunks[i].data = file->numsVector + begin;
+        chunks[i].size = ChunkBegin(file->size, count, i + 1) - begin;
+        chunks[i].scratch = scratch != NULL ? scratch + begin : NULL;
+        chunks[i].sort_algo = ctx->sort_algo;
+        chunks[i].quantum_usec = ctx->quantum_usec;
+        chunks[i].done = done;
+        // Without memory for a coroutine the chunk is sorted here.
+        if (i > 0 && coro_new(SortChunkFunc, &chunks[i]) == NULL) {
+            SortChunkFunc(&chunks[i]);
+        }
+    }
+    numsort_set_scratch(&ctx->sorter, chunks[0].scratch,
+                        chunks[0].scratch != NULL ? chunks[0].size : 0);
+    numsort_sort(&ctx->sorter, chunks[0].data, chunks[0].size,
+                 ctx->sort_algo);
+    coro_wait_group_wait(done);
+    coro_wait_group_delete(done);
+    free(chunks);
+}
 
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    long long int yield_start_time = start_time.tv_sec * 1000000000 + start_time.tv_nsec;
-
-    long long int yield_total_time = MergeSortHelper(numsVector, s, e, this, ctx);
-
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
+// Pipeline engine: the stages are coroutines joined by bounded
+// channels, and each stage works while the next one does. Loaders
+// parse files on helper threads while the pool sorts the files loaded
+// before. Then the merge fills blocks of the result while the blocks
+// before are formatted and written on a helper thread.
+struct pipeline {
+    struct work_list *work;
+    /* Loaded files, not sorted yet. */
+    struct coro_chan *loaded;
+    /* Loaders still working, the last one closes the channel. */
+    int loader_count;
+    /* The pool coroutines, the merge waits for all the sorts. */
+    struct coro_wait_group *sorted;
+    /* Empty blocks for the merge, and full ones for the writer. */
+    struct coro_chan *free_blocks;
+    struct coro_chan *full_blocks;
+    struct result_block *blocks;
+    int fd;
+    struct numio_writer writer;
+    int write_status;
+    /* Of the failed write, errno of the helper thread is not ours. */
+    int write_errno;
+    long long int write_time_nsec;
+    long long int merged;
+};
 
-    long long int yield_end_time = end_time.tv_sec * 1000000000 + end_time.tv_nsec;
-    yield_total_time += yield_end_time - yield_start_time;
+struct result_block {
+    struct pipeline *pipeline;
+    int *data;
+    size_t size;
+};
 
-    return yield_total_time;
+// Takes the next file and loads it. NULL when no file is left, or
+// when the file can not be loaded - then *is_failed is set.
+static struct file_context *LoadNextFile(struct work_list *work,
+                                         bool *is_failed) {
+    int index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+    if (index >= work->count) {
+        return NULL;
+    }
+    struct file_context *file = work->files[index];
+    // The other coroutines keep sorting while the file is read.
+    file->numsVector = coro_blocking_call(ReadFileTask, file);
+    if (file->numsVector == NULL) {
+        *is_failed = true;
+        return NULL;
+    }
+    return file;
 }
 
 /**
- * Coroutine body. This code is executed by all the coroutines. Here you
- * implement your solution, sort each individual file.
+ * Coroutine body. This code is executed by all the coroutines of
+ * the pool. Each one takes the next unsorted file from the shared
+ * work list and sorts it, until the list is empty. In the pipeline
+ * the files come loaded already.
  */
 
 static int
 coroutine_func_f(void *context)
 {
-	/* IMPLEMENT SORTING OF wqsa FILES HERE. */
-
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
-	char *name = ctx->name;
-	printf("Started coroutine %s\n", name);
-    
-    clock_gettime(CLOCK_MONOTONIC, &ctx->start_time);     
-    long long int yield_time = MergeSort(ctx->numsVector, 0, (*ctx->size) - 1, this, name, ctx);
-    clock_gettime(CLOCK_MONOTONIC, &ctx->end_time); 
-
-    long long int work_time_nsec = (ctx->end_time.tv_sec - ctx->start_time.tv_sec) * 1000000000 +
-                            (ctx->end_time.tv_nsec - ctx->start_time.tv_nsec) - yield_time;
-    
-    __sync_add_and_fetch(&ctx->total_work_time_nsec, work_time_nsec);
-
-	printf("%s: switch count after other function %lld\n", name,
+	printf("Started coroutine %d (trace id %llu)\n", ctx->id,
+	       coro_id(this));
+    coro_set_quantum(this, ctx->quantum_usec);
+
+    bool is_failed = false;
+    while (true) {
+        struct file_context *file;
+        if (ctx->pipeline != NULL) {
+            void *msg;
+            if (coro_chan_recv(ctx->pipeline->loaded, &msg) != 0) {
+                break;
+            }
+            file = msg;
+        } else {
+            // A file which can not be loaded is skipped, the others
+            // in the list are still sorted.
+            bool is_load_failed = false;
+            file = LoadNextFile(ctx->work, &is_load_failed);
+            if (is_load_failed) {
+                is_failed = true;
+                continue;
+            }
+            if (file == NULL) {
+                break;
+            }
+        }
+        file->chunk_count = ChunkCount(file, ctx->work);
+        int *scratch = TakeScratch(ctx->work, file->size);
+        if (file->chunk_count > 1) {
+            SortChunks(ctx, file, scratch);
+        } else {
+            numsort_set_scratch(&ctx->sorter, scratch,
+                                scratch != NULL ? file->size : 0);
+            numsort_sort(&ctx->sorter, file->numsVector, file->size,
+                         ctx->sort_algo);
+        }
+        ctx->files_sorted++;
+        ctx->numbers_sorted += file->size;
+    }
+    if (ctx->pipeline != NULL) {
+        coro_wait_group_done(ctx->pipeline->sorted);
+    }
+
+    ctx->work_time_nsec = coro_work_time(this);
+    ctx->wait_time_nsec = coro_wait_time(this);
+    ctx->context_switch_count = coro_switch_count(this);
+	printf("%d: switch count after other function %lld\n", ctx->id,
 	       coro_switch_count(this));
 
-	my_context_delete(ctx);
 	/* This will be returned from coro_status(). */
-	return 0;
+	return is_failed ? 1 : 0;
 }
 
+// Sorted runs of all the files: each sorted chunk is a run of its own.
+static struct numsort_run *CollectRuns(const struct work_list *work,
+                                       int *run_count) {
+    *run_count = 0;
+    for (int i = 0; i < work->count; i++) {
+        *run_count += work->files[i]->chunk_count;
+    }
+    struct numsort_run *runs = malloc(*run_count * sizeof(struct numsort_run));
+    if (runs == NULL) {
+        return NULL;
+    }
+    int run = 0;
+    for (int i = 0; i < work->count; i++) {
+        struct file_context *file = work->files[i];
+        for (int j = 0; j < file->chunk_count; j++) {
+            size_t begin = ChunkBegin(file->size, file->chunk_count, j);
+            runs[run].data = file->numsVector + begin;
+            runs[run].size =
+                ChunkBegin(file->size, file->chunk_count, j + 1) - begin;
+            run++;
+        }
+    }
+    return runs;
+}
 
-void merge(int* arr1, int* arr2, int size1, int size2, int* result){
+static int LoaderFunc(void *arg) {
+    struct pipeline *p = arg;
+    bool is_failed = false;
+    while (true) {
+        // A file which can not be loaded is skipped, as in the pool.
+        bool is_load_failed = false;
+        struct file_context *file = LoadNextFile(p->work, &is_load_failed);
+        if (is_load_failed) {
+            is_failed = true;
+            continue;
+        }
+        if (file == NULL) {
+            break;
+        }
+        // Waits while SORT_LOAD_QUEUE files wait for the sort already.
+        coro_chan_send(p->loaded, file);
+    }
+    if (__atomic_sub_fetch(&p->loader_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        coro_chan_close(p->loaded);
+    }
+    return is_failed ? 1 : 0;
+}
 
-    int i = 0, j = 0, k = 0;
+// Runs on a helper thread: formats a block and writes it when the
+// writer's buffer is full.
+static void *WriteBlockTask(void *arg) {
+    struct result_block *block = arg;
+    struct pipeline *p = block->pipeline;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (block->size > 0) {
+        p->write_status = numio_writer_write(&p->writer, block->data,
+                                             block->size);
+    } else {
+        p->write_status = numio_writer_finish(&p->writer);
+    }
+    if (p->write_status != 0) {
+        p->write_errno = errno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    p->write_time_nsec += (end.tv_sec - start.tv_sec) * 1000000000LL +
+        end.tv_nsec - start.tv_nsec;
+    return NULL;
+}
 
-    while (i < size1 && j < size2) {
-        if (*(arr1 + i) < *(arr2+ j) ) {
-            *(result + k++) = *(arr1 + i++);
-        } else {
-            *(result + k++) = *(arr2 + j++);
+static int MergeStreamFunc(void *arg) {
+    struct pipeline *p = arg;
+    coro_wait_group_wait(p->sorted);
+    int run_count;
+    struct numsort_run *runs = CollectRuns(p->work, &run_count);
+    struct numsort_merger merger;
+    if (runs == NULL ||
+        numsort_merger_create(&merger, runs, run_count, NULL, NULL) != 0) {
+        free(runs);
+        coro_chan_close(p->full_blocks);
+        return 1;
+    }
+    void *msg;
+    // Stops early if the writer has failed and closed the channel.
+    while (coro_chan_recv(p->free_blocks, &msg) == 0) {
+        struct result_block *block = msg;
+        block->size = numsort_merger_next(&merger, block->data, SORT_BLOCK);
+        p->merged += block->size;
+        if (block->size > 0) {
+            coro_chan_send(p->full_blocks, block);
+        }
+        if (block->size < SORT_BLOCK) {
+            break;
         }
+        coro_yield_if_quantum_expired();
     }
+    coro_chan_close(p->full_blocks);
+    numsort_merger_destroy(&merger);
+    free(runs);
+    return 0;
+}
 
-    while (i < size1) {
-        *(result + k++) = *(arr1 + i++);
+static int WriterFunc(void *arg) {
+    struct pipeline *p = arg;
+    void *msg;
+    while (p->write_status == 0 &&
+           coro_chan_recv(p->full_blocks, &msg) == 0) {
+        // The merge fills the other block meanwhile.
+        coro_blocking_call(WriteBlockTask, msg);
+        coro_chan_send(p->free_blocks, msg);
     }
-    while (j < size2) {
-       *(result + k++) = *(arr2 + j++);
+    coro_chan_close(p->free_blocks);
+    if (p->write_status == 0) {
+        // A block of size 0 writes the rest of the buffer.
+        p->blocks[0].size = 0;
+        coro_blocking_call(WriteBlockTask, &p->blocks[0]);
     }
+    return p->write_status == 0 ? 0 : 1;
 }
 
-int *MergeSortedArrays(struct my_context **contexts, int size)
+static struct pipeline *
+pipeline_new(struct work_list *work, int coro_count, int loader_count)
 {
-    if (size == 1)
-    {
-        return contexts[0]->numsVector;
-    }
-    struct my_context **new_contexts = malloc((size / 2 + 1) * sizeof(struct my_context *));
-
-    for (int i = 0; i < size - 1; i += 2)
-    {
-        int *new_size = malloc(sizeof(int));
-        *new_size = (*contexts[i]->size) + (*contexts[i + 1]->size);
-        int *resultVector = (int *)malloc((*new_size) * sizeof(int));
-        if (resultVector == NULL)
-        {
-            printf("Error: MEMORY ALLOCATION FAILED\n");
-            return NULL;
+    struct pipeline *p = malloc(sizeof(*p));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->work = work;
+    // The blocks are allocated before the result file is truncated.
+    p->blocks = calloc(SORT_BLOCK_COUNT, sizeof(struct result_block));
+    bool is_allocated = p->blocks != NULL;
+    for (int i = 0; is_allocated && i < SORT_BLOCK_COUNT; i++) {
+        p->blocks[i].data = malloc(SORT_BLOCK * sizeof(int));
+        is_allocated = p->blocks[i].data != NULL;
+    }
+    p->fd = is_allocated ?
+        open("result.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (p->fd < 0 || numio_writer_create(&p->writer, p->fd) != 0) {
+        int err = errno;
+        if (p->fd >= 0) {
+            close(p->fd);
         }
+        for (int i = 0; p->blocks != NULL && i < SORT_BLOCK_COUNT; i++) {
+            free(p->blocks[i].data);
+        }
+        free(p->blocks);
+        free(p);
+        errno = err;
+        return NULL;
+    }
+    p->loaded = coro_chan_new(SORT_LOAD_QUEUE);
+    p->loader_count = loader_count;
+    p->sorted = coro_wait_group_new();
+    coro_wait_group_add(p->sorted, coro_count);
+    p->free_blocks = coro_chan_new(SORT_BLOCK_COUNT);
+    p->full_blocks = coro_chan_new(SORT_BLOCK_COUNT);
+    // All the blocks fit into either channel, a send never waits.
+    for (int i = 0; i < SORT_BLOCK_COUNT; i++) {
+        p->blocks[i].pipeline = p;
+        p->blocks[i].size = 0;
+    }
+    p->write_status = 0;
+    p->write_errno = 0;
+    p->write_time_nsec = 0;
+    p->merged = 0;
+    return p;
+}
+
+// Starts all the stages but the sort pool. Returns -1 if a stage
+// could not be started; the loaders which could are still waited for.
+static int
+pipeline_start(struct pipeline *p)
+{
+    int loader_count = p->loader_count;
+    for (int i = 0; i < loader_count; i++) {
+        if (coro_new(LoaderFunc, p) == NULL) {
+            // The last loader closes the channel, count those started.
+            int missing = loader_count - i;
+            if (__atomic_sub_fetch(&p->loader_count, missing,
+                                   __ATOMIC_ACQ_REL) == 0) {
+                coro_chan_close(p->loaded);
+            }
+            return -1;
+        }
+    }
+    for (int i = 0; i < SORT_BLOCK_COUNT; i++) {
+        coro_chan_send(p->free_blocks, &p->blocks[i]);
+    }
+    if (coro_new(MergeStreamFunc, p) == NULL ||
+        coro_new(WriterFunc, p) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the status of the result file, errno is set on error.
+static int
+pipeline_delete(struct pipeline *p)
+{
+    int rc = p->write_status;
+    int err = p->write_errno;
+    if (close(p->fd) != 0 && rc == 0) {
+        rc = -1;
+        err = errno;
+    }
+    numio_writer_destroy(&p->writer);
+    coro_chan_delete(p->loaded);
+    coro_wait_group_delete(p->sorted);
+    coro_chan_delete(p->free_blocks);
+    coro_chan_delete(p->full_blocks);
+    for (int i = 0; i < SORT_BLOCK_COUNT; i++) {
+        free(p->blocks[i].data);
+    }
+    free(p->blocks);
+    free(p);
+    errno = err;
+    return rc;
+}
+
+
+static bool IsNumber(const char *str) {
+    if (*str == '\0') {
+        return false;
+    }
+    for (; *str != '\0'; str++) {
+        if (*str < '0' || *str > '9') {
+            return false;
+        }
+    }
+    return true;
+}
 
-        merge(contexts[i]->numsVector, contexts[i + 1]->numsVector, *contexts[i]->size, *contexts[i + 1]->size, resultVector);
+// One slice of the result, merged by its own coroutine: the runs are
+// cut at the ranks of the slice ends, see numsort_split().
+struct merge_slice {
+    const struct numsort_run *runs;
+    int run_count;
+    size_t begin;
+    size_t end;
+    int *out;
+};
+
+static int MergeSliceFunc(void *arg) {
+    struct merge_slice *slice = arg;
+    int count = slice->run_count;
+    size_t *begins = malloc(count * sizeof(size_t));
+    size_t *ends = malloc(count * sizeof(size_t));
+    struct numsort_run *parts = malloc(count * sizeof(struct numsort_run));
+    if (begins == NULL || ends == NULL || parts == NULL) {
+        free(begins);
+        free(ends);
+        free(parts);
+        return 1;
+    }
+    numsort_split(slice->runs, count, slice->begin, begins);
+    numsort_split(slice->runs, count, slice->end, ends);
+    for (int i = 0; i < count; i++) {
+        parts[i].data = slice->runs[i].data + begins[i];
+        parts[i].size = ends[i] - begins[i];
+    }
+    struct numsort merger;
+    numsort_create(&merger, SortYield, NULL);
+    int rc = numsort_merge(&merger, parts, count, slice->out + slice->begin);
+    numsort_destroy(&merger);
+    free(begins);
+    free(ends);
+    free(parts);
+    return rc == 0 ? 0 : 1;
+}
 
-        struct my_context *new_context = (struct my_context *)malloc(sizeof(struct my_context));
+// Merges the runs into out. With more than one slice, each slice of
+// the result has an equal size and is merged by a coroutine, so all
+// the worker threads merge at once.
+static int MergeRuns(const struct numsort_run *runs, int run_count,
+                     size_t size, int *out, int slice_count) {
+    if (slice_count == 1) {
+        struct numsort merger;
+        numsort_create(&merger, NULL, NULL);
+        int rc = numsort_merge(&merger, runs, run_count, out);
+        numsort_destroy(&merger);
+        return rc;
+    }
+    struct merge_slice *slices =
+        malloc(slice_count * sizeof(struct merge_slice));
+    if (slices == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < slice_count; i++) {
+        slices[i].runs = runs;
+        slices[i].run_count = run_count;
+        slices[i].begin = size * i / slice_count;
+        slices[i].end = size * (i + 1) / slice_count;
+        slices[i].out = out;
+    }
+    int rc = 0;
+    for (int i = 0; i < slice_count; i++) {
+        if (coro_new(MergeSliceFunc, &slices[i]) == NULL) {
+            rc = -1;
+            break;
+        }
+    }
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        if (coro_status(c) != 0) {
+            rc = -1;
+        }
+        coro_delete(c);
+    }
+    free(slices);
+    return rc;
+}
 
-        new_context->numsVector = resultVector;
-        new_context->size = new_size;
-        new_contexts[i/2 + (i%2)] = new_context;
+// Sorts the files in a memory budget, see extsort.h. No coroutines:
+// the work is mostly reading and writing files.
+static int ExternalSort(char **paths, int count, size_t memory) {
+    const char *tmp_dir = getenv("TMPDIR");
+    if (tmp_dir == NULL) {
+        tmp_dir = "/tmp";
     }
-    if ((size % 2))
-    {
-        new_contexts[size / 2] = contexts[size - 1];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct extsort_stats stats;
+    if (extsort_sort((const char *const *)paths, count, "result.txt",
+                     tmp_dir, memory, &stats) != 0) {
+        printf("Error: external sort failed: %s\n", strerror(errno));
+        return 1;
     }
-    MergeSortedArrays(new_contexts, (size / 2 + (size % 2)));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long int time_usec = (end.tv_sec - start.tv_sec) * 1000000LL +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("%lld numbers have been sorted in %lld us\n", stats.numbers,
+           time_usec);
+    printf("External sort: %d runs, %d passes, %lld bytes read, "
+           "%lld bytes written\n", stats.runs, stats.passes,
+           stats.bytes_read, stats.bytes_written);
+    return 0;
 }
 
 // The following code assumes valid input only.
 // EX: ./a.out test1.txt test2.txt test3.txt test4.txt
+// Binary files made by numconv are loaded without parsing:
+// EX: ./a.out test1.bin test2.bin
+// With a target latency T in microseconds, each of N coroutines
+// yields only after its T / N quantum is over:
+// EX: ./a.out 1000 test1.txt test2.txt test3.txt test4.txt
+// With a coroutine count K after T, a pool of K coroutines sorts
+// the files, each one taking the next file when done with its own.
+// By default there is a coroutine per file:
+// EX: ./a.out 1000 2 test1.txt test2.txt test3.txt test4.txt
+// NUMSORT=radix|intro|auto picks the sort of the files, auto by
+// default: introsort for small files, radix sort for the others.
+// SORT_PIPELINE=1 loads the next files while the others are sorted,
+// and writes the result while it is merged, see struct pipeline:
+// EX: SORT_PIPELINE=1 ./a.out test1.txt test2.txt
+// SORT_THREADS=N runs the coroutines on N worker threads. Big files
+// are then cut into chunks sorted in parallel, and the merge is cut
+// into N slices of the result, merged in parallel:
+// EX: SORT_THREADS=8 ./a.out 1000 2 test1.txt test2.txt
+// EXTSORT_MEMORY=M sorts the files in M megabytes of memory, with
+// the runs spilled to $TMPDIR (/tmp by default), without coroutines:
+// EX: EXTSORT_MEMORY=64 ./a.out huge1.txt huge2.bin
 int main(int argc, char **argv)
 {
-	coro_sched_init();
-    struct my_context** contexts = malloc( (argc - 1) * sizeof(struct my_context*));
-    int lst = 0;
-	/* Start several coroutines. */
-    /* Each file should be sorted in its own coroutine*/
-	for (int i = 1; i < argc; ++i) {
-		char name[16];
-		sprintf(name, argv[i]);
-        contexts[lst++] = my_context_new(name);
-        coro_new(coroutine_func_f, contexts[lst-1]);
+    enum numsort_algo sort_algo = NUMSORT_AUTO;
+    const char *sort_name = getenv("NUMSORT");
+    if (sort_name != NULL) {
+        sort_algo = numsort_algo_by_name(sort_name);
+        if (sort_algo == NUMSORT_ALGO_COUNT) {
+            printf("Unknown NUMSORT=%s\n", sort_name);
+            return 1;
+        }
+    }
+    long long int latency_usec = 0;
+    if (argc > 1 && IsNumber(argv[1])) {
+        latency_usec = atoll(argv[1]);
+        argv++;
+        argc--;
+    }
+    int file_count = argc - 1;
+    int coro_count = file_count;
+    if (argc > 1 && IsNumber(argv[1])) {
+        coro_count = atoi(argv[1]);
+        argv++;
+        argc--;
+        file_count--;
+    }
+    if (coro_count < 1) {
+        coro_count = 1;
+    }
+    long long int quantum_usec = latency_usec / coro_count;
+    const char *memory_mb = getenv("EXTSORT_MEMORY");
+    if (memory_mb != NULL) {
+        return ExternalSort(argv + 1, file_count,
+                            (size_t)atoll(memory_mb) << 20);
+    }
+
+    struct timespec wall_start;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    int thread_count = 1;
+    const char *threads = getenv("SORT_THREADS");
+    if (threads != NULL && atoi(threads) > 1) {
+        thread_count = atoi(threads);
+    }
+
+    // All that lives through the run comes from one arena, sized up
+    // front by the file sizes: the files with their names and number
+    // buffers, the coroutine contexts, and the result region.
+    long long int *file_bytes = malloc(file_count * sizeof(long long int));
+    if (file_bytes == NULL && file_count > 0) {
+        printf("Error: MEMORY ALLOCATION FAILED\n");
+        return 1;
+    }
+    size_t capacity_total = 0;
+    size_t arena_size =
+        arena_size_of(file_count * sizeof(struct file_context*)) +
+        arena_size_of(coro_count * sizeof(struct my_context*)) +
+        coro_count * arena_size_of(sizeof(struct my_context));
+    for (int i = 0; i < file_count; ++i) {
+        struct stat st;
+        file_bytes[i] = stat(argv[i + 1], &st) == 0 ? st.st_size : 0;
+        capacity_total += numio_text_capacity(file_bytes[i]);
+        arena_size += FileArenaSize(argv[i + 1], file_bytes[i]);
+    }
+    arena_size += arena_size_of(capacity_total * sizeof(int));
+    struct arena arena;
+    if (arena_create(&arena, arena_size) != 0) {
+        printf("Error: MEMORY ALLOCATION FAILED\n");
+        return 1;
+    }
+
+    struct work_list work;
+    work.files = arena_alloc(&arena, file_count * sizeof(struct file_context*));
+    if (work.files == NULL) {
+        printf("Error: MEMORY ALLOCATION FAILED\n");
+        return 1;
+    }
+    work.count = file_count;
+    work.next = 0;
+    work.total_bytes = 0;
+    work.thread_count = thread_count;
+    for (int i = 0; i < file_count; ++i) {
+        work.files[i] = file_context_new(&arena, argv[i + 1], file_bytes[i]);
+        if (work.files[i] == NULL) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
+        work.total_bytes += work.files[i]->bytes;
+    }
+    free(file_bytes);
+    work.scratch = arena_alloc(&arena, capacity_total * sizeof(int));
+    work.scratch_capacity = work.scratch != NULL ? capacity_total : 0;
+    work.scratch_used = 0;
+
+    if (threads != NULL) {
+        coro_sched_init_mt(thread_count);
+    } else {
+        coro_sched_init();
+    }
+    // CORO_TRACE=trace.bin records the scheduler events, see trace_dump.c.
+    const char *trace_path = getenv("CORO_TRACE");
+    if (trace_path != NULL) {
+        coro_trace_start(1 << 20);
+    }
+    struct pipeline *pipeline = NULL;
+    if (getenv("SORT_PIPELINE") != NULL) {
+        // A loader per worker thread, to parse as fast as they sort.
+        pipeline = pipeline_new(&work, coro_count, thread_count);
+        if (pipeline == NULL && errno == ENOMEM) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
+        if (pipeline == NULL) {
+            printf("Could not write the result: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    struct my_context** contexts =
+        arena_alloc(&arena, coro_count * sizeof(struct my_context*));
+    if (contexts == NULL) {
+        printf("Error: MEMORY ALLOCATION FAILED\n");
+        return 1;
+    }
+	/* Start the pool. */
+	for (int i = 0; i < coro_count; ++i) {
+        contexts[i] = my_context_new(&arena, i, &work, pipeline,
+                                     quantum_usec, sort_algo);
+        if (contexts[i] == NULL) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
+        if (coro_new(coroutine_func_f, contexts[i]) == NULL) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
 	}
+    if (pipeline != NULL && pipeline_start(pipeline) != 0) {
+        printf("Error: MEMORY ALLOCATION FAILED\n");
+        return 1;
+    }
     /* Wait for all the coroutines to end. */
+    // A coroutine fails when a file could not be loaded: the others are
+    // sorted anyway, but the exit status tells about it.
+    int exit_status = 0;
 	struct coro *c;
 	while ((c = coro_sched_wait()) != NULL) {
 		printf("Finished %d\n", coro_status(c));
+        if (coro_status(c) != 0) {
+            exit_status = 1;
+        }
 		coro_delete(c);
 	}
 	/* All coroutines have finished. */
+    if (trace_path != NULL) {
+        coro_trace_stop();
+        if (coro_trace_save(trace_path) != 0) {
+            perror(trace_path);
+        } else {
+            printf("Trace saved to %s\n", trace_path);
+        }
+    }
 
 	/* MERGING OF THE SORTED ARRAYS */
 
     int size = 0;
-    for(int i = 0; i < argc - 1; i ++){
-        size += *contexts[i]->size;
+    for(int i = 0; i < file_count; i ++){
+        size += work.files[i]->size;
     }
     printf("%d numbers have been sorted\n", size);
-    int* resultVector = (int*) malloc(size * sizeof(int));
-    resultVector = MergeSortedArrays(contexts, (argc - 1));
+    // One pass over all the files, straight into the result. The
+    // pipeline has merged and written it already.
+    int* resultVector = NULL;
+    bool is_result_allocated = false;
+    if (pipeline == NULL) {
+        int run_count;
+        struct numsort_run *runs = CollectRuns(&work, &run_count);
+        struct timespec merge_start, merge_end;
+        clock_gettime(CLOCK_MONOTONIC, &merge_start);
+        // The scratch of the sorts is free now, and has room - unless
+        // the files have grown since they were stat'ed.
+        resultVector = work.scratch;
+        if ((size_t)size > work.scratch_capacity) {
+            resultVector = malloc(size * sizeof(int));
+            is_result_allocated = true;
+        }
+        if (runs == NULL || resultVector == NULL ||
+            MergeRuns(runs, run_count, size, resultVector,
+                      thread_count) != 0) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &merge_end);
+        free(runs);
+        long long int merge_time_nsec =
+            (merge_end.tv_sec - merge_start.tv_sec) * 1000000000LL +
+            merge_end.tv_nsec - merge_start.tv_nsec;
+        printf("Merge: %d runs on %d threads in %lld us\n", run_count,
+               thread_count, merge_time_nsec / 1000);
+    }
+    coro_sched_destroy();
 
     long long int total_work_time_nsec = 0;
     long long int total_context_switches = 0;
 
-    for (int i = 0; i < argc - 1; i++) {
-        total_work_time_nsec += contexts[i]->total_work_time_nsec;
-        total_context_switches += contexts[i]->context_switch_count;
+    for (int i = 0; i < coro_count; i++) {
+        struct my_context *ctx = contexts[i];
+        double throughput = ctx->work_time_nsec > 0 ?
+            ctx->numbers_sorted * 1e9 / ctx->work_time_nsec : 0;
+        printf("coroutine %d: %d files, %lld numbers, work time %lld us, "
+               "wait time %lld us, context switches %lld, "
+               "%.0f numbers/s\n", ctx->id, ctx->files_sorted,
+               ctx->numbers_sorted, ctx->work_time_nsec / 1000,
+               ctx->wait_time_nsec / 1000, ctx->context_switch_count,
+               throughput);
+        total_work_time_nsec += ctx->work_time_nsec;
+        total_context_switches += ctx->context_switch_count;
+        my_context_delete(ctx);
     }
 
-    // Rest of my_context_delete
-    for(int i = 0; i < argc - 1; i ++){
-        free(contexts[i]->size);
-        free(contexts[i]->numsVector);
-	    free(contexts[i]);
+    long long int output_time_nsec;
+    long long int output_bytes;
+    if (pipeline == NULL) {
+        // Formatted into a big buffer and written by a few write() calls.
+        struct timespec output_start, output_end;
+        clock_gettime(CLOCK_MONOTONIC, &output_start);
+        if (numio_save_text("result.txt", resultVector, size) != 0) {
+            printf("Could not write the result: %s\n", strerror(errno));
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &output_end);
+        output_time_nsec =
+            (output_end.tv_sec - output_start.tv_sec) * 1000000000LL +
+            output_end.tv_nsec - output_start.tv_nsec;
+        struct stat output_stat;
+        output_bytes = stat("result.txt", &output_stat) == 0 ?
+            output_stat.st_size : 0;
+    } else {
+        // The time of the writes, overlapped with the merge.
+        output_time_nsec = pipeline->write_time_nsec;
+        output_bytes = pipeline->writer.bytes;
+        bool is_merged = pipeline->merged == size;
+        if (pipeline_delete(pipeline) != 0) {
+            printf("Could not write the result: %s\n", strerror(errno));
+            return 1;
+        }
+        if (!is_merged) {
+            printf("Error: MEMORY ALLOCATION FAILED\n");
+            return 1;
+        }
     }
 
-    FILE * output_file = fopen("result.txt", "w");
-    if (output_file == NULL) {
-        printf("Could not open the file for writing.\n");
-        return 1;
+    for (int i = 0; i < file_count; i++) {
+        file_context_delete(work.files[i]);
     }
-
-    for (int i = 0; i < size; i++) {
-        fprintf(output_file, "%d", resultVector[i]);
-
-        if (i < size - 1) {
-            fprintf(output_file, " ");
-        } else {
-            fprintf(output_file, "\n");
-        }
+    if (is_result_allocated) {
+        free(resultVector);
     }
-
-    fclose(output_file);
+    arena_destroy(&arena);
 
     printf("Total Work Time (ns): %lld\n", total_work_time_nsec);
     printf("Context Switches: %lld\n", total_context_switches);
-
-	return 0;
+    printf("Output: %lld bytes in %lld us, %.1f MB/s\n", output_bytes,
+           output_time_nsec / 1000, output_time_nsec > 0 ?
+           output_bytes * 1e3 / output_time_nsec : 0);
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    printf("Wall time: %lld us\n",
+           (wall_end.tv_sec - wall_start.tv_sec) * 1000000LL +
+           (wall_end.tv_nsec - wall_start.tv_nsec) / 1000);
+
+	return exit_status;
 }
\ No newline at end of file
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "numio.h"
+#include "numsort.h"
+
+/**
+ * Throughput of the sort tool, a.out, on generated datasets with each
+ * of its engines. Every dataset is generated from the seed, so the
+ * same options give the same files. Each engine sorts each dataset a
+ * few times, and its result.txt is checked against the numbers sorted
+ * here. One CSV line per dataset and engine goes to stdout:
+ *
+ *     $> make && make sortbench
+ *     $> ./sortbench > base.csv
+ *     $> ./sortbench -n 16000000 -f 32 -r 9 zipf radix intro
+ *
+ * Only the datasets and the engines named in the command line are
+ * run, all of them if none is named. Options:
+ *
+ *     -n <count>   Numbers in all the files of a dataset.
+ *     -f <count>   Files of a dataset.
+ *     -r <count>   Runs of each engine on each dataset.
+ *     -s <seed>    Seed of the generator.
+ *     -t <count>   SORT_THREADS of the "threads" engine.
+ *     -m <MB>      EXTSORT_MEMORY of the "extsort" engine.
+ *     -b <path>    The sort tool, ./a.out by default.
+ *     -d <dir>     Where to keep the datasets, a temporary directory
+ *                  removed at the end by default.
+ *     -B           Binary files instead of text, see numconv.c.
+ */
+
+enum {
+	SORTBENCH_COUNT = 1 << 22,
+	SORTBENCH_FILES = 8,
+	SORTBENCH_RUNS = 5,
+	SORTBENCH_THREADS = 4,
+	/** Below the 16 MB of the default count, so the runs spill. */
+	SORTBENCH_MEMORY_MB = 8,
+	/** Distinct numbers of the "few_unique" dataset. */
+	SORTBENCH_UNIQUE = 16,
+	/** Distinct numbers of the "zipf" dataset, the first is the most
+	 * frequent, the k-th is k times rarer. */
+	SORTBENCH_ZIPF_RANKS = 1 << 16,
+};
+
+static long long
+sortbench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** splitmix64: the same numbers on every platform and libc. */
+static uint64_t
+sortbench_rand(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/** State of the generator of one dataset. */
+struct sortbench_gen {
+	uint64_t rng;
+	int unique[SORTBENCH_UNIQUE];
+	/** Share of the first k + 1 ranks of the Zipf distribution. */
+	double *zipf_cdf;
+	/** Mixed with a rank to make its number. */
+	uint64_t zipf_salt;
+};
+
+typedef void (*sortbench_gen_f)(struct sortbench_gen *g, int *data,
+				size_t size);
+
+static void
+sortbench_gen_uniform(struct sortbench_gen *g, int *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (int)(uint32_t)sortbench_rand(&g->rng);
+}
+
+/** Each file is sorted, the files overlap. */
+static void
+sortbench_gen_sorted(struct sortbench_gen *g, int *data, size_t size)
+{
+	sortbench_gen_uniform(g, data, size);
+	struct numsort s;
+	numsort_create(&s, NULL, NULL);
+	numsort_sort(&s, data, size, NUMSORT_AUTO);
+	numsort_destroy(&s);
+}
+
+static void
+sortbench_gen_reverse(struct sortbench_gen *g, int *data, size_t size)
+{
+	sortbench_gen_sorted(g, data, size);
+	for (size_t i = 0, j = size; i + 1 < j; ++i, --j) {
+		int tmp = data[i];
+		data[i] = data[j - 1];
+		data[j - 1] = tmp;
+	}
+}
+
+static void
+sortbench_gen_few_unique(struct sortbench_gen *g, int *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		data[i] = g->unique[sortbench_rand(&g->rng) % SORTBENCH_UNIQUE];
+}
+
+/** By the inverse of the distribution, with a binary search. */
+static void
+sortbench_gen_zipf(struct sortbench_gen *g, int *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		double u = (sortbench_rand(&g->rng) >> 11) * 0x1p-53;
+		size_t lo = 0, hi = SORTBENCH_ZIPF_RANKS - 1;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (g->zipf_cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		uint64_t state = g->zipf_salt ^ lo;
+		data[i] = (int)(uint32_t)sortbench_rand(&state);
+	}
+}
+
+static const struct sortbench_dataset {
+	const char *name;
+	sortbench_gen_f gen;
+} datasets[] = {
+	{"uniform", sortbench_gen_uniform},
+	{"sorted", sortbench_gen_sorted},
+	{"reverse", sortbench_gen_reverse},
+	{"few_unique", sortbench_gen_few_unique},
+	{"zipf", sortbench_gen_zipf},
+};
+
+/** An engine of a.out, picked by an environment variable. */
+struct sortbench_engine {
+	const char *name;
+	/** NULL for the default engine. */
+	const char *env;
+	const char *value;
+};
+
+/** The values of the options are filled in by main(). */
+static char sortbench_threads_value[16];
+static char sortbench_memory_value[16];
+
+static const struct sortbench_engine engines[] = {
+	{"default", NULL, NULL},
+	{"radix", "NUMSORT", "radix"},
+	{"intro", "NUMSORT", "intro"},
+	{"pipeline", "SORT_PIPELINE", "1"},
+	{"threads", "SORT_THREADS", sortbench_threads_value},
+	{"extsort", "EXTSORT_MEMORY", sortbench_memory_value},
+};
+
+/** The variables of all the engines are cleared before each run. */
+static const char *const sortbench_env_names[] = {
+	"NUMSORT", "SORT_PIPELINE", "SORT_THREADS", "EXTSORT_MEMORY",
+	"CORO_TRACE",
+};
+
+struct sortbench {
+	/** Absolute path of a.out. */
+	char binary[PATH_MAX];
+	char dir[PATH_MAX];
+	bool is_dir_temporary;
+	bool is_binary;
+	size_t count;
+	int file_count;
+	int run_count;
+	uint64_t seed;
+	/** Arguments of a.out: itself and the file names, relative to
+	 * the directory. */
+	char **argv;
+	/** All the numbers of the current dataset, sorted. */
+	int *expected;
+};
+
+static const char *
+sortbench_file_name(const struct sortbench *b, int i, char *buf,
+		    size_t size)
+{
+	snprintf(buf, size, "f%d.%s", i, b->is_binary ? "bin" : "txt");
+	return buf;
+}
+
+/**
+ * Write the files of the dataset into the directory, and keep all of
+ * their numbers sorted in b->expected.
+ * @retval 0 Success.
+ * @retval -1 Error, see errno.
+ */
+static int
+sortbench_generate(struct sortbench *b, int dataset)
+{
+	struct sortbench_gen g;
+	g.rng = b->seed * 0x100000001b3ULL + dataset;
+	for (int i = 0; i < SORTBENCH_UNIQUE; ++i)
+		g.unique[i] = (int)(uint32_t)sortbench_rand(&g.rng);
+	g.zipf_salt = sortbench_rand(&g.rng);
+	g.zipf_cdf = malloc(SORTBENCH_ZIPF_RANKS * sizeof(double));
+	if (g.zipf_cdf == NULL)
+		return -1;
+	double sum = 0;
+	for (int i = 0; i < SORTBENCH_ZIPF_RANKS; ++i) {
+		sum += 1.0 / (i + 1);
+		g.zipf_cdf[i] = sum;
+	}
+	for (int i = 0; i < SORTBENCH_ZIPF_RANKS; ++i)
+		g.zipf_cdf[i] /= sum;
+
+	int rc = 0;
+	size_t pos = 0;
+	for (int i = 0; i < b->file_count && rc == 0; ++i) {
+		size_t size = b->count / b->file_count +
+			      ((size_t)i < b->count % b->file_count);
+		int *data = b->expected + pos;
+		datasets[dataset].gen(&g, data, size);
+		pos += size;
+		char path[PATH_MAX + 32];
+		snprintf(path, sizeof(path), "%s/%s", b->dir, b->argv[i + 1]);
+		rc = b->is_binary ? numio_save_binary(path, data, size) :
+		     numio_save_text(path, data, size);
+	}
+	free(g.zipf_cdf);
+	if (rc != 0)
+		return -1;
+	struct numsort s;
+	numsort_create(&s, NULL, NULL);
+	numsort_sort(&s, b->expected, b->count, NUMSORT_AUTO);
+	numsort_destroy(&s);
+	return 0;
+}
+
+/**
+ * Run a.out once in the directory, with its output in sort.log.
+ * @retval 0 Success, it exited with 0.
+ * @retval -1 It failed, the reason is printed.
+ */
+static int
+sortbench_run(const struct sortbench *b, const struct sortbench_engine *e,
+	      long long *time_ns, long *max_rss_kb)
+{
+	long long start = sortbench_now_ns();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int fd = chdir(b->dir) == 0 ?
+			 open("sort.log", O_WRONLY | O_CREAT | O_TRUNC, 0644) :
+			 -1;
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+			perror(b->dir);
+			_exit(127);
+		}
+		int name_count = sizeof(sortbench_env_names) /
+				 sizeof(sortbench_env_names[0]);
+		for (int i = 0; i < name_count; ++i)
+			unsetenv(sortbench_env_names[i]);
+		if (e->env != NULL)
+			setenv(e->env, e->value, 1);
+		execv(b->binary, b->argv);
+		perror(b->binary);
+		_exit(127);
+	}
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		perror("wait4");
+		return -1;
+	}
+	*time_ns = sortbench_now_ns() - start;
+	*max_rss_kb = usage.ru_maxrss;
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "%s: the sort was killed by signal %d, "
+			"see %s/sort.log\n", e->name, WTERMSIG(status), b->dir);
+		return -1;
+	}
+	if (WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: the sort exited with %d, see %s/sort.log\n",
+			e->name, WEXITSTATUS(status), b->dir);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Compare the result of a run with the sorted numbers.
+ * @retval 0 The same.
+ * @retval -1 Not the same, or can not be read, the reason is printed.
+ */
+static int
+sortbench_verify(const struct sortbench *b, const struct sortbench_engine *e)
+{
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/result.txt", b->dir);
+	struct numio_array arr;
+	if (numio_load(path, &arr) != 0) {
+		perror(path);
+		return -1;
+	}
+	int rc = 0;
+	if (arr.size != b->count) {
+		fprintf(stderr, "%s: %zu numbers in %s instead of %zu\n",
+			e->name, arr.size, path, b->count);
+		rc = -1;
+	} else {
+		for (size_t i = 0; i < arr.size; ++i) {
+			if (arr.data[i] != b->expected[i]) {
+				fprintf(stderr, "%s: %s has %d at %zu instead "
+					"of %d\n", e->name, path, arr.data[i],
+					i, b->expected[i]);
+				rc = -1;
+				break;
+			}
+		}
+	}
+	numio_array_destroy(&arr);
+	return rc;
+}
+
+static int
+sortbench_time_cmp(const void *a, const void *b)
+{
+	long long l = *(const long long *)a, r = *(const long long *)b;
+	return l < r ? -1 : l > r;
+}
+
+/**
+ * All the runs of an engine on the generated dataset, and their CSV
+ * line. A failed or wrong run stops the engine.
+ */
+static int
+sortbench_engine_run(const struct sortbench *b, int dataset,
+		     const struct sortbench_engine *e)
+{
+	long long *times = malloc(b->run_count * sizeof(*times));
+	if (times == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	long max_rss_kb = 0;
+	for (int i = 0; i < b->run_count; ++i) {
+		long rss_kb;
+		if (sortbench_run(b, e, &times[i], &rss_kb) != 0 ||
+		    sortbench_verify(b, e) != 0) {
+			fprintf(stderr, "%s: %s failed\n",
+				datasets[dataset].name, e->name);
+			free(times);
+			return -1;
+		}
+		if (rss_kb > max_rss_kb)
+			max_rss_kb = rss_kb;
+	}
+	qsort(times, b->run_count, sizeof(*times), sortbench_time_cmp);
+	int n = b->run_count;
+	long long median = n % 2 != 0 ? times[n / 2] :
+			   (times[n / 2 - 1] + times[n / 2]) / 2;
+	printf("%s,%s,%d,%zu,%d,%.3f,%.3f,%.3f,%.0f,%ld\n",
+	       datasets[dataset].name, e->name, b->file_count, b->count, n,
+	       times[0] / 1e6, median / 1e6, times[n - 1] / 1e6,
+	       median > 0 ? b->count * 1e9 / median : 0, max_rss_kb);
+	fflush(stdout);
+	free(times);
+	return 0;
+}
+
+/** Remove the temporary directory with all in it. */
+static void
+sortbench_cleanup(const struct sortbench *b)
+{
+	char path[PATH_MAX + 32];
+	for (int i = 0; i < b->file_count; ++i) {
+		snprintf(path, sizeof(path), "%s/%s", b->dir, b->argv[i + 1]);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/result.txt", b->dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/sort.log", b->dir);
+	unlink(path);
+	rmdir(b->dir);
+}
+
+static bool
+sortbench_is_selected(const char *name, char **names, int count,
+		      bool is_any)
+{
+	if (!is_any)
+		return true;
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(names[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+sortbench_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n count] [-f files] [-r runs] "
+		"[-s seed] [-t threads] [-m MB] [-b a.out] [-d dir] [-B] "
+		"[dataset|engine ...]\n", prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sortbench b;
+	memset(&b, 0, sizeof(b));
+	b.count = SORTBENCH_COUNT;
+	b.file_count = SORTBENCH_FILES;
+	b.run_count = SORTBENCH_RUNS;
+	b.seed = 1;
+	const char *binary = "./a.out";
+	const char *dir = NULL;
+	int thread_count = SORTBENCH_THREADS;
+	int memory_mb = SORTBENCH_MEMORY_MB;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:f:r:s:t:m:b:d:B")) != -1) {
+		switch (opt) {
+		case 'n': b.count = strtoull(optarg, NULL, 10); break;
+		case 'f': b.file_count = atoi(optarg); break;
+		case 'r': b.run_count = atoi(optarg); break;
+		case 's': b.seed = strtoull(optarg, NULL, 10); break;
+		case 't': thread_count = atoi(optarg); break;
+		case 'm': memory_mb = atoi(optarg); break;
+		case 'b': binary = optarg; break;
+		case 'd': dir = optarg; break;
+		case 'B': b.is_binary = true; break;
+		default:
+			sortbench_usage(argv[0]);
+			return 1;
+		}
+	}
+	/* a.out keeps the count of numbers in an int. */
+	if (b.count < 1 || b.count > INT_MAX || b.file_count < 1 ||
+	    b.run_count < 1 || thread_count < 1 || memory_mb < 1) {
+		sortbench_usage(argv[0]);
+		return 1;
+	}
+	snprintf(sortbench_threads_value, sizeof(sortbench_threads_value),
+		 "%d", thread_count);
+	snprintf(sortbench_memory_value, sizeof(sortbench_memory_value),
+		 "%d", memory_mb);
+	if (realpath(binary, b.binary) == NULL) {
+		perror(binary);
+		return 1;
+	}
+	if (dir == NULL) {
+		const char *tmp_dir = getenv("TMPDIR");
+		snprintf(b.dir, sizeof(b.dir), "%s/sortbench.XXXXXX",
+			 tmp_dir != NULL ? tmp_dir : "/tmp");
+		b.is_dir_temporary = true;
+		if (mkdtemp(b.dir) == NULL) {
+			perror(b.dir);
+			return 1;
+		}
+	} else {
+		snprintf(b.dir, sizeof(b.dir), "%s", dir);
+		if (mkdir(b.dir, 0755) != 0 && errno != EEXIST) {
+			perror(b.dir);
+			return 1;
+		}
+	}
+
+	b.argv = calloc(b.file_count + 2, sizeof(char *));
+	b.expected = malloc(b.count * sizeof(int));
+	if (b.argv == NULL || b.expected == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	b.argv[0] = b.binary;
+	for (int i = 0; i < b.file_count; ++i) {
+		char name[32];
+		b.argv[i + 1] = strdup(sortbench_file_name(&b, i, name,
+							   sizeof(name)));
+		if (b.argv[i + 1] == NULL) {
+			perror("malloc");
+			return 1;
+		}
+	}
+
+	char **names = argv + optind;
+	int name_count = argc - optind;
+	int dataset_count = sizeof(datasets) / sizeof(datasets[0]);
+	int engine_count = sizeof(engines) / sizeof(engines[0]);
+	bool is_any_dataset = false;
+	bool is_any_engine = false;
+	for (int i = 0; i < name_count; ++i) {
+		bool is_known = false;
+		for (int j = 0; j < dataset_count; ++j) {
+			if (strcmp(names[i], datasets[j].name) == 0)
+				is_known = is_any_dataset = true;
+		}
+		for (int j = 0; j < engine_count; ++j) {
+			if (strcmp(names[i], engines[j].name) == 0)
+				is_known = is_any_engine = true;
+		}
+		if (!is_known) {
+			fprintf(stderr, "Unknown dataset or engine %s\n",
+				names[i]);
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "%zu numbers in %d %s files, %d runs, seed %llu, "
+		"%s in %s\n", b.count, b.file_count,
+		b.is_binary ? "binary" : "text", b.run_count,
+		(unsigned long long)b.seed, b.binary, b.dir);
+	printf("dataset,engine,files,numbers,runs,min_ms,median_ms,max_ms,"
+	       "numbers_per_s,max_rss_kb\n");
+	int failed = 0;
+	for (int i = 0; i < dataset_count; ++i) {
+		if (!sortbench_is_selected(datasets[i].name, names, name_count,
+					   is_any_dataset))
+			continue;
+		if (sortbench_generate(&b, i) != 0) {
+			perror(datasets[i].name);
+			failed = 1;
+			break;
+		}
+		for (int j = 0; j < engine_count; ++j) {
+			if (sortbench_is_selected(engines[j].name, names,
+						  name_count, is_any_engine) &&
+			    sortbench_engine_run(&b, i, &engines[j]) != 0)
+				failed = 1;
+		}
+	}
+	/* The files of a failed run are kept to look into. */
+	if (b.is_dir_temporary && !failed)
+		sortbench_cleanup(&b);
+	for (int i = 0; i < b.file_count; ++i)
+		free(b.argv[i + 1]);
+	free(b.argv);
+	free(b.expected);
+	return failed;
+}
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libcoro_trace.h"
+
+/**
+ * Convert a trace saved by coro_trace_save() into Chrome trace JSON
+ * or folded stacks:
+ *
+ *     $> ./trace_dump json trace.bin > trace.json
+ *     $> ./trace_dump folded trace.bin | flamegraph.pl > trace.svg
+ *
+ * JSON has a slice per coroutine run on each thread, plus instant
+ * events for creation and I/O parking. Folded stacks sum up, in
+ * nanoseconds, how long each coroutine ran on each thread, and how
+ * long it waited after a yield, a suspend or an I/O park.
+ */
+
+struct event {
+	struct coro_trace_event e;
+	/** Position in the file, keeps the sort stable. */
+	size_t pos;
+};
+
+static int
+event_cmp(const void *a, const void *b)
+{
+	const struct event *l = a, *r = b;
+	if (l->e.thread != r->e.thread)
+		return l->e.thread < r->e.thread ? -1 : 1;
+	if (l->e.time != r->e.time)
+		return l->e.time < r->e.time ? -1 : 1;
+	return l->pos < r->pos ? -1 : l->pos > r->pos;
+}
+
+/** Read the events and sort them by thread, then by time. */
+static struct event *
+trace_load(const char *path, size_t *count)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	struct coro_trace_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, CORO_TRACE_MAGIC,
+		   sizeof(header.magic)) != 0 ||
+	    header.version != CORO_TRACE_VERSION ||
+	    header.event_size != sizeof(struct coro_trace_event)) {
+		fprintf(stderr, "%s: not a coroutine trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+	size_t capacity = 1024;
+	size_t size = 0;
+	struct event *events = malloc(capacity * sizeof(*events));
+	while (events != NULL) {
+		if (size == capacity) {
+			capacity *= 2;
+			struct event *tmp =
+				realloc(events, capacity * sizeof(*events));
+			if (tmp == NULL) {
+				free(events);
+				events = NULL;
+				break;
+			}
+			events = tmp;
+		}
+		if (fread(&events[size].e, sizeof(events[size].e), 1, f) != 1)
+			break;
+		events[size].pos = size;
+		++size;
+	}
+	fclose(f);
+	if (events == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+	qsort(events, size, sizeof(*events), event_cmp);
+	*count = size;
+	return events;
+}
+
+static const char *
+out_reason(const struct coro_trace_event *e)
+{
+	if (e->type == CORO_TRACE_FINISH)
+		return "finish";
+	return e->arg == CORO_TRACE_OUT_YIELD ? "yield" : "suspend";
+}
+
+static void
+dump_json(const struct event *events, size_t count)
+{
+	int64_t base = count > 0 ? events[0].e.time : 0;
+	for (size_t i = 1; i < count; ++i) {
+		if (events[i].e.time < base)
+			base = events[i].e.time;
+	}
+	printf("{\"traceEvents\":[\n");
+	const char *sep = "";
+	/* The run started by the last switch-in on the current thread. */
+	const struct coro_trace_event *in = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		const struct coro_trace_event *e = &events[i].e;
+		if (in != NULL && in->thread != e->thread)
+			in = NULL;
+		double ts = (e->time - base) / 1000.0;
+		switch (e->type) {
+		case CORO_TRACE_SWITCH_IN:
+			in = e;
+			break;
+		case CORO_TRACE_SWITCH_OUT:
+		case CORO_TRACE_FINISH:
+			if (in == NULL || in->coro_id != e->coro_id)
+				break;
+			printf("%s{\"name\":\"coro %llu\",\"cat\":\"run\","
+			       "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			       "\"pid\":0,\"tid\":%u,"
+			       "\"args\":{\"out\":\"%s\"}}", sep,
+			       (unsigned long long)e->coro_id,
+			       (in->time - base) / 1000.0,
+			       (e->time - in->time) / 1000.0, e->thread,
+			       out_reason(e));
+			sep = ",\n";
+			in = NULL;
+			break;
+		case CORO_TRACE_CREATE:
+		case CORO_TRACE_IO_PARK:
+			printf("%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+			       "\"ts\":%.3f,\"pid\":0,\"tid\":%u,"
+			       "\"args\":{\"coro\":%llu,\"fd\":%d}}", sep,
+			       e->type == CORO_TRACE_CREATE ?
+			       "create" : "io park", ts, e->thread,
+			       (unsigned long long)e->coro_id,
+			       e->type == CORO_TRACE_IO_PARK ? e->arg : -1);
+			sep = ",\n";
+			break;
+		}
+	}
+	printf("\n]}\n");
+}
+
+/** One line of the folded output before the summing up. */
+struct sample {
+	/** "run" or the wait reason. */
+	const char *kind;
+	/** The thread for runs. */
+	unsigned thread;
+	uint64_t coro_id;
+	int64_t value;
+};
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	const struct sample *l = a, *r = b;
+	int rc = strcmp(l->kind, r->kind);
+	if (rc != 0)
+		return rc;
+	if (l->thread != r->thread)
+		return l->thread < r->thread ? -1 : 1;
+	if (l->coro_id != r->coro_id)
+		return l->coro_id < r->coro_id ? -1 : 1;
+	return 0;
+}
+
+/** Last switch-out of a coroutine, for its wait time. */
+struct coro_out {
+	uint64_t coro_id;
+	int64_t time;
+	size_t pos;
+	/** Wait reason, NULL for a switch-in. */
+	const char *reason;
+};
+
+static int
+coro_out_cmp(const void *a, const void *b)
+{
+	const struct coro_out *l = a, *r = b;
+	if (l->coro_id != r->coro_id)
+		return l->coro_id < r->coro_id ? -1 : 1;
+	if (l->time != r->time)
+		return l->time < r->time ? -1 : 1;
+	return l->pos < r->pos ? -1 : l->pos > r->pos;
+}
+
+static void
+dump_folded(struct event *events, size_t count)
+{
+	struct sample *samples = malloc((count + 1) * sizeof(*samples));
+	struct coro_out *outs = malloc((count + 1) * sizeof(*outs));
+	if (samples == NULL || outs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		free(samples);
+		free(outs);
+		return;
+	}
+	size_t sample_count = 0;
+	size_t out_count = 0;
+	const struct coro_trace_event *in = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		const struct coro_trace_event *e = &events[i].e;
+		if (in != NULL && in->thread != e->thread)
+			in = NULL;
+		if (e->type == CORO_TRACE_SWITCH_IN) {
+			in = e;
+		} else if ((e->type == CORO_TRACE_SWITCH_OUT ||
+			    e->type == CORO_TRACE_FINISH) && in != NULL &&
+			   in->coro_id == e->coro_id) {
+			struct sample *s = &samples[sample_count++];
+			s->kind = "run";
+			s->thread = e->thread;
+			s->coro_id = e->coro_id;
+			s->value = e->time - in->time;
+			in = NULL;
+		}
+	}
+	/*
+	 * Waits cross threads, so they are matched in the time order
+	 * of each coroutine: an out, an optional I/O park before it,
+	 * and the next in.
+	 */
+	for (size_t i = 0; i < count; ++i) {
+		const struct coro_trace_event *e = &events[i].e;
+		outs[out_count].coro_id = e->coro_id;
+		outs[out_count].time = e->time;
+		outs[out_count].pos = events[i].pos;
+		if (e->type == CORO_TRACE_SWITCH_OUT)
+			outs[out_count].reason = out_reason(e);
+		else if (e->type == CORO_TRACE_IO_PARK)
+			outs[out_count].reason = "io";
+		else if (e->type == CORO_TRACE_SWITCH_IN)
+			outs[out_count].reason = NULL;
+		else
+			continue;
+		++out_count;
+	}
+	qsort(outs, out_count, sizeof(*outs), coro_out_cmp);
+	const struct coro_out *last = NULL;
+	for (size_t i = 0; i < out_count; ++i) {
+		if (last != NULL && last->coro_id != outs[i].coro_id)
+			last = NULL;
+		if (outs[i].reason != NULL) {
+			/* An I/O park is followed by its suspend. */
+			if (last == NULL || strcmp(last->reason, "io") != 0)
+				last = &outs[i];
+			continue;
+		}
+		if (last != NULL) {
+			struct sample *s = &samples[sample_count++];
+			s->kind = last->reason;
+			s->thread = 0;
+			s->coro_id = outs[i].coro_id;
+			s->value = outs[i].time - last->time;
+		}
+		last = NULL;
+	}
+	qsort(samples, sample_count, sizeof(*samples), sample_cmp);
+	for (size_t i = 0; i < sample_count;) {
+		const struct sample *s = &samples[i];
+		int64_t value = 0;
+		for (; i < sample_count && sample_cmp(&samples[i], s) == 0; ++i)
+			value += samples[i].value;
+		if (strcmp(s->kind, "run") == 0)
+			printf("run;thread %u;coro %llu %lld\n", s->thread,
+			       (unsigned long long)s->coro_id,
+			       (long long)value);
+		else
+			printf("wait;coro %llu;%s %lld\n",
+			       (unsigned long long)s->coro_id, s->kind,
+			       (long long)value);
+	}
+	free(samples);
+	free(outs);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3 || (strcmp(argv[1], "json") != 0 &&
+			  strcmp(argv[1], "folded") != 0)) {
+		fprintf(stderr, "Usage: %s json|folded <trace file>\n",
+			argv[0]);
+		return 1;
+	}
+	size_t count = 0;
+	struct event *events = trace_load(argv[2], &count);
+	if (events == NULL)
+		return 1;
+	if (strcmp(argv[1], "json") == 0)
+		dump_json(events, count);
+	else
+		dump_folded(events, count);
+	free(events);
+	return 0;
+}